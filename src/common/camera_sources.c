@@ -0,0 +1,348 @@
+/*
+  camera sources without a device: a synthetic pattern and a raw YUYV
+  recording. Both are paced by a timerfd that stands in for the device fd,
+  so the server polls them exactly as a V4L2 camera
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include "capture_camera_mod.h"
+
+#define SOURCE_DEFAULT_FPS 30
+#define SYNTHETIC_SPEED 4     // pixels the pattern moves at each frame
+
+// first member of the private data of the sources below
+typedef struct paced_t{
+  long period_ns;             // of the timer, between two frames
+} paced_t;
+
+typedef struct synthetic_t{
+  paced_t pace;
+  uint32_t frame;             // frames generated, moves the pattern
+  uint32_t seed;              // noise state
+} synthetic_t;
+
+typedef struct recording_t{
+  paced_t pace;
+  uint8_t* data;              // the whole file, mapped
+  size_t size;
+  size_t frame_bytes;
+  size_t frames;
+  size_t next;                // frame played at the next tick
+} recording_t;
+
+static uint64_t _now_us(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// 0 disarms the timer
+static int _timer_set(int fd, long period_ns){
+  struct itimerspec period = {
+    .it_interval = { .tv_sec = period_ns / 1000000000L, .tv_nsec = period_ns % 1000000000L },
+    .it_value = { .tv_sec = period_ns / 1000000000L, .tv_nsec = period_ns % 1000000000L }
+  };
+  return timerfd_settime(fd, 0, &period, NULL);
+}
+
+static int _timer_open(int fps){
+  int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  if (_timer_set(fd, 1000000000L / fps)){
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static int _paced_set_streaming(camera_t* camera, int on){
+  paced_t* pace = (paced_t*) camera->source_data;
+  return _timer_set(camera->fd, on ? pace->period_ns : 0);
+}
+
+static int _paced_set_fps(camera_t* camera, int fps){
+  paced_t* pace = (paced_t*) camera->source_data;
+  pace->period_ns = 1000000000L / fps;
+  if (camera->streaming && _timer_set(camera->fd, pace->period_ns))
+    return -1;
+  camera->fps = fps;
+  return 0;
+}
+
+// consumes the ticks of the timer, 0 if it has not fired. Late ticks make a single frame
+static int _timer_fired(camera_t* camera){
+  uint64_t expirations;
+  if (read(camera->fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+    return 0;
+  camera->timestamp_us = _now_us();
+  return 1;
+}
+
+static camera_t* _camera_alloc(uint32_t width, uint32_t height, int fps){
+  camera_t* camera = calloc(1, sizeof(camera_t));
+  if (!camera)
+    return NULL;
+  camera->fd = _timer_open(fps);
+  if (camera->fd < 0){
+    free(camera);
+    return NULL;
+  }
+  camera->width = width;
+  camera->height = height;
+  camera->fps = fps;
+  camera->streaming = 1;
+  camera->head_capacity = (size_t) width * height * 2;
+  camera->head.start = malloc(camera->head_capacity);
+  if (!camera->head.start){
+    close(camera->fd);
+    free(camera);
+    errno = ENOMEM;
+    return NULL;
+  }
+  return camera;
+}
+
+// undoes _camera_alloc, for a source that cannot set up its own data
+static void _camera_free(camera_t* camera){
+  close(camera->fd);
+  free(camera->head.start);
+  free(camera);
+  errno = ENOMEM;
+}
+
+static void _source_close(camera_t* camera){
+  close(camera->fd);
+}
+
+/* --- synthetic --- */
+
+// diagonal luma ramps scrolling right, chroma bands scrolling down, and noise
+static void _synthetic_fill(synthetic_t* s, uint8_t* yuyv, uint32_t width, uint32_t height){
+  uint32_t shift = s->frame * SYNTHETIC_SPEED;
+  uint32_t seed = s->seed;
+  for (uint32_t r = 0; r < height; ++r){
+    uint8_t* p = yuyv + (size_t) r * width * 2;
+    uint8_t u = 128 + (((r + shift / 2) & 0xFF) >> 2) - 32;
+    for (uint32_t c = 0; c < width; c += 2, p += 4){
+      seed ^= seed << 13;
+      seed ^= seed >> 17;
+      seed ^= seed << 5;
+      uint8_t luma = (c + r + shift) & 0xFF;
+      p[0] = luma + (seed & 0x0F);
+      p[1] = u;
+      p[2] = luma + ((seed >> 4) & 0x0F);
+      p[3] = 128 + ((((c + shift) * 255 / width) & 0xFF) >> 2) - 32;
+    }
+  }
+  s->seed = seed;
+  ++s->frame;
+}
+
+static size_t _synthetic_capture_into(camera_t* camera, uint8_t* dest, size_t capacity){
+  if (!_timer_fired(camera))
+    return 0;
+  size_t length = (size_t) camera->width * camera->height * 2;
+  if (!dest || length > capacity)
+    return 0;
+  _synthetic_fill((synthetic_t*) camera->source_data, dest, camera->width, camera->height);
+  return length;
+}
+
+// any size, the pattern is drawn at each frame
+static int _synthetic_set_format(camera_t* camera, uint32_t width, uint32_t height){
+  width &= ~1u;
+  if (!width || !height){
+    errno = EINVAL;
+    return -1;
+  }
+  size_t capacity = (size_t) width * height * 2;
+  if (capacity > camera->head_capacity){
+    // the current size stays if the bigger buffer cannot be had
+    uint8_t* head = malloc(capacity);
+    if (!head){
+      errno = ENOMEM;
+      return -1;
+    }
+    free(camera->head.start);
+    camera->head.start = head;
+    camera->head_capacity = capacity;
+  }
+  camera->width = width;
+  camera->height = height;
+  return 0;
+}
+
+static void _synthetic_finish(camera_t* camera){
+}
+
+static void _synthetic_close(camera_t* camera){
+  _source_close(camera);
+  free(camera->source_data);
+  camera->source_data = NULL;
+}
+
+static const camera_source_t synthetic_source = {
+  .name = "synthetic",
+  .capture_into = _synthetic_capture_into,
+  .set_streaming = _paced_set_streaming,
+  .set_format = _synthetic_set_format,
+  .set_fps = _paced_set_fps,
+  .finish = _synthetic_finish,
+  .close = _synthetic_close
+};
+
+camera_t* camera_synthetic_open(uint32_t width, uint32_t height, int fps){
+  // YUYV pairs pixels
+  width &= ~1u;
+  if (!width || !height)
+    return NULL;
+  if (fps <= 0)
+    fps = SOURCE_DEFAULT_FPS;
+  camera_t* camera = _camera_alloc(width, height, fps);
+  if (!camera)
+    return NULL;
+  synthetic_t* s = calloc(1, sizeof(synthetic_t));
+  if (!s){
+    _camera_free(camera);
+    return NULL;
+  }
+  s->pace.period_ns = 1000000000L / fps;
+  s->seed = 2463534242u;
+  camera->source = &synthetic_source;
+  camera->source_data = s;
+  printf("synthetic source %u x %u at %d fps\n", width, height, fps);
+  return camera;
+}
+
+/* --- recording --- */
+
+static size_t _file_capture_into(camera_t* camera, uint8_t* dest, size_t capacity){
+  if (!_timer_fired(camera))
+    return 0;
+  recording_t* rec = (recording_t*) camera->source_data;
+  const uint8_t* frame = rec->data + rec->next * rec->frame_bytes;
+  rec->next = (rec->next + 1) % rec->frames;
+  if (!dest || rec->frame_bytes > capacity)
+    return 0;
+  memcpy(dest, frame, rec->frame_bytes);
+  return rec->frame_bytes;
+}
+
+static void _file_finish(camera_t* camera){
+}
+
+static void _file_close(camera_t* camera){
+  recording_t* rec = (recording_t*) camera->source_data;
+  _source_close(camera);
+  munmap(rec->data, rec->size);
+  free(rec);
+  camera->source_data = NULL;
+}
+
+static const camera_source_t file_source = {
+  .name = "yuyv",
+  .capture_into = _file_capture_into,
+  .set_streaming = _paced_set_streaming,
+  .set_fps = _paced_set_fps,
+  .finish = _file_finish,
+  .close = _file_close
+};
+
+camera_t* camera_file_open(const char* path, uint32_t width, uint32_t height, int fps){
+  width &= ~1u;
+  size_t frame_bytes = (size_t) width * height * 2;
+  if (!frame_bytes)
+    return NULL;
+  if (fps <= 0)
+    fps = SOURCE_DEFAULT_FPS;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return NULL;
+  struct stat st;
+  if (fstat(fd, &st) || (size_t) st.st_size < frame_bytes){
+    fprintf(stderr, "%s: not even one %u x %u frame\n", path, width, height);
+    close(fd);
+    errno = EINVAL;
+    return NULL;
+  }
+  // the page cache holds the recording, the frames are read in order
+  uint8_t* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return NULL;
+  madvise(data, st.st_size, MADV_SEQUENTIAL);
+  camera_t* camera = _camera_alloc(width, height, fps);
+  if (!camera){
+    munmap(data, st.st_size);
+    return NULL;
+  }
+  recording_t* rec = calloc(1, sizeof(recording_t));
+  if (!rec){
+    _camera_free(camera);
+    munmap(data, st.st_size);
+    return NULL;
+  }
+  rec->pace.period_ns = 1000000000L / fps;
+  rec->data = data;
+  rec->size = st.st_size;
+  rec->frame_bytes = frame_bytes;
+  rec->frames = st.st_size / frame_bytes;
+  camera->source = &file_source;
+  camera->source_data = rec;
+  printf("recording %s: %zu frames %u x %u at %d fps\n", path, rec->frames,
+         width, height, fps);
+  return camera;
+}
+
+/* --- names --- */
+
+/*
+  strips the optional [:WxH][@fps] from the end of spec,
+  the values found replace the defaults
+*/
+static void _parse_mode(char* spec, uint32_t* width, uint32_t* height, int* fps){
+  char* at = strrchr(spec, '@');
+  if (at && at[1] && strspn(at + 1, "0123456789") == strlen(at + 1)){
+    *fps = atoi(at + 1);
+    *at = 0;
+  }
+  char* colon = strrchr(spec, ':');
+  unsigned w, h;
+  char tail;
+  if (colon && sscanf(colon + 1, "%ux%u%c", &w, &h, &tail) == 2){
+    *width = w;
+    *height = h;
+    *colon = 0;
+  }
+}
+
+camera_t* camera_source_open(const char* spec, uint32_t width, uint32_t height){
+  char buf[4096];
+  snprintf(buf, sizeof(buf), "%s", spec);
+  int fps = SOURCE_DEFAULT_FPS;
+  if (!strncmp(buf, "synthetic", 9)){
+    _parse_mode(buf, &width, &height, &fps);
+    if (strcmp(buf, "synthetic")){
+      errno = EINVAL;
+      return NULL;
+    }
+    return camera_synthetic_open(width, height, fps);
+  }
+  if (!strncmp(buf, "yuyv:", 5)){
+    _parse_mode(buf + 5, &width, &height, &fps);
+    return camera_file_open(buf + 5, width, height, fps);
+  }
+  errno = EINVAL;
+  return NULL;
+}
@@ -17,13 +17,19 @@
 #include <sys/mman.h>
 #include <asm/types.h>
 #include <linux/videodev2.h>
-#include <opencv2/highgui/highgui_c.h>
 #include <jpeglib.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #include <sys/time.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 #include "capture_camera_mod.h"
+#include "jpeg_strip_encoder.h"
 
 #define FALSE 0
 #define TRUE 1
@@ -42,6 +48,25 @@ int xioctl(int fd, int request, void *arg){
   return -1;
 }
 
+static size_t _v4l2_capture_into(camera_t *camera, uint8_t* dest, size_t capacity);
+static int _v4l2_set_streaming(camera_t *camera, int on);
+static int _v4l2_set_format(camera_t *camera, uint32_t width, uint32_t height);
+static int _v4l2_set_fps(camera_t *camera, int fps);
+static int _v4l2_set_control(camera_t *camera, uint32_t id, int32_t value);
+static void _v4l2_finish(camera_t *camera);
+static void _v4l2_close(camera_t *camera);
+
+static const camera_source_t v4l2_source = {
+  .name = "v4l2",
+  .capture_into = _v4l2_capture_into,
+  .set_streaming = _v4l2_set_streaming,
+  .set_format = _v4l2_set_format,
+  .set_fps = _v4l2_set_fps,
+  .set_control = _v4l2_set_control,
+  .finish = _v4l2_finish,
+  .close = _v4l2_close
+};
+
 /*
   Opens the camera device and stores the requested image size in the camera struct
 */
@@ -58,10 +83,87 @@ camera_t *camera_open(const char *device, uint32_t width, uint32_t height){
   camera->buffers = NULL;
   camera->head.length = 0;
   camera->head.start = NULL;
+  camera->head_capacity = 0;
+  camera->pool = NULL;
+  camera->timestamp_us = 0;
+  camera->fps = 0;
+  camera->streaming = 0;
+  camera->source = &v4l2_source;
+  camera->source_data = NULL;
   printf("device opened\n");
   return camera;
 }
 
+// the driver may pick the closest size it supports. 0 on success
+static int _v4l2_format(camera_t *camera, uint32_t width, uint32_t height){
+  struct v4l2_format format;
+  memset(&format, 0, sizeof format);
+  format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  format.fmt.pix.width = width;
+  format.fmt.pix.height = height;
+  format.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
+  format.fmt.pix.field = V4L2_FIELD_NONE;
+  if (xioctl(camera->fd, VIDIOC_S_FMT, &format) == -1)
+    return -1;
+  camera->width = format.fmt.pix.width;
+  camera->height = format.fmt.pix.height;
+  return 0;
+}
+
+// requests the driver buffers and maps them, the head buffer grows to fit them
+static int _v4l2_map(camera_t *camera){
+  struct v4l2_requestbuffers req;
+  memset(&req, 0, sizeof req);
+  req.count = 4;
+  req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  req.memory = V4L2_MEMORY_MMAP;
+  if (xioctl(camera->fd, VIDIOC_REQBUFS, &req) == -1)
+    return -1;
+  camera->buffer_count = 0;
+  camera->buffers = calloc(req.count, sizeof(buffer_t));
+  printf("allocated %d buffers\n", req.count);
+
+  //here we do a mmap for each individual buffer
+  size_t buf_max = 0;
+  for (size_t i = 0; i < req.count; i++){
+    struct v4l2_buffer buf;
+    memset(&buf, 0, sizeof buf);
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = V4L2_MEMORY_MMAP;
+    buf.index = i;
+    if (xioctl(camera->fd, VIDIOC_QUERYBUF, &buf) == -1)
+      return -1;
+    if (buf.length > buf_max)
+      buf_max = buf.length;
+    camera->buffers[i].length = buf.length;
+    camera->buffers[i].start =
+      mmap(NULL, buf.length, PROT_READ | PROT_WRITE, MAP_SHARED,
+	   camera->fd, buf.m.offset);
+    if (camera->buffers[i].start == MAP_FAILED)
+      return -1;
+    camera->buffer_count = i + 1;
+  }
+  if (buf_max > camera->head_capacity){
+    free(camera->head.start);
+    camera->head.start = malloc(buf_max);
+    camera->head_capacity = buf_max;
+  }
+  return 0;
+}
+
+// the frame interval the driver is using, 0 if it does not tell
+static void _v4l2_read_fps(camera_t *camera){
+  struct v4l2_streamparm parm;
+  memset(&parm, 0, sizeof parm);
+  parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  camera->fps = 0;
+  if (xioctl(camera->fd, VIDIOC_G_PARM, &parm) == -1)
+    return;
+  struct v4l2_fract* t = &parm.parm.capture.timeperframe;
+  if (t->numerator)
+    camera->fps = t->denominator / t->numerator;
+}
+
 /*
   1. queries the capability of he camera
   2. checks if device supports cropping
@@ -92,53 +194,23 @@ void camera_init(camera_t *camera){
   }
   printf("camera supports cropping\n");
 
-  struct v4l2_format format;
-  memset(&format, 0, sizeof format);
-  format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-  format.fmt.pix.width = camera->width;
-  format.fmt.pix.height = camera->height;
-  format.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
-  format.fmt.pix.field = V4L2_FIELD_NONE;
-  if (xioctl(camera->fd, VIDIOC_S_FMT, &format) == -1)
+  if (_v4l2_format(camera, camera->width, camera->height))
     quit("VIDIOC_S_FMT");
   printf("set format to %d x %d\n", camera->width, camera->height);
-
-  struct v4l2_requestbuffers req;
-  memset(&req, 0, sizeof req);
-  req.count = 4;
-  req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-  req.memory = V4L2_MEMORY_MMAP;
-  if (xioctl(camera->fd, VIDIOC_REQBUFS, &req) == -1)
+  if (_v4l2_map(camera))
     quit("VIDIOC_REQBUFS");
-  camera->buffer_count = req.count;
-  camera->buffers = calloc(req.count, sizeof(buffer_t));
-  printf("allocated %d buffers\n", req.count);
-
-  //here we do a mmap for each individual buffer
-  size_t buf_max = 0;
-  for (size_t i = 0; i < camera->buffer_count; i++){
-    struct v4l2_buffer buf;
-    memset(&buf, 0, sizeof buf);
-    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    buf.memory = V4L2_MEMORY_MMAP;
-    buf.index = i;
-    if (xioctl(camera->fd, VIDIOC_QUERYBUF, &buf) == -1)
-      quit("VIDIOC_QUERYBUF");
-    if (buf.length > buf_max)
-      buf_max = buf.length;
-    camera->buffers[i].length = buf.length;
-    camera->buffers[i].start =
-      mmap(NULL, buf.length, PROT_READ | PROT_WRITE, MAP_SHARED,
-	   camera->fd, buf.m.offset);
-    if (camera->buffers[i].start == MAP_FAILED)
-      quit("mmap");
-    printf("mmapping buffer[%d]\n", (int)i);
-  }
-  camera->head.start = malloc(buf_max);
+  _v4l2_read_fps(camera);
 }
 
-// starts the streaming (one single xioctl)
-void camera_start(camera_t *camera){
+/*
+  starts the streaming, queueing all the buffers first.
+  STREAMOFF takes them all back from the driver and leaves them mapped,
+  so a restart is just this
+*/
+static int _v4l2_set_streaming(camera_t *camera, int on){
+  enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  if (!on)
+    return xioctl(camera->fd, VIDIOC_STREAMOFF, &type) == -1 ? -1 : 0;
   for (size_t i = 0; i < camera->buffer_count; i++){
     struct v4l2_buffer buf;
     memset(&buf, 0, sizeof buf);
@@ -146,54 +218,173 @@ void camera_start(camera_t *camera){
     buf.memory = V4L2_MEMORY_MMAP;
     buf.index = i;
     if (xioctl(camera->fd, VIDIOC_QBUF, &buf) == -1)
-      quit("VIDIOC_QBUF"); // query for a buffer
+      return -1;
   }
+  return xioctl(camera->fd, VIDIOC_STREAMON, &type) == -1 ? -1 : 0;
+}
 
-  enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-  if (xioctl(camera->fd, VIDIOC_STREAMON, &type) == -1)
+int camera_set_streaming(camera_t *camera, int on){
+  if (camera->streaming == on)
+    return 0;
+  if (camera->source->set_streaming(camera, on))
+    return -1;
+  camera->streaming = on;
+  return 0;
+}
+
+// starts the streaming
+void camera_start(camera_t *camera){
+  if (camera_set_streaming(camera, 1))
     quit("VIDIOC_STREAMON");
 }
 
 // stops the streaming
 void camera_stop(camera_t *camera){
-  enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-  if (xioctl(camera->fd, VIDIOC_STREAMOFF, &type) == -1)
+  if (camera_set_streaming(camera, 0))
     quit("VIDIOC_STREAMOFF");
 }
 
 // unmaps the buffers
-void camera_finish(camera_t *camera){
+static void _v4l2_finish(camera_t *camera){
   for (size_t i = 0; i < camera->buffer_count; i++){
     munmap(camera->buffers[i].start, camera->buffers[i].length);
   }
   free(camera->buffers);
   camera->buffer_count = 0;
   camera->buffers = NULL;
+}
+
+// gives the buffers back to the driver, switches the format and maps new ones
+static int _v4l2_remap(camera_t *camera, uint32_t width, uint32_t height){
+  struct v4l2_requestbuffers req;
+  _v4l2_finish(camera);
+  memset(&req, 0, sizeof req);
+  req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  req.memory = V4L2_MEMORY_MMAP;
+  xioctl(camera->fd, VIDIOC_REQBUFS, &req);
+  if (_v4l2_format(camera, width, height))
+    return -1;
+  return _v4l2_map(camera);
+}
+
+/*
+  the driver refuses a new format while it holds buffers: stops the
+  stream, gives the buffers back, switches and maps new ones.
+  If the format is refused, or cannot be mapped or streamed, the previous
+  one is restored with its buffers. Only if that fails too the camera is
+  left stopped
+*/
+static int _v4l2_set_format(camera_t *camera, uint32_t width, uint32_t height){
+  int streaming = camera->streaming;
+  uint32_t old_width = camera->width;
+  uint32_t old_height = camera->height;
+  if (streaming && _v4l2_set_streaming(camera, 0))
+    return -1;
+  int r = _v4l2_remap(camera, width, height);
+  if (!r && streaming && _v4l2_set_streaming(camera, 1)){
+    // takes back the buffers queued before the failure
+    _v4l2_set_streaming(camera, 0);
+    r = -1;
+  }
+  if (r && (_v4l2_remap(camera, old_width, old_height)
+            || (streaming && _v4l2_set_streaming(camera, 1)))){
+    camera->streaming = 0;
+    return -1;
+  }
+  // a new format may come with its own frame interval
+  _v4l2_read_fps(camera);
+  return r;
+}
+
+// most drivers take a new frame interval only while stopped
+static int _v4l2_set_fps(camera_t *camera, int fps){
+  struct v4l2_streamparm parm;
+  memset(&parm, 0, sizeof parm);
+  parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  if (xioctl(camera->fd, VIDIOC_G_PARM, &parm) == -1)
+    return -1;
+  if (!(parm.parm.capture.capability & V4L2_CAP_TIMEPERFRAME)){
+    errno = ENOTTY;
+    return -1;
+  }
+  parm.parm.capture.timeperframe.numerator = 1;
+  parm.parm.capture.timeperframe.denominator = fps;
+  int streaming = camera->streaming;
+  if (streaming && _v4l2_set_streaming(camera, 0))
+    return -1;
+  int r = xioctl(camera->fd, VIDIOC_S_PARM, &parm) == -1 ? -1 : 0;
+  if (streaming && _v4l2_set_streaming(camera, 1)){
+    camera->streaming = 0;
+    return -1;
+  }
+  _v4l2_read_fps(camera);
+  return r;
+}
+
+static int _v4l2_set_control(camera_t *camera, uint32_t id, int32_t value){
+  struct v4l2_control control = { .id = id, .value = value };
+  return xioctl(camera->fd, VIDIOC_S_CTRL, &control) == -1 ? -1 : 0;
+}
+
+// closes the device
+static void _v4l2_close(camera_t *camera){
+  if (close(camera->fd) == -1)
+    quit("close");
+}
+
+void camera_finish(camera_t *camera){
+  camera->source->finish(camera);
   free(camera->head.start);
   camera->head.length = 0;
   camera->head.start = NULL;
+  camera->head_capacity = 0;
+  if (camera->pool)
+    frame_pool_destroy(camera->pool);
+  camera->pool = NULL;
 }
 
-// closes the device
 void camera_close(camera_t *camera){
-  if (close(camera->fd) == -1)
-    quit("close");
+  camera->source->close(camera);
   free(camera);
 }
 
-// captures a frame from the current buffer
+// captures a frame in the head buffer
 int camera_capture(camera_t *camera){
+  size_t length = camera_capture_into(camera, camera->head.start, camera->head_capacity);
+  if (!length)
+    return FALSE;
+  camera->head.length = length;
+  return TRUE;
+}
+
+size_t camera_capture_into(camera_t *camera, uint8_t* dest, size_t capacity){
+  return camera->source->capture_into(camera, dest, capacity);
+}
+
+// dequeues a ready buffer, copies it in dest (if any) and gives it back to the driver
+static size_t _v4l2_capture_into(camera_t *camera, uint8_t* dest, size_t capacity){
   struct v4l2_buffer buf;
   memset(&buf, 0, sizeof buf);
   buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
   buf.memory = V4L2_MEMORY_MMAP;
   if (xioctl(camera->fd, VIDIOC_DQBUF, &buf) == -1)
-    return FALSE; // buffer exchange with the driver - full
-  memcpy(camera->head.start, camera->buffers[buf.index].start, buf.bytesused);
-  camera->head.length = buf.bytesused;
+    return 0;
+  // the driver stamps the frame on the monotonic clock, older ones do not say
+  if ((buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC)
+    camera->timestamp_us = (uint64_t) buf.timestamp.tv_sec * 1000000 + buf.timestamp.tv_usec;
+  else {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    camera->timestamp_us = (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+  }
+  size_t length = buf.bytesused;
+  if (dest && length <= capacity)
+    memcpy(dest, camera->buffers[buf.index].start, length);
+  else
+    length = 0;
   if (xioctl(camera->fd, VIDIOC_QBUF, &buf) == -1)
-    return FALSE; // buffer exchange with the driver - empty
-  return TRUE;
+    return 0;
+  return length;
 }
 
 int camera_frame(camera_t *camera, struct timeval timeout){
@@ -209,10 +400,98 @@ int camera_frame(camera_t *camera, struct timeval timeout){
   return camera_capture(camera);
 }
 
+static int pool_flags = 0;
+
+void camera_set_pool_flags(int flags){
+  pool_flags = flags;
+}
+
+// a buffer fits an rgb image, or an encoded frame with its transport headroom
+static frame_pool_t* _camera_pool(camera_t *camera){
+  return frame_pool_create(camera->width * camera->height * 3 + CAMERA_FRAME_HEADROOM,
+                           CAMERA_POOL_BUFFERS, pool_flags);
+}
+
+int camera_set_format(camera_t *camera, uint32_t width, uint32_t height){
+  if (width > CAMERA_MAX_WIDTH)
+    width = CAMERA_MAX_WIDTH;
+  if (height > CAMERA_MAX_HEIGHT)
+    height = CAMERA_MAX_HEIGHT;
+  if (width == camera->width && height == camera->height)
+    return 0;
+  if (!camera->source->set_format){
+    errno = ENOTTY;
+    return -1;
+  }
+  uint32_t old_width = camera->width;
+  uint32_t old_height = camera->height;
+  if (camera->source->set_format(camera, width, height))
+    return -1;
+  if (!camera->pool || (camera->width == old_width && camera->height == old_height))
+    return 0;
+  // frames of the old size may still be in the pipeline, they keep the old pool alive
+  frame_pool_t* pool = _camera_pool(camera);
+  if (!pool)
+    return -1;
+  frame_pool_retire(camera->pool);
+  camera->pool = pool;
+  printf("camera format %u x %u\n", camera->width, camera->height);
+  return 0;
+}
+
+int camera_set_fps(camera_t *camera, int fps){
+  if (fps <= 0){
+    errno = EINVAL;
+    return -1;
+  }
+  if (fps > CAMERA_MAX_FPS)
+    fps = CAMERA_MAX_FPS;
+  if (!camera->source->set_fps){
+    errno = ENOTTY;
+    return -1;
+  }
+  return camera->source->set_fps(camera, fps);
+}
+
+int camera_set_control(camera_t *camera, uint32_t id, int32_t value){
+  if (!camera->source->set_control){
+    errno = ENOTTY;
+    return -1;
+  }
+  return camera->source->set_control(camera, id, value);
+}
+
+int camera_set_exposure(camera_t *camera, int exposure){
+  if (exposure > 0){
+    if (camera_set_control(camera, V4L2_CID_EXPOSURE_AUTO, V4L2_EXPOSURE_MANUAL))
+      return -1;
+    return camera_set_control(camera, V4L2_CID_EXPOSURE_ABSOLUTE, exposure);
+  }
+  // UVC cameras call their automatic mode aperture priority
+  if (camera_set_control(camera, V4L2_CID_EXPOSURE_AUTO, V4L2_EXPOSURE_APERTURE_PRIORITY) &&
+      camera_set_control(camera, V4L2_CID_EXPOSURE_AUTO, V4L2_EXPOSURE_AUTO))
+    return -1;
+  // in low light the exposure may not stretch the frame interval, not all the cameras have it
+  camera_set_control(camera, V4L2_CID_EXPOSURE_AUTO_PRIORITY, 0);
+  return 0;
+}
+
 camera_t *camera_initialize(char* dev, int width, int height){
-  camera_t *camera = camera_open(dev, width, height);
-  camera_init(camera);
-  camera_start(camera);
+  camera_t *camera = NULL;
+  if (!strncmp(dev, "synthetic", 9) || !strncmp(dev, "yuyv:", 5)){
+    camera = camera_source_open(dev, width, height);
+    if (!camera)
+      quit("camera source");
+  }
+  else {
+    camera = camera_open(dev, width, height);
+    camera_init(camera);
+  }
+  camera->pool = _camera_pool(camera);
+  if (!camera->pool)
+    quit("frame_pool_create");
+  if (camera->source == &v4l2_source)
+    camera_start(camera);
 
   return camera;
 }
@@ -235,47 +514,185 @@ void savePGM(camera_t *camera, char *filename){
   fclose(f);
 }
 
+static jpeg_strip_encoder_t* strip_encoder = NULL;
+static int coding_options = 0;
+
+void jpeg_set_workers(int workers){
+  if (strip_encoder)
+    jpeg_strip_encoder_destroy(strip_encoder);
+  strip_encoder = NULL;
+  if (workers > 1)
+    strip_encoder = jpeg_strip_encoder_create(workers);
+}
+
+int jpeg_workers(void){
+  return strip_encoder ? jpeg_strip_encoder_workers(strip_encoder) : 1;
+}
+
+void jpeg_set_options(int options){
+  coding_options = options;
+}
+
+int jpeg_options(void){
+  return coding_options;
+}
+
+/*
+  feeds the rows straight from the rgb (or gray, components 1) image, no per-row copy.
+  Abbreviated, the tables are marked as already sent; with optimize_coding
+  libjpeg clears that mark on the huffman tables it builds, so only the
+  quantization tables are left out
+*/
+static void _jpeg_compress(struct jpeg_compress_struct* compress, const uint8_t* pixels,
+                           uint32_t width, uint32_t height, int components, int quality,
+                           int options){
+  compress->image_width = width;
+  compress->image_height = height;
+  compress->input_components = components;
+  compress->in_color_space = components == 1 ? JCS_GRAYSCALE : JCS_RGB;
+  jpeg_set_defaults(compress);
+  jpeg_set_quality(compress, quality, TRUE);
+  compress->optimize_coding = (options & JPEG_OPTIMIZE_CODING) != 0;
+  if (options & JPEG_ABBREVIATED)
+    jpeg_suppress_tables(compress, TRUE);
+  jpeg_start_compress(compress, !(options & JPEG_ABBREVIATED));
+  while (compress->next_scanline < height){
+    JSAMPROW row = (JSAMPROW) (pixels + (size_t) compress->next_scanline * width * components);
+    jpeg_write_scanlines(compress, &row, 1);
+  }
+  jpeg_finish_compress(compress);
+}
+
+// a file always carries its tables
 void jpeg(FILE* dest, uint8_t* rgb, uint32_t width, uint32_t height, int quality){
-  JSAMPARRAY image;
-  image = calloc(height, sizeof (JSAMPROW));
-  for (size_t i = 0; i < height; i++) {
-    image[i] = calloc(width * 3, sizeof (JSAMPLE));
-    for (size_t j = 0; j < width; j++) {
-      image[i][j * 3 + 0] = rgb[(i * width + j) * 3 + 0];
-      image[i][j * 3 + 1] = rgb[(i * width + j) * 3 + 1];
-      image[i][j * 3 + 2] = rgb[(i * width + j) * 3 + 2];
-    }
+  if (strip_encoder){
+    size_t capacity = (size_t) width * height * 3 + 1024;
+    uint8_t* encoded = malloc(capacity);
+    size_t size = jpeg_strip_encoder_encode(strip_encoder, encoded, capacity, rgb, width, height, quality, 0);
+    fwrite(encoded, 1, size, dest);
+    free(encoded);
+    return;
   }
-  
+
   struct jpeg_compress_struct compress;
   struct jpeg_error_mgr error;
   compress.err = jpeg_std_error(&error);
   jpeg_create_compress(&compress);
   jpeg_stdio_dest(&compress, dest);
-  
-  compress.image_width = width;
-  compress.image_height = height;
+  _jpeg_compress(&compress, rgb, width, height, 3, quality, coding_options & JPEG_OPTIMIZE_CODING);
+  jpeg_destroy_compress(&compress);
+}
+
+/*
+  destination manager writing into a caller buffer that is never grown.
+  On overflow the output wraps to the start and the encode is reported as failed
+*/
+typedef struct fixed_dest_t{
+  struct jpeg_destination_mgr mgr;
+  uint8_t* buffer;
+  size_t capacity;
+  int overflow;
+} fixed_dest_t;
+
+static void _fixed_init(j_compress_ptr compress){
+  fixed_dest_t* dest = (fixed_dest_t*) compress->dest;
+  dest->mgr.next_output_byte = dest->buffer;
+  dest->mgr.free_in_buffer = dest->capacity;
+  dest->overflow = 0;
+}
+
+static boolean _fixed_empty(j_compress_ptr compress){
+  fixed_dest_t* dest = (fixed_dest_t*) compress->dest;
+  dest->overflow = 1;
+  dest->mgr.next_output_byte = dest->buffer;
+  dest->mgr.free_in_buffer = dest->capacity;
+  return TRUE;
+}
+
+static void _fixed_term(j_compress_ptr compress){
+}
+
+static void _fixed_setup(fixed_dest_t* fixed, uint8_t* buffer, size_t capacity){
+  fixed->mgr.init_destination = _fixed_init;
+  fixed->mgr.empty_output_buffer = _fixed_empty;
+  fixed->mgr.term_destination = _fixed_term;
+  fixed->buffer = buffer;
+  fixed->capacity = capacity;
+}
+
+static size_t _fixed_size(const fixed_dest_t* fixed){
+  if (fixed->overflow)
+    return 0;
+  return fixed->capacity - fixed->mgr.free_in_buffer;
+}
+
+static size_t _jpeg_mem(uint8_t* dest, size_t capacity, const uint8_t* pixels,
+                       uint32_t width, uint32_t height, int components, int quality){
+  // the compressor is kept across frames so libjpeg does not rebuild its pools
+  static struct jpeg_compress_struct compress;
+  static struct jpeg_error_mgr error;
+  static fixed_dest_t fixed;
+  static int initialized = 0;
+  static int optimized = 0;
+  // libjpeg-turbo's jpeg_set_defaults keeps the huffman tables it finds, those
+  // fitted to the last optimized frame would not match the ones of jpeg_mem_tables
+  if (initialized && optimized && !(coding_options & JPEG_OPTIMIZE_CODING)){
+    jpeg_destroy_compress(&compress);
+    initialized = 0;
+  }
+  if (!initialized){
+    compress.err = jpeg_std_error(&error);
+    jpeg_create_compress(&compress);
+    compress.dest = &fixed.mgr;
+    initialized = 1;
+  }
+  optimized = coding_options & JPEG_OPTIMIZE_CODING;
+  _fixed_setup(&fixed, dest, capacity);
+  _jpeg_compress(&compress, pixels, width, height, components, quality, coding_options);
+  return _fixed_size(&fixed);
+}
+
+size_t jpeg_mem(uint8_t* dest, size_t capacity, const uint8_t* rgb,
+                uint32_t width, uint32_t height, int quality){
+  if (strip_encoder)
+    return jpeg_strip_encoder_encode(strip_encoder, dest, capacity, rgb, width, height, quality,
+                                     coding_options & JPEG_ABBREVIATED);
+  return _jpeg_mem(dest, capacity, rgb, width, height, 3, quality);
+}
+
+size_t jpeg_mem_gray(uint8_t* dest, size_t capacity, const uint8_t* gray,
+                     uint32_t width, uint32_t height, int quality){
+  return _jpeg_mem(dest, capacity, gray, width, height, 1, quality);
+}
+
+/*
+  jpeg_set_quality fills both quantization tables and jpeg_set_defaults all
+  four standard huffman tables whatever the color space, and
+  jpeg_write_tables writes all of them: the same tables serve the color and
+  the gray frames
+*/
+size_t jpeg_mem_tables(uint8_t* dest, size_t capacity, int quality){
+  struct jpeg_compress_struct compress;
+  struct jpeg_error_mgr error;
+  fixed_dest_t fixed;
+  compress.err = jpeg_std_error(&error);
+  jpeg_create_compress(&compress);
+  _fixed_setup(&fixed, dest, capacity);
+  compress.dest = &fixed.mgr;
   compress.input_components = 3;
   compress.in_color_space = JCS_RGB;
   jpeg_set_defaults(&compress);
   jpeg_set_quality(&compress, quality, TRUE);
-  jpeg_start_compress(&compress, TRUE);
-  jpeg_write_scanlines(&compress, image, height);
-  jpeg_finish_compress(&compress);
+  jpeg_write_tables(&compress);
   jpeg_destroy_compress(&compress);
-
-  for (size_t i = 0; i < height; i++) {
-    free(image[i]);
-  }
-  free(image);
+  return _fixed_size(&fixed);
 }
 
 int minmax(int min, int v, int max){
   return (v < min) ? min : (max < v) ? max : v;
 }
 
-uint8_t* yuyv2rgb(uint8_t* yuyv, uint32_t width, uint32_t height){
-  uint8_t* rgb = calloc(width * height * 3, sizeof (uint8_t));
+void yuyv2rgb_into(const uint8_t* yuyv, uint8_t* rgb, uint32_t width, uint32_t height){
   for (size_t i = 0; i < height; i++) {
     for (size_t j = 0; j < width; j += 2) {
       size_t index = i * width + j;
@@ -291,5 +708,113 @@ uint8_t* yuyv2rgb(uint8_t* yuyv, uint32_t width, uint32_t height){
       rgb[index * 3 + 5] = minmax(0, (y1 + 454 * u) >> 8, 255);
     }
   }
+}
+
+void yuyv2rgb_scaled_into(const uint8_t* yuyv, uint8_t* rgb, uint32_t width, uint32_t height, int scale){
+  if (scale <= 1){
+    yuyv2rgb_into(yuyv, rgb, width, height);
+    return;
+  }
+  // one output pixel every scale pixels: Y0 of the macropixel with its U and V
+  uint32_t out_width = width / scale;
+  uint32_t out_height = height / scale;
+  for (size_t i = 0; i < out_height; i++) {
+    const uint8_t* row = yuyv + i * scale * width * 2;
+    for (size_t j = 0; j < out_width; j++) {
+      const uint8_t* macropixel = row + (j * scale / 2) * 4;
+      int y = macropixel[0] << 8;
+      int u = macropixel[1] - 128;
+      int v = macropixel[3] - 128;
+      uint8_t* p = rgb + (i * out_width + j) * 3;
+      p[0] = minmax(0, (y + 359 * v) >> 8, 255);
+      p[1] = minmax(0, (y + 88 * v - 183 * u) >> 8, 255);
+      p[2] = minmax(0, (y + 454 * u) >> 8, 255);
+    }
+  }
+}
+
+/*
+  the luma is every other byte of YUYV: 16 pixels at a time with SSE2
+  (mask the Y bytes of 32 input bytes, then pack them) or NEON
+  (de-interleaving load), the rest one by one
+*/
+void yuyv2gray_into(const uint8_t* yuyv, uint8_t* gray, uint32_t width, uint32_t height){
+  size_t pixels = (size_t) width * height;
+  size_t i = 0;
+#if defined(__SSE2__)
+  const __m128i luma = _mm_set1_epi16(0x00FF);
+  for (; i + 16 <= pixels; i += 16){
+    __m128i a = _mm_loadu_si128((const __m128i*) (yuyv + i * 2));
+    __m128i b = _mm_loadu_si128((const __m128i*) (yuyv + i * 2 + 16));
+    __m128i y = _mm_packus_epi16(_mm_and_si128(a, luma), _mm_and_si128(b, luma));
+    _mm_storeu_si128((__m128i*) (gray + i), y);
+  }
+#elif defined(__ARM_NEON)
+  for (; i + 16 <= pixels; i += 16){
+    uint8x16x2_t yc = vld2q_u8(yuyv + i * 2);
+    vst1q_u8(gray + i, yc.val[0]);
+  }
+#endif
+  for (; i < pixels; ++i)
+    gray[i] = yuyv[i * 2];
+}
+
+void yuyv2gray_scaled_into(const uint8_t* yuyv, uint8_t* gray, uint32_t width, uint32_t height, int scale){
+  if (scale <= 1){
+    yuyv2gray_into(yuyv, gray, width, height);
+    return;
+  }
+  uint32_t out_width = width / scale;
+  uint32_t out_height = height / scale;
+  for (size_t i = 0; i < out_height; i++) {
+    const uint8_t* row = yuyv + i * scale * width * 2;
+    for (size_t j = 0; j < out_width; j++)
+      *gray++ = row[j * scale * 2];
+  }
+}
+
+void yuyv2i420_scaled_into(const uint8_t* yuyv, uint8_t* i420, uint32_t width, uint32_t height,
+                           int scale, int gray){
+  if (scale < 1)
+    scale = 1;
+  uint32_t out_width = (width / scale) & ~1u;
+  uint32_t out_height = (height / scale) & ~1u;
+  uint8_t* y = i420;
+  uint8_t* u = y + (size_t) out_width * out_height;
+  uint8_t* v = u + (size_t) out_width * out_height / 4;
+  if (gray)
+    memset(u, 128, (size_t) out_width * out_height / 2);
+  for (uint32_t r = 0; r < out_height; ++r){
+    const uint8_t* row = yuyv + (size_t) r * scale * width * 2;
+    for (uint32_t c = 0; c < out_width; ++c)
+      *y++ = row[c * scale * 2];
+    if ((r & 1) || gray)
+      continue;
+    // the columns are even, so each starts a macropixel: Y0 U Y1 V
+    for (uint32_t c = 0; c < out_width; c += 2){
+      *u++ = row[c * scale * 2 + 1];
+      *v++ = row[c * scale * 2 + 3];
+    }
+  }
+}
+
+void yuyv_half_into(const uint8_t* yuyv, uint8_t* half, uint32_t width, uint32_t height){
+  // two input macropixels on two rows make an output macropixel
+  uint32_t macropixels = width / 4;
+  for (uint32_t r = 0; r < height / 2; ++r){
+    const uint8_t* a = yuyv + (size_t) r * 2 * width * 2;
+    const uint8_t* b = a + width * 2;
+    for (uint32_t m = 0; m < macropixels; ++m, a += 8, b += 8, half += 4){
+      half[0] = (a[0] + a[2] + b[0] + b[2] + 2) >> 2;
+      half[1] = (a[1] + a[5] + b[1] + b[5] + 2) >> 2;
+      half[2] = (a[4] + a[6] + b[4] + b[6] + 2) >> 2;
+      half[3] = (a[3] + a[7] + b[3] + b[7] + 2) >> 2;
+    }
+  }
+}
+
+uint8_t* yuyv2rgb(uint8_t* yuyv, uint32_t width, uint32_t height){
+  uint8_t* rgb = calloc(width * height * 3, sizeof (uint8_t));
+  yuyv2rgb_into(yuyv, rgb, width, height);
   return rgb;
 }
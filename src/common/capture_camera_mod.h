@@ -1,4 +1,5 @@
 #pragma once
+#include <stdio.h>
 #include <stdint.h>
 #include <sys/time.h>
 #include <sys/types.h>
@@ -8,27 +9,182 @@
 #include <sys/mman.h>
 #include <asm/types.h>
 #include <linux/videodev2.h>
+#include "frame_pool.h"
+
+#define CAMERA_POOL_BUFFERS 16    // captures on their way to the encoder
+#define CAMERA_FRAME_HEADROOM 128 // room for transport headers in front of an encoded frame
+#define CAMERA_MAX_WIDTH 1920     // largest format camera_set_format switches to
+#define CAMERA_MAX_HEIGHT 1080
+#define CAMERA_MAX_FPS 120        // fastest rate camera_set_fps asks for
 
 typedef struct buffer_t{
 	uint8_t* start;
 	size_t length;
 } buffer_t;
 
+struct camera_t;
+
+// where the YUYV frames come from: a V4L2 device, a synthetic pattern or a recording
+typedef struct camera_source_t{
+	const char* name;
+	size_t (*capture_into)(struct camera_t* camera, uint8_t* dest, size_t capacity);
+	int (*set_streaming)(struct camera_t* camera, int on); // 0 on success
+	// optional, NULL if the source cannot change them at runtime. 0 on success
+	int (*set_format)(struct camera_t* camera, uint32_t width, uint32_t height);
+	int (*set_fps)(struct camera_t* camera, int fps);
+	int (*set_control)(struct camera_t* camera, uint32_t id, int32_t value);
+	void (*finish)(struct camera_t* camera);   // releases the frame buffers
+	void (*close)(struct camera_t* camera);    // releases the rest, fd included
+} camera_source_t;
+
 typedef struct camera_t{
-	int fd;
+	int fd;               // polls readable when a frame is ready
 	uint32_t width;
 	uint32_t height;
 	buffer_t head;        // buffer for the current image
+	size_t head_capacity;
 
 	size_t buffer_count;
 	buffer_t* buffers;    // image buffers four nimage buffers
+
+	frame_pool_t* pool;   // buffers for the processing pipeline, sized on the image
+	uint64_t timestamp_us; // capture time of the last frame, CLOCK_MONOTONIC
+	int fps;              // frame rate of the source, 0 if unknown
+	int streaming;
+
+	const camera_source_t* source;
+	void* source_data;    // private to the source
 } camera_t;
 
 
 
+// FRAME_POOL_* flags for the pool created by camera_initialize
+void camera_set_pool_flags(int flags);
+// dev picks the source:
+//   synthetic[:WxH][@fps]         moving gradients and noise
+//   yuyv:<file>[:WxH][@fps]       raw YUYV frames of a recording, played in a loop
+//   anything else                 a V4L2 device
+// the sources without a device default to width x height at 30 fps
 camera_t* camera_initialize(char* dev, int width, int height);
+// sources paced by a timerfd in camera->fd, NULL on errors
+camera_t* camera_synthetic_open(uint32_t width, uint32_t height, int fps);
+camera_t* camera_file_open(const char* path, uint32_t width, uint32_t height, int fps);
+// opens the synthetic or yuyv: source named by spec, as camera_initialize
+camera_t* camera_source_open(const char* spec, uint32_t width, uint32_t height);
 int camera_frame(camera_t* camera, struct timeval timeout);
+// stops and restarts the frames. Buffers and format are kept, so restarting
+// is quick. Stopped, a V4L2 fd polls with an error: do not wait on it. 0 on success
+int camera_set_streaming(camera_t* camera, int on);
+// runtime changes, on the thread that captures. -1 with errno ENOTTY if the
+// source does not support them.
+// The driver may pick the closest size: camera->width/height say which one.
+// The size is clamped to CAMERA_MAX_WIDTH x CAMERA_MAX_HEIGHT: it may come
+// from a viewer, and the pool and the sources allocate for it.
+// The pool is replaced by one sized on the new format, the frames still
+// around keep the old pool until they are released
+int camera_set_format(camera_t* camera, uint32_t width, uint32_t height);
+// the driver may round it: camera->fps says the rate obtained. -1 with
+// errno EINVAL if fps <= 0, clamped to CAMERA_MAX_FPS
+int camera_set_fps(camera_t* camera, int fps);
+// VIDIOC_S_CTRL, id is a V4L2_CID_*
+int camera_set_control(camera_t* camera, uint32_t id, int32_t value);
+// exposure time in 100us units, 0 for automatic without lowering the frame rate
+int camera_set_exposure(camera_t* camera, int exposure);
+// non blocking: copies the next ready frame in dest, returns its size (0 if none or dropped).
+// Meant to be called when camera->fd polls readable
+// sets camera->timestamp_us to the capture time of the frame
+size_t camera_capture_into(camera_t *camera, uint8_t* dest, size_t capacity);
 void camera_finish(camera_t *camera);
 void camera_close(camera_t *camera);
 uint8_t* yuyv2rgb(uint8_t* yuyv, uint32_t width, uint32_t height);
-void jpeg(FILE* dest, uint8_t* rgb, uint32_t width, uint32_t height, int quality);
\ No newline at end of file
+// converts into a caller buffer of width*height*3 bytes
+void yuyv2rgb_into(const uint8_t* yuyv, uint8_t* rgb, uint32_t width, uint32_t height);
+// converts keeping one pixel every scale (even) in both directions: (width/scale)x(height/scale)
+void yuyv2rgb_scaled_into(const uint8_t* yuyv, uint8_t* rgb, uint32_t width, uint32_t height, int scale);
+// keeps the luma only, into a caller buffer of width*height bytes
+void yuyv2gray_into(const uint8_t* yuyv, uint8_t* gray, uint32_t width, uint32_t height);
+// as yuyv2rgb_scaled_into, one byte per pixel
+void yuyv2gray_scaled_into(const uint8_t* yuyv, uint8_t* gray, uint32_t width, uint32_t height, int scale);
+// planar 4:2:0 of (width/scale)x(height/scale) rounded down to even sizes,
+// the chroma of the even rows. gray fills the chroma planes with 128
+void yuyv2i420_scaled_into(const uint8_t* yuyv, uint8_t* i420, uint32_t width, uint32_t height,
+                           int scale, int gray);
+// halves a yuyv image averaging 2x2 pixels (the chroma of 4x2), into a caller
+// buffer of (width/4*2)x(height/2) yuyv. Cascaded, it makes the simulcast layers
+void yuyv_half_into(const uint8_t* yuyv, uint8_t* half, uint32_t width, uint32_t height);
+void jpeg(FILE* dest, uint8_t* rgb, uint32_t width, uint32_t height, int quality);
+// encodes into a caller buffer, returns the jpeg size or 0 if it does not fit.
+// Reuses one compressor across calls, so it is meant for a single encoding thread
+size_t jpeg_mem(uint8_t* dest, size_t capacity, const uint8_t* rgb,
+                uint32_t width, uint32_t height, int quality);
+// single component jpeg of a gray image, as jpeg_mem. Always on the calling
+// thread: a gray frame is cheap enough not to need the strip workers
+size_t jpeg_mem_gray(uint8_t* dest, size_t capacity, const uint8_t* gray,
+                     uint32_t width, uint32_t height, int quality);
+
+// splits each frame encoded by jpeg() in horizontal strips encoded by workers threads
+// workers<=1 encodes the whole frame on the calling thread (default)
+void jpeg_set_workers(int workers);
+int jpeg_workers(void);
+
+// coding of the jpeg_mem and jpeg_mem_gray frames that follow
+#define JPEG_ABBREVIATED 0x1      // no tables in the frames, the decoder gets them from jpeg_mem_tables
+#define JPEG_OPTIMIZE_CODING 0x2  // huffman tables fitted to each frame: smaller, slower. Not with the strip workers
+void jpeg_set_options(int options);
+int jpeg_options(void);
+// tables-only jpeg (quantization and huffman) that decodes the abbreviated
+// frames of that quality, color or gray. Any thread, 0 if it does not fit
+size_t jpeg_mem_tables(uint8_t* dest, size_t capacity, int quality);
+
+// codecs of the video encoders, the values go on the wire (RRC_CODEC_*)
+typedef enum {
+	VideoCodecJpeg = 0,
+	VideoCodecVp8 = 1,    // built with RRC_WITH_VPX only
+	VideoCodecCount
+} video_codec_t;
+
+struct video_encoder_t;
+
+// a video codec: yuyv captures in, coded frames out
+typedef struct video_encoder_backend_t{
+	const char* name;
+	int inter;            // frames depend on the previous ones: they cannot be encoded again
+	int (*init)(struct video_encoder_t* enc);     // 0 on success
+	// returns the size, 0 if it does not fit or on errors. Sets enc->keyframe
+	size_t (*encode)(struct video_encoder_t* enc, const uint8_t* yuyv, uint32_t width, uint32_t height,
+	                 uint64_t stamp_us, uint8_t* dest, size_t capacity);
+	void (*destroy)(struct video_encoder_t* enc);
+} video_encoder_backend_t;
+
+typedef struct video_encoder_t{
+	video_codec_t codec;
+	int gray;             // luma only
+	int quality;          // jpeg quality
+	int scale;            // frames are encoded at 1/scale of the capture
+	uint32_t bitrate;     // bits/s the inter-frame codecs aim at, 0 for their default
+	int force_keyframe;   // the next frame must decode on its own
+	int keyframe;         // the last frame encoded decodes on its own
+	uint8_t* pixels;      // the capture converted for the codec
+	size_t pixels_capacity;
+
+	const video_encoder_backend_t* backend;
+	void* backend_data;   // private to the backend
+} video_encoder_t;
+
+const char* video_codec_name(video_codec_t codec);
+// 1 if the codec is built in
+int video_encoder_available(video_codec_t codec);
+// NULL if the codec is not built in or cannot start
+video_encoder_t* video_encoder_create(video_codec_t codec, int gray);
+void video_encoder_destroy(video_encoder_t* enc);
+// jpeg quality and downscale of the frames that follow
+void video_encoder_set_quality(video_encoder_t* enc, int quality, int scale);
+// target of the inter-frame codecs, the jpeg one follows the quality
+void video_encoder_set_bitrate(video_encoder_t* enc, uint32_t bitrate);
+void video_encoder_force_keyframe(video_encoder_t* enc);
+// encodes a yuyv capture into a caller buffer, stamp_us is its capture time.
+// Returns the size, 0 if it does not fit: an inter-frame codec then starts
+// again from a keyframe. Also 0 if the scaled frame is empty or the
+// conversion buffer cannot be allocated
+size_t video_encoder_encode(video_encoder_t* enc, const uint8_t* yuyv, uint32_t width, uint32_t height,
+                            uint64_t stamp_us, uint8_t* dest, size_t capacity);
@@ -0,0 +1,57 @@
+#include <string.h>
+#include <time.h>
+#include "command_mailbox.h"
+
+void command_mailbox_init(command_mailbox_t* mb){
+  memset(mb, 0, sizeof(command_mailbox_t));
+}
+
+uint64_t command_now_us(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+uint32_t command_mailbox_post(command_mailbox_t* mb, float tv, float rv, uint64_t stamp_us){
+  command_t command;
+  uint32_t words[COMMAND_WORDS];
+  // the writer is the only one changing the words, it can read them plainly
+  memcpy(&command, mb->words, sizeof(command));
+  command.translational_velocity = tv;
+  command.rotational_velocity = rv;
+  command.seq++;
+  command.pad = 0;
+  command.stamp_us = stamp_us;
+  memcpy(words, &command, sizeof(words));
+
+  uint32_t version = __atomic_load_n(&mb->version, __ATOMIC_RELAXED);
+  __atomic_store_n(&mb->version, version + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  for (size_t i = 0; i < COMMAND_WORDS; ++i)
+    __atomic_store_n(mb->words + i, words[i], __ATOMIC_RELAXED);
+  __atomic_store_n(&mb->version, version + 2, __ATOMIC_RELEASE);
+  return command.seq;
+}
+
+void command_mailbox_read(const command_mailbox_t* mb, command_t* command){
+  uint32_t words[COMMAND_WORDS];
+  uint32_t before, after;
+  do {
+    before = __atomic_load_n(&mb->version, __ATOMIC_ACQUIRE);
+    for (size_t i = 0; i < COMMAND_WORDS; ++i)
+      words[i] = __atomic_load_n(mb->words + i, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    after = __atomic_load_n(&mb->version, __ATOMIC_RELAXED);
+  } while ((before & 1) || before != after);
+  memcpy(command, words, sizeof(words));
+}
+
+int command_mailbox_poll(const command_mailbox_t* mb, uint32_t* last_seq, command_t* command){
+  command_t c;
+  command_mailbox_read(mb, &c);
+  if (c.seq == *last_seq)
+    return 0;
+  *last_seq = c.seq;
+  *command = c;
+  return 1;
+}
@@ -0,0 +1,38 @@
+#pragma once
+#include <stdint.h>
+
+/*
+  Single writer, multi reader mailbox holding the last velocity command.
+  It is a seqlock: the writer never waits, the readers retry if they
+  overlapped a write, so a reader always gets a consistent tuple.
+  Only one thread may post to a given mailbox.
+*/
+
+typedef struct command_t{
+  float translational_velocity;
+  float rotational_velocity;
+  uint32_t seq;        // increases with each post, 0 means no command yet
+  uint32_t pad;
+  uint64_t stamp_us;   // command_now_us() of the post
+} command_t;
+
+#define COMMAND_WORDS (sizeof(command_t) / sizeof(uint32_t))
+
+typedef struct command_mailbox_t{
+  uint32_t version;    // odd while a write is in progress
+  uint32_t words[COMMAND_WORDS];
+} command_mailbox_t;
+
+void command_mailbox_init(command_mailbox_t* mb);
+
+// monotonic clock used for the stamps
+uint64_t command_now_us(void);
+
+// wait free, returns the seq of the new command
+uint32_t command_mailbox_post(command_mailbox_t* mb, float tv, float rv, uint64_t stamp_us);
+
+// copies the last command
+void command_mailbox_read(const command_mailbox_t* mb, command_t* command);
+
+// copies the last command if it is newer than *last_seq and updates it, returns 1 in that case
+int command_mailbox_poll(const command_mailbox_t* mb, uint32_t* last_seq, command_t* command);
@@ -0,0 +1,115 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include "frame_pool.h"
+
+#define HUGE_PAGE_SIZE (2UL << 20)
+
+static size_t _round_up(size_t v, size_t to){
+  return (v + to - 1) / to * to;
+}
+
+frame_pool_t* frame_pool_create(size_t buffer_size, size_t count, int flags){
+  frame_pool_t* pool = calloc(1, sizeof(frame_pool_t));
+  pool->buffer_size = _round_up(buffer_size, FRAME_POOL_ALIGN);
+  pool->count = count;
+  pool->memory_size = pool->buffer_size * count;
+
+  // mmap gives page aligned memory, hence each buffer starts on a cache line
+  pool->memory = MAP_FAILED;
+  if (flags & FRAME_POOL_HUGEPAGES){
+    size_t size = _round_up(pool->memory_size, HUGE_PAGE_SIZE);
+    pool->memory = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (pool->memory != MAP_FAILED){
+      pool->memory_size = size;
+      pool->flags |= FRAME_POOL_HUGEPAGES;
+    }
+    else
+      fprintf(stderr, "[frame_pool] no huge pages (%s), using normal pages\n", strerror(errno));
+  }
+  if (pool->memory == MAP_FAILED){
+    pool->memory = mmap(NULL, pool->memory_size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (pool->memory == MAP_FAILED){
+      free(pool);
+      return NULL;
+    }
+  }
+  if (flags & FRAME_POOL_MLOCK){
+    if (!mlock(pool->memory, pool->memory_size))
+      pool->flags |= FRAME_POOL_MLOCK;
+    else
+      fprintf(stderr, "[frame_pool] mlock failed (%s)\n", strerror(errno));
+  }
+
+  pool->buffers = calloc(count, sizeof(frame_buffer_t));
+  for (size_t i = 0; i < count; ++i){
+    frame_buffer_t* b = pool->buffers + i;
+    b->data = pool->memory + i * pool->buffer_size;
+    b->capacity = pool->buffer_size;
+    b->pool = pool;
+    b->next = pool->free_list;
+    pool->free_list = b;
+  }
+  pthread_mutex_init(&pool->lock, NULL);
+  return pool;
+}
+
+void frame_pool_destroy(frame_pool_t* pool){
+  if (pool->in_use)
+    fprintf(stderr, "[frame_pool] destroying pool with %zu buffers in use\n", pool->in_use);
+  if (pool->flags & FRAME_POOL_MLOCK)
+    munlock(pool->memory, pool->memory_size);
+  munmap(pool->memory, pool->memory_size);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool->buffers);
+  free(pool);
+}
+
+void frame_pool_retire(frame_pool_t* pool){
+  pthread_mutex_lock(&pool->lock);
+  pool->retired = 1;
+  int idle = !pool->in_use;
+  pthread_mutex_unlock(&pool->lock);
+  if (idle)
+    frame_pool_destroy(pool);
+}
+
+frame_buffer_t* frame_pool_get(frame_pool_t* pool){
+  pthread_mutex_lock(&pool->lock);
+  frame_buffer_t* b = pool->free_list;
+  if (b){
+    pool->free_list = b->next;
+    ++pool->in_use;
+  }
+  else
+    ++pool->exhausted;
+  pthread_mutex_unlock(&pool->lock);
+  if (b){
+    b->next = NULL;
+    b->length = 0;
+    b->refcount = 1;
+  }
+  return b;
+}
+
+void frame_buffer_ref(frame_buffer_t* buffer){
+  __atomic_add_fetch(&buffer->refcount, 1, __ATOMIC_RELAXED);
+}
+
+void frame_buffer_unref(frame_buffer_t* buffer){
+  if (__atomic_sub_fetch(&buffer->refcount, 1, __ATOMIC_ACQ_REL))
+    return;
+  frame_pool_t* pool = buffer->pool;
+  pthread_mutex_lock(&pool->lock);
+  buffer->next = pool->free_list;
+  pool->free_list = buffer;
+  --pool->in_use;
+  int idle = pool->retired && !pool->in_use;
+  pthread_mutex_unlock(&pool->lock);
+  if (idle)
+    frame_pool_destroy(pool);
+}
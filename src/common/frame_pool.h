@@ -0,0 +1,59 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+/*
+  Fixed-size pool of cache-line aligned, refcounted frame buffers.
+  All the memory is reserved at creation, so getting and releasing
+  a buffer never touches the heap.
+*/
+
+#define FRAME_POOL_ALIGN 64
+
+#define FRAME_POOL_HUGEPAGES 0x1  // back the pool with huge pages (falls back to normal pages)
+#define FRAME_POOL_MLOCK     0x2  // lock the pool in ram
+
+struct frame_pool_t;
+
+typedef struct frame_buffer_t{
+  uint8_t* data;                 // FRAME_POOL_ALIGN aligned
+  size_t capacity;
+  size_t length;                 // bytes used by the owner
+  int refcount;
+  struct frame_pool_t* pool;
+  struct frame_buffer_t* next;   // free list
+} frame_buffer_t;
+
+typedef struct frame_pool_t{
+  uint8_t* memory;
+  size_t memory_size;
+  size_t buffer_size;
+  size_t count;
+  int flags;                     // flags actually obtained
+  frame_buffer_t* buffers;
+  frame_buffer_t* free_list;
+  size_t in_use;
+  size_t exhausted;              // number of failed gets
+  int retired;                   // destroyed when the last buffer comes back
+  pthread_mutex_t lock;
+} frame_pool_t;
+
+// reserves count buffers of at least buffer_size bytes
+frame_pool_t* frame_pool_create(size_t buffer_size, size_t count, int flags);
+
+// releases the memory, all buffers should be returned
+void frame_pool_destroy(frame_pool_t* pool);
+
+// the owner is done with the pool: it is destroyed now if no buffer is in
+// use, else by the release of the last one
+void frame_pool_retire(frame_pool_t* pool);
+
+// takes a buffer with refcount 1, NULL if the pool is exhausted
+frame_buffer_t* frame_pool_get(frame_pool_t* pool);
+
+// adds a reference to a buffer
+void frame_buffer_ref(frame_buffer_t* buffer);
+
+// drops a reference, the buffer goes back to its pool when no one holds it
+void frame_buffer_unref(frame_buffer_t* buffer);
@@ -0,0 +1,103 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <setjmp.h>
+#include <jpeglib.h>
+#include "jpeg_decoder.h"
+
+typedef struct decoder_error_t{
+  struct jpeg_error_mgr mgr;
+  jmp_buf escape;
+} decoder_error_t;
+
+struct jpeg_decoder_t{
+  struct jpeg_decompress_struct decompress;
+  decoder_error_t error;
+  uint8_t* image;
+  size_t image_capacity;
+  JSAMPROW* rows;
+  uint32_t rows_capacity;
+};
+
+// the default handler exits, we go back to jpeg_decoder_decode
+static void _error_exit(j_common_ptr cinfo){
+  decoder_error_t* error = (decoder_error_t*) cinfo->err;
+  longjmp(error->escape, 1);
+}
+
+// corrupt data warnings would flood the console on a lossy link
+static void _output_message(j_common_ptr cinfo){
+}
+
+jpeg_decoder_t* jpeg_decoder_create(void){
+  jpeg_decoder_t* dec = calloc(1, sizeof(jpeg_decoder_t));
+  dec->decompress.err = jpeg_std_error(&dec->error.mgr);
+  dec->error.mgr.error_exit = _error_exit;
+  dec->error.mgr.output_message = _output_message;
+  jpeg_create_decompress(&dec->decompress);
+  return dec;
+}
+
+void jpeg_decoder_destroy(jpeg_decoder_t* dec){
+  jpeg_destroy_decompress(&dec->decompress);
+  free(dec->rows);
+  free(dec->image);
+  free(dec);
+}
+
+int jpeg_decoder_load_tables(jpeg_decoder_t* dec, const uint8_t* tables, size_t size){
+  struct jpeg_decompress_struct* d = &dec->decompress;
+  if (setjmp(dec->error.escape)){
+    jpeg_abort_decompress(d);
+    return -1;
+  }
+  // the tables live in the permanent pool of the decompressor, read_header
+  // goes back to the start state after the EOI
+  jpeg_mem_src(d, tables, size);
+  if (jpeg_read_header(d, FALSE) != JPEG_HEADER_TABLES_ONLY){
+    jpeg_abort_decompress(d);
+    return -1;
+  }
+  return 0;
+}
+
+int jpeg_decoder_decode(jpeg_decoder_t* dec, const uint8_t* jpeg, size_t size,
+                        uint8_t** bgr, uint32_t* width, uint32_t* height){
+  struct jpeg_decompress_struct* d = &dec->decompress;
+  if (setjmp(dec->error.escape)){
+    // back to a clean state for the next frame
+    jpeg_abort_decompress(d);
+    return -1;
+  }
+  jpeg_mem_src(d, jpeg, size);
+  if (jpeg_read_header(d, TRUE) != JPEG_HEADER_OK){
+    jpeg_abort_decompress(d);
+    return -1;
+  }
+  d->out_color_space = JCS_EXT_BGR;
+  d->dct_method = JDCT_IFAST;
+  jpeg_start_decompress(d);
+
+  uint32_t w = d->output_width;
+  uint32_t h = d->output_height;
+  size_t stride = (size_t) w * 3;
+  if (dec->image_capacity < stride * h){
+    free(dec->image);
+    dec->image_capacity = stride * h;
+    dec->image = malloc(dec->image_capacity);
+  }
+  if (dec->rows_capacity < h){
+    free(dec->rows);
+    dec->rows_capacity = h;
+    dec->rows = malloc(h * sizeof(JSAMPROW));
+  }
+  for (uint32_t r = 0; r < h; ++r)
+    dec->rows[r] = dec->image + r * stride;
+  while (d->output_scanline < h)
+    jpeg_read_scanlines(d, dec->rows + d->output_scanline, h - d->output_scanline);
+  jpeg_finish_decompress(d);
+
+  *bgr = dec->image;
+  *width = w;
+  *height = h;
+  return 0;
+}
@@ -0,0 +1,27 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+  In memory JPEG decoder.
+  Keeps the libjpeg decompressor and the output image between frames, so that
+  decoding a stream of frames of the same size does not allocate.
+  A corrupted frame makes the call fail instead of terminating the program.
+  Abbreviated frames (without quantization and huffman tables) decode with
+  the tables loaded last, by jpeg_decoder_load_tables or by a full frame.
+*/
+
+typedef struct jpeg_decoder_t jpeg_decoder_t;
+
+jpeg_decoder_t* jpeg_decoder_create(void);
+
+void jpeg_decoder_destroy(jpeg_decoder_t* dec);
+
+// decodes into the internal packed bgr image, valid until the next call.
+// Returns 0 on success, -1 if the data is not a valid jpeg
+int jpeg_decoder_decode(jpeg_decoder_t* dec, const uint8_t* jpeg, size_t size,
+                        uint8_t** bgr, uint32_t* width, uint32_t* height);
+
+// loads the tables of a tables-only jpeg for the abbreviated frames that follow.
+// Returns 0 on success, -1 if the data holds no tables or an image
+int jpeg_decoder_load_tables(jpeg_decoder_t* dec, const uint8_t* tables, size_t size);
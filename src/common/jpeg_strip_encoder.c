@@ -0,0 +1,284 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <jpeglib.h>
+#include "jpeg_strip_encoder.h"
+
+// jpeg_set_defaults on rgb input subsamples chroma 2x2, so one MCU row is 16 pixel rows
+#define JPEG_MCU_HEIGHT 16
+
+#define JPEG_MARKER_SOF0 0xC0
+#define JPEG_MARKER_RST0 0xD0
+#define JPEG_MARKER_RST7 0xD7
+#define JPEG_MARKER_EOI  0xD9
+#define JPEG_MARKER_SOS  0xDA
+
+typedef struct strip_t{
+  struct jpeg_compress_struct compress;
+  struct jpeg_error_mgr error;
+  const uint8_t* rgb;   // first row of the strip
+  uint32_t width;
+  uint32_t height;
+  int quality;
+  int restart;          // restart marker after each MCU row
+  int abbreviated;      // no tables in the output
+  JSAMPROW* rows;       // row pointers into rgb, no copy
+  uint32_t rows_capacity;
+  uint8_t* out;         // encoded strip
+  unsigned long out_capacity;
+  unsigned long out_size;
+} strip_t;
+
+typedef struct worker_args_t{
+  jpeg_strip_encoder_t* enc;
+  int index;
+} worker_args_t;
+
+struct jpeg_strip_encoder_t{
+  int workers;
+  strip_t* strips;
+  pthread_t* threads;
+  worker_args_t* args;
+
+  pthread_mutex_t lock;
+  pthread_cond_t start_cond;
+  pthread_cond_t done_cond;
+  unsigned int generation;  // bumped for each frame handed to the workers
+  int active;               // strips in the current frame
+  int pending;              // strips still being encoded by the workers
+  int quit;
+};
+
+static void _encode_strip(strip_t* s){
+  if (s->rows_capacity < s->height){
+    s->rows = realloc(s->rows, s->height * sizeof(JSAMPROW));
+    s->rows_capacity = s->height;
+  }
+  for (uint32_t r = 0; r < s->height; ++r)
+    s->rows[r] = (JSAMPROW) (s->rgb + (size_t) r * s->width * 3);
+
+  // jpeg_mem_dest only allocates if the buffer we hand over is too small
+  unsigned char* out = s->out;
+  unsigned long out_size = s->out_capacity;
+  jpeg_mem_dest(&s->compress, &out, &out_size);
+
+  s->compress.image_width = s->width;
+  s->compress.image_height = s->height;
+  s->compress.input_components = 3;
+  s->compress.in_color_space = JCS_RGB;
+  jpeg_set_defaults(&s->compress);
+  jpeg_set_quality(&s->compress, s->quality, TRUE);
+  s->compress.restart_in_rows = s->restart;
+  if (s->abbreviated)
+    jpeg_suppress_tables(&s->compress, TRUE);
+  jpeg_start_compress(&s->compress, !s->abbreviated);
+  jpeg_write_scanlines(&s->compress, s->rows, s->height);
+  jpeg_finish_compress(&s->compress);
+
+  if (out != s->out){
+    free(s->out);
+    s->out = out;
+    s->out_capacity = out_size;
+  }
+  s->out_size = out_size;
+}
+
+static void* _worker_fn(void* args_){
+  worker_args_t* args = (worker_args_t*) args_;
+  jpeg_strip_encoder_t* enc = args->enc;
+  unsigned int seen = 0;
+  pthread_mutex_lock(&enc->lock);
+  while (1){
+    while (!enc->quit && enc->generation == seen)
+      pthread_cond_wait(&enc->start_cond, &enc->lock);
+    if (enc->quit)
+      break;
+    seen = enc->generation;
+    if (args->index >= enc->active)
+      continue;
+    pthread_mutex_unlock(&enc->lock);
+    _encode_strip(enc->strips + args->index);
+    pthread_mutex_lock(&enc->lock);
+    if (!--enc->pending)
+      pthread_cond_signal(&enc->done_cond);
+  }
+  pthread_mutex_unlock(&enc->lock);
+  return 0;
+}
+
+jpeg_strip_encoder_t* jpeg_strip_encoder_create(int workers){
+  if (workers < 1)
+    workers = 1;
+  jpeg_strip_encoder_t* enc = calloc(1, sizeof(jpeg_strip_encoder_t));
+  enc->workers = workers;
+  enc->strips = calloc(workers, sizeof(strip_t));
+  enc->threads = calloc(workers, sizeof(pthread_t));
+  enc->args = calloc(workers, sizeof(worker_args_t));
+  pthread_mutex_init(&enc->lock, NULL);
+  pthread_cond_init(&enc->start_cond, NULL);
+  pthread_cond_init(&enc->done_cond, NULL);
+  for (int i = 0; i < workers; ++i){
+    strip_t* s = enc->strips + i;
+    s->compress.err = jpeg_std_error(&s->error);
+    jpeg_create_compress(&s->compress);
+  }
+  // strip 0 is encoded by the caller
+  for (int i = 1; i < workers; ++i){
+    enc->args[i].enc = enc;
+    enc->args[i].index = i;
+    pthread_create(enc->threads + i, NULL, _worker_fn, enc->args + i);
+  }
+  return enc;
+}
+
+void jpeg_strip_encoder_destroy(jpeg_strip_encoder_t* enc){
+  pthread_mutex_lock(&enc->lock);
+  enc->quit = 1;
+  pthread_cond_broadcast(&enc->start_cond);
+  pthread_mutex_unlock(&enc->lock);
+  for (int i = 1; i < enc->workers; ++i)
+    pthread_join(enc->threads[i], NULL);
+  for (int i = 0; i < enc->workers; ++i){
+    strip_t* s = enc->strips + i;
+    jpeg_destroy_compress(&s->compress);
+    free(s->rows);
+    free(s->out);
+  }
+  pthread_cond_destroy(&enc->done_cond);
+  pthread_cond_destroy(&enc->start_cond);
+  pthread_mutex_destroy(&enc->lock);
+  free(enc->args);
+  free(enc->threads);
+  free(enc->strips);
+  free(enc);
+}
+
+int jpeg_strip_encoder_workers(jpeg_strip_encoder_t* enc){
+  return enc->workers;
+}
+
+/*
+  walks the marker segments of a jpeg header and returns the offset
+  of the requested marker, or 0 if the scan starts before it
+*/
+static size_t _find_marker(const uint8_t* buf, size_t size, uint8_t marker){
+  size_t pos = 2; // skip SOI
+  while (pos + 4 <= size && buf[pos] == 0xFF){
+    uint8_t m = buf[pos + 1];
+    if (m == marker)
+      return pos;
+    if (m == JPEG_MARKER_SOS)
+      return 0;
+    pos += 2 + ((buf[pos + 2] << 8) | buf[pos + 3]);
+  }
+  return 0;
+}
+
+static size_t _scan_start(const uint8_t* buf, size_t size){
+  size_t sos = _find_marker(buf, size, JPEG_MARKER_SOS);
+  if (!sos)
+    return 0;
+  return sos + 2 + ((buf[sos + 2] << 8) | buf[sos + 3]);
+}
+
+/*
+  copies the entropy coded segment of a strip rewriting each RSTn so that the
+  numbering continues from *restarts. Byte stuffing guarantees that 0xFF
+  followed by D0-D7 inside the scan can only be a restart marker
+*/
+static uint8_t* _copy_scan(uint8_t* dest, const uint8_t* src, size_t size, unsigned int* restarts){
+  const uint8_t* end = src + size;
+  while (src < end){
+    const uint8_t* ff = memchr(src, 0xFF, end - src);
+    if (!ff || ff + 1 >= end){
+      memcpy(dest, src, end - src);
+      return dest + (end - src);
+    }
+    size_t run = ff - src + 1;
+    memcpy(dest, src, run);
+    dest += run;
+    src = ff + 1;
+    if (*src >= JPEG_MARKER_RST0 && *src <= JPEG_MARKER_RST7){
+      *dest++ = JPEG_MARKER_RST0 + (*restarts & 7);
+      ++*restarts;
+      ++src;
+    }
+  }
+  return dest;
+}
+
+size_t jpeg_strip_encoder_encode(jpeg_strip_encoder_t* enc, uint8_t* dest, size_t capacity,
+                                 const uint8_t* rgb, uint32_t width, uint32_t height,
+                                 int quality, int abbreviated){
+  uint32_t mcu_rows = (height + JPEG_MCU_HEIGHT - 1) / JPEG_MCU_HEIGHT;
+  uint32_t strip_rows = (mcu_rows + enc->workers - 1) / enc->workers * JPEG_MCU_HEIGHT;
+  int active = (height + strip_rows - 1) / strip_rows;
+
+  for (int i = 0; i < active; ++i){
+    strip_t* s = enc->strips + i;
+    uint32_t first_row = i * strip_rows;
+    s->rgb = rgb + (size_t) first_row * width * 3;
+    s->width = width;
+    s->height = (i == active - 1) ? height - first_row : strip_rows;
+    s->quality = quality;
+    s->restart = active > 1;
+    s->abbreviated = abbreviated;
+  }
+
+  pthread_mutex_lock(&enc->lock);
+  enc->active = active;
+  enc->pending = active - 1;
+  ++enc->generation;
+  pthread_cond_broadcast(&enc->start_cond);
+  pthread_mutex_unlock(&enc->lock);
+
+  _encode_strip(enc->strips);
+
+  pthread_mutex_lock(&enc->lock);
+  while (enc->pending)
+    pthread_cond_wait(&enc->done_cond, &enc->lock);
+  pthread_mutex_unlock(&enc->lock);
+
+  // worst case: every strip plus one RST marker between strips
+  size_t needed = 0;
+  for (int i = 0; i < active; ++i)
+    needed += enc->strips[i].out_size + 2;
+  if (needed > capacity)
+    return 0;
+
+  if (active == 1){
+    memcpy(dest, enc->strips[0].out, enc->strips[0].out_size);
+    return enc->strips[0].out_size;
+  }
+
+  // header (tables unless abbreviated, DRI, SOF, SOS) comes from the first strip, with the full height
+  const strip_t* first = enc->strips;
+  size_t header_size = _scan_start(first->out, first->out_size);
+  size_t sof = _find_marker(first->out, first->out_size, JPEG_MARKER_SOF0);
+  if (!header_size || !sof)
+    return 0;
+  uint8_t* out = dest;
+  memcpy(out, first->out, header_size);
+  out[sof + 5] = height >> 8;
+  out[sof + 6] = height & 0xFF;
+  out += header_size;
+
+  unsigned int restarts = 0;
+  for (int i = 0; i < active; ++i){
+    const strip_t* s = enc->strips + i;
+    size_t scan = _scan_start(s->out, s->out_size);
+    if (!scan)
+      return 0;
+    out = _copy_scan(out, s->out + scan, s->out_size - scan - 2, &restarts);
+    if (i < active - 1){
+      *out++ = 0xFF;
+      *out++ = JPEG_MARKER_RST0 + (restarts & 7);
+      ++restarts;
+    }
+  }
+  *out++ = 0xFF;
+  *out++ = JPEG_MARKER_EOI;
+
+  return out - dest;
+}
@@ -0,0 +1,30 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+  Strip-parallel baseline JPEG encoder.
+  The frame is cut into horizontal strips whose height is a multiple of the MCU
+  height. Each strip is encoded on its own worker with a restart marker after
+  every MCU row, then the strips are stitched into a single JPEG bitstream
+  by renumbering the RSTn markers and inserting one between strips.
+  The strips always use the standard huffman tables: tables optimized for
+  each strip could not be shared by the stitched scan.
+*/
+
+typedef struct jpeg_strip_encoder_t jpeg_strip_encoder_t;
+
+// creates an encoder with workers threads (the caller thread encodes the first strip)
+jpeg_strip_encoder_t* jpeg_strip_encoder_create(int workers);
+
+// joins the workers and releases the buffers
+void jpeg_strip_encoder_destroy(jpeg_strip_encoder_t* enc);
+
+// number of strips a frame is split into
+int jpeg_strip_encoder_workers(jpeg_strip_encoder_t* enc);
+
+// encodes a packed rgb image into dest, abbreviated leaves the tables out.
+// Returns the size of the jpeg, 0 on error or if it does not fit in capacity
+size_t jpeg_strip_encoder_encode(jpeg_strip_encoder_t* enc, uint8_t* dest, size_t capacity,
+                                 const uint8_t* rgb, uint32_t width, uint32_t height,
+                                 int quality, int abbreviated);
@@ -0,0 +1,58 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "latency_stats.h"
+
+void latency_stats_init(latency_stats_t* ls){
+  ls->count = 0;
+  ls->next = 0;
+  ls->total = 0;
+}
+
+void latency_stats_add(latency_stats_t* ls, int64_t us){
+  // clock offsets can make a tiny latency come out negative
+  if (us < 0)
+    us = 0;
+  if (us > UINT32_MAX)
+    us = UINT32_MAX;
+  ls->samples[ls->next] = us;
+  ls->next = (ls->next + 1) % LATENCY_WINDOW;
+  if (ls->count < LATENCY_WINDOW)
+    ++ls->count;
+  ++ls->total;
+}
+
+static int _compare(const void* a, const void* b){
+  uint32_t x = *(const uint32_t*) a;
+  uint32_t y = *(const uint32_t*) b;
+  return (x > y) - (x < y);
+}
+
+static size_t _sorted(const latency_stats_t* ls, uint32_t* sorted){
+  memcpy(sorted, ls->samples, ls->count * sizeof(uint32_t));
+  qsort(sorted, ls->count, sizeof(uint32_t), _compare);
+  return ls->count;
+}
+
+static uint32_t _at(const uint32_t* sorted, size_t count, float p){
+  size_t idx = p * (count - 1) + 0.5f;
+  return sorted[idx];
+}
+
+uint32_t latency_stats_percentile(const latency_stats_t* ls, float p){
+  if (!ls->count)
+    return 0;
+  uint32_t sorted[LATENCY_WINDOW];
+  size_t count = _sorted(ls, sorted);
+  return _at(sorted, count, p);
+}
+
+int latency_stats_format(const latency_stats_t* ls, char* buf, size_t size){
+  if (!ls->count)
+    return snprintf(buf, size, "no samples");
+  uint32_t sorted[LATENCY_WINDOW];
+  size_t count = _sorted(ls, sorted);
+  return snprintf(buf, size, "p50 %uus p99 %uus max %uus (n %zu)",
+                  _at(sorted, count, 0.5f), _at(sorted, count, 0.99f),
+                  sorted[count - 1], count);
+}
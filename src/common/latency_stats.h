@@ -0,0 +1,27 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+  Rolling latency statistics over the last LATENCY_WINDOW samples (microseconds).
+  Not thread safe: each instance is fed and read by one thread.
+*/
+
+#define LATENCY_WINDOW 1024
+
+typedef struct latency_stats_t{
+  uint32_t samples[LATENCY_WINDOW];
+  size_t count;       // valid samples, up to LATENCY_WINDOW
+  size_t next;        // slot of the next sample
+  uint64_t total;     // samples ever added
+} latency_stats_t;
+
+void latency_stats_init(latency_stats_t* ls);
+
+void latency_stats_add(latency_stats_t* ls, int64_t us);
+
+// p in [0,1]; 0 if there are no samples
+uint32_t latency_stats_percentile(const latency_stats_t* ls, float p);
+
+// writes "p50 <us> p99 <us> max <us> (n <count>)" into buf, returns the length
+int latency_stats_format(const latency_stats_t* ls, char* buf, size_t size);
@@ -0,0 +1,163 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "motion_gate.h"
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+static uint64_t _now_us(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void motion_gate_init(motion_gate_t* gate, int threshold, uint64_t refresh_us){
+  memset(gate, 0, sizeof(motion_gate_t));
+  gate->threshold = threshold;
+  gate->refresh_us = refresh_us;
+}
+
+void motion_gate_destroy(motion_gate_t* gate){
+  free(gate->reference);
+  free(gate->current);
+  gate->reference = gate->current = NULL;
+  gate->capacity = 0;
+  gate->valid = 0;
+}
+
+void motion_gate_reset(motion_gate_t* gate){
+  gate->valid = 0;
+}
+
+void motion_gate_stats_reset(motion_gate_t* gate){
+  gate->passed = 0;
+  gate->skipped = 0;
+  gate->check_us = 0;
+}
+
+/*
+  the Y0 of each macropixel, every other row: 16 macropixels (64 bytes)
+  at a time with SSE2 (mask the first byte of each 32 bit lane and pack
+  twice) or NEON (load de-interleaving by 4), the rest one by one
+*/
+void motion_gate_thumbnail(const uint8_t* yuyv, uint8_t* thumb, uint32_t width, uint32_t height){
+  uint32_t thumb_width = width / 2;
+  uint32_t thumb_height = height / 2;
+#if defined(__SSE2__)
+  const __m128i first = _mm_set1_epi32(0xFF);
+#endif
+  for (uint32_t r = 0; r < thumb_height; ++r){
+    const uint8_t* row = yuyv + (size_t) r * 2 * width * 2;
+    uint8_t* out = thumb + (size_t) r * thumb_width;
+    uint32_t c = 0;
+#if defined(__SSE2__)
+    for (; c + 16 <= thumb_width; c += 16){
+      const __m128i* p = (const __m128i*) (row + c * 4);
+      __m128i a = _mm_and_si128(_mm_loadu_si128(p), first);
+      __m128i b = _mm_and_si128(_mm_loadu_si128(p + 1), first);
+      __m128i d = _mm_and_si128(_mm_loadu_si128(p + 2), first);
+      __m128i e = _mm_and_si128(_mm_loadu_si128(p + 3), first);
+      __m128i y = _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(d, e));
+      _mm_storeu_si128((__m128i*) (out + c), y);
+    }
+#elif defined(__ARM_NEON)
+    for (; c + 16 <= thumb_width; c += 16){
+      uint8x16x4_t macropixels = vld4q_u8(row + c * 4);
+      vst1q_u8(out + c, macropixels.val[0]);
+    }
+#endif
+    for (; c < thumb_width; ++c)
+      out[c] = row[c * 4];
+  }
+}
+
+// sum of absolute differences of 16 bytes
+static inline uint32_t _sad16(const uint8_t* a, const uint8_t* b){
+#if defined(__SSE2__)
+  __m128i sad = _mm_sad_epu8(_mm_loadu_si128((const __m128i*) a), _mm_loadu_si128((const __m128i*) b));
+  return _mm_cvtsi128_si32(sad) + _mm_cvtsi128_si32(_mm_srli_si128(sad, 8));
+#elif defined(__ARM_NEON)
+  uint8x16_t va = vld1q_u8(a);
+  uint8x16_t vb = vld1q_u8(b);
+  uint16x8_t diff = vabdl_u8(vget_low_u8(va), vget_low_u8(vb));
+  diff = vabal_u8(diff, vget_high_u8(va), vget_high_u8(vb));
+  uint64x2_t sum = vpaddlq_u32(vpaddlq_u16(diff));
+  return vgetq_lane_u64(sum, 0) + vgetq_lane_u64(sum, 1);
+#else
+  uint32_t sad = 0;
+  for (int i = 0; i < 16; ++i)
+    sad += abs(a[i] - b[i]);
+  return sad;
+#endif
+}
+
+int motion_gate_difference(const uint8_t* a, const uint8_t* b, uint32_t width, uint32_t height){
+  uint32_t largest = 0;
+  for (uint32_t ty = 0; ty < height; ty += MOTION_TILE){
+    uint32_t rows = height - ty < MOTION_TILE ? height - ty : MOTION_TILE;
+    for (uint32_t tx = 0; tx < width; tx += MOTION_TILE){
+      uint32_t cols = width - tx < MOTION_TILE ? width - tx : MOTION_TILE;
+      uint32_t sad = 0;
+      for (uint32_t r = ty; r < ty + rows; ++r){
+        const uint8_t* pa = a + (size_t) r * width + tx;
+        const uint8_t* pb = b + (size_t) r * width + tx;
+        if (cols == MOTION_TILE)
+          sad += _sad16(pa, pb);
+        else
+          for (uint32_t c = 0; c < cols; ++c)
+            sad += abs(pa[c] - pb[c]);
+      }
+      uint32_t mean = sad / (rows * cols);
+      if (mean > largest)
+        largest = mean;
+    }
+  }
+  return largest;
+}
+
+int motion_gate_check(motion_gate_t* gate, const uint8_t* yuyv,
+                      uint32_t width, uint32_t height, uint64_t now_us){
+  if (gate->threshold <= 0){
+    ++gate->passed;
+    return 1;
+  }
+  uint64_t start = _now_us();
+  uint32_t thumb_width = width / 2;
+  uint32_t thumb_height = height / 2;
+  size_t size = (size_t) thumb_width * thumb_height;
+  if (size > gate->capacity){
+    free(gate->reference);
+    free(gate->current);
+    gate->reference = malloc(size);
+    gate->current = malloc(size);
+    gate->capacity = size;
+    gate->valid = 0;
+  }
+  // a new format always passes
+  if (thumb_width != gate->width || thumb_height != gate->height){
+    gate->width = thumb_width;
+    gate->height = thumb_height;
+    gate->valid = 0;
+  }
+  motion_gate_thumbnail(yuyv, gate->current, width, height);
+  int pass = !gate->valid || now_us - gate->passed_us >= gate->refresh_us;
+  gate->last_change = gate->valid ? motion_gate_difference(gate->current, gate->reference,
+                                                           thumb_width, thumb_height) : 0;
+  if (gate->last_change > gate->threshold)
+    pass = 1;
+  if (pass){
+    uint8_t* tmp = gate->reference;
+    gate->reference = gate->current;
+    gate->current = tmp;
+    gate->valid = 1;
+    gate->passed_us = now_us;
+    ++gate->passed;
+  }
+  else
+    ++gate->skipped;
+  gate->check_us += _now_us() - start;
+  return pass;
+}
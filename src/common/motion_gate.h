@@ -0,0 +1,55 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+  Change detector in front of the encoder.
+  Each frame is reduced to a thumbnail of its luma (one pixel every two in
+  both directions) and compared with the thumbnail of the last frame let
+  through, tile by tile, with a sum of absolute differences. A frame passes
+  if a tile changed more than the threshold on average, or if nothing
+  passed for refresh_us; otherwise it can be skipped.
+  Comparing with the last frame let through, not with the previous one,
+  a slow drift still passes once it adds up.
+*/
+
+#define MOTION_TILE 16  // tile side in thumbnail pixels, 32 pixels of the frame
+
+typedef struct motion_gate_t{
+  int threshold;          // mean absolute luma difference of a tile, 0 lets all through
+  uint64_t refresh_us;    // longest time without a frame let through
+
+  uint8_t* reference;     // thumbnail of the last frame let through
+  uint8_t* current;
+  size_t capacity;
+  uint32_t width;         // of the thumbnails
+  uint32_t height;
+  int valid;              // reference holds a frame
+  uint64_t passed_us;     // when the reference was taken
+
+  int last_change;        // largest tile difference of the last frame checked
+
+  // stats since the last motion_gate_stats_reset
+  uint32_t passed;
+  uint32_t skipped;
+  uint64_t check_us;      // spent checking
+} motion_gate_t;
+
+void motion_gate_init(motion_gate_t* gate, int threshold, uint64_t refresh_us);
+
+void motion_gate_destroy(motion_gate_t* gate);
+
+// 1 if the yuyv frame has to be sent, 0 if it can be skipped
+int motion_gate_check(motion_gate_t* gate, const uint8_t* yuyv,
+                      uint32_t width, uint32_t height, uint64_t now_us);
+
+// forgets the reference: the next frame passes
+void motion_gate_reset(motion_gate_t* gate);
+
+void motion_gate_stats_reset(motion_gate_t* gate);
+
+// the thumbnail and the tile differences, exposed for the benchmarks.
+// thumb holds (width/2)*(height/2) bytes
+void motion_gate_thumbnail(const uint8_t* yuyv, uint8_t* thumb, uint32_t width, uint32_t height);
+// largest mean absolute difference of the MOTION_TILE tiles of two thumbnails
+int motion_gate_difference(const uint8_t* a, const uint8_t* b, uint32_t width, uint32_t height);
@@ -0,0 +1,112 @@
+#include "rate_control.h"
+
+#define RC_SIZE_GAIN 0.25f       // weight of the last frame in the size average
+#define RC_INTERVAL_GAIN 0.1f    // weight of the last period in the frame rate average
+#define RC_HIGH 1.10f            // above target*RC_HIGH the quality goes down
+#define RC_LOW 0.75f             // below target*RC_LOW the quality goes up
+#define RC_SWITCH_QUALITY 10     // quality after a change of resolution
+
+static int _clamp(int min, int v, int max){
+  return (v < min) ? min : (max < v) ? max : v;
+}
+
+void rate_control_init(rate_control_t* rc, size_t target_bytes, uint32_t bitrate,
+                       int min_quality, int max_quality, int allow_downscale){
+  rc->target_bytes = target_bytes;
+  rc->bitrate = bitrate;
+  rc->allow_downscale = allow_downscale;
+  rc->min_quality = min_quality;
+  rc->max_quality = max_quality;
+  rc->quality = _clamp(min_quality, 15, max_quality);
+  rc->scale = 1;
+  rc->avg_bytes = 0;
+  rc->avg_interval_us = 0;
+  rc->last_stamp_us = 0;
+  rate_control_stats_reset(rc);
+}
+
+size_t rate_control_target(const rate_control_t* rc){
+  if (!rc->bitrate || rc->avg_interval_us <= 0)
+    return rc->target_bytes;
+  return (size_t) (rc->bitrate / 8.0f * rc->avg_interval_us * 1e-6f);
+}
+
+uint32_t rate_control_bitrate(const rate_control_t* rc){
+  if (rc->bitrate)
+    return rc->bitrate;
+  if (rc->avg_interval_us <= 0)
+    return 0;
+  return (uint32_t) (rc->target_bytes * 8.0f / (rc->avg_interval_us * 1e-6f));
+}
+
+static void _step_down(rate_control_t* rc, int step){
+  if (rc->quality - step >= rc->min_quality){
+    rc->quality -= step;
+    return;
+  }
+  rc->quality = rc->min_quality;
+  // quality alone cannot get there, trade resolution
+  if (rc->allow_downscale && rc->scale == 1){
+    rc->scale = 2;
+    rc->quality = _clamp(rc->min_quality, RC_SWITCH_QUALITY, rc->max_quality);
+    rc->avg_bytes = 0;
+  }
+}
+
+static void _step_up(rate_control_t* rc){
+  if (rc->quality < rc->max_quality){
+    ++rc->quality;
+    return;
+  }
+  // plenty of room at half resolution: go back to full
+  if (rc->scale > 1){
+    rc->scale = 1;
+    rc->quality = _clamp(rc->min_quality, RC_SWITCH_QUALITY, rc->max_quality);
+    rc->avg_bytes = 0;
+  }
+}
+
+void rate_control_update(rate_control_t* rc, size_t frame_bytes, int queue_depth, uint64_t stamp_us){
+  if (rc->last_stamp_us && stamp_us > rc->last_stamp_us){
+    float interval = stamp_us - rc->last_stamp_us;
+    rc->avg_interval_us = rc->avg_interval_us > 0
+      ? rc->avg_interval_us + RC_INTERVAL_GAIN * (interval - rc->avg_interval_us)
+      : interval;
+  }
+  rc->last_stamp_us = stamp_us;
+  ++rc->frames;
+  rc->bytes += frame_bytes;
+
+  rc->avg_bytes = rc->avg_bytes > 0
+    ? rc->avg_bytes + RC_SIZE_GAIN * (frame_bytes - rc->avg_bytes)
+    : frame_bytes;
+
+  // frames piling up in the send queue mean the link is slower than the target
+  float target = rate_control_target(rc);
+  if (queue_depth > 1)
+    target /= 1 + queue_depth / 2.0f;
+  if (target <= 0)
+    return;
+
+  float ratio = rc->avg_bytes / target;
+  if (ratio > RC_HIGH){
+    // proportional step, so that a big overshoot is recovered in a few frames
+    int step = (int) ((ratio - 1) * rc->quality * 0.5f);
+    _step_down(rc, step < 1 ? 1 : step);
+  }
+  else if (ratio < RC_LOW)
+    _step_up(rc);
+}
+
+void rate_control_overflow(rate_control_t* rc){
+  ++rc->reencoded;
+  int step = rc->quality / 3;
+  _step_down(rc, step < 1 ? 1 : step);
+  rc->avg_bytes = 0;
+}
+
+void rate_control_stats_reset(rate_control_t* rc){
+  rc->frames = 0;
+  rc->bytes = 0;
+  rc->reencoded = 0;
+}
@@ -0,0 +1,49 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+  Closed loop jpeg quality control.
+  Tracks the size of the recent frames and the depth of the send queue
+  and moves the quality (and optionally the resolution) so that frames
+  stay around a target size, either fixed or derived from a bitrate
+  and the measured frame rate.
+*/
+
+typedef struct rate_control_t{
+  size_t target_bytes;    // per frame target, used when bitrate is 0
+  uint32_t bitrate;       // bits/s target
+  int allow_downscale;    // let the controller halve the resolution
+
+  int quality;            // current jpeg quality
+  int min_quality;
+  int max_quality;
+  int scale;              // 1 full resolution, 2 half
+
+  float avg_bytes;        // moving average of the frame sizes
+  float avg_interval_us;  // moving average of the frame period
+  uint64_t last_stamp_us;
+
+  // stats since the last rate_control_stats_reset
+  uint32_t frames;
+  uint64_t bytes;
+  uint32_t reencoded;
+} rate_control_t;
+
+void rate_control_init(rate_control_t* rc, size_t target_bytes, uint32_t bitrate,
+                       int min_quality, int max_quality, int allow_downscale);
+
+// per frame target (bitrate converted with the measured frame rate)
+size_t rate_control_target(const rate_control_t* rc);
+
+// bits/s target for the encoders that take one (frame target converted
+// with the measured frame rate), 0 while the frame rate is unknown
+uint32_t rate_control_bitrate(const rate_control_t* rc);
+
+// feeds the size of the frame just encoded and the number of frames waiting to be sent
+void rate_control_update(rate_control_t* rc, size_t frame_bytes, int queue_depth, uint64_t stamp_us);
+
+// the frame did not fit: steps down harder so that it can be encoded again
+void rate_control_overflow(rate_control_t* rc);
+
+void rate_control_stats_reset(rate_control_t* rc);
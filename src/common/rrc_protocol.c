@@ -0,0 +1,248 @@
+#include <string.h>
+#include "rrc_protocol.h"
+
+static void _put16(uint8_t* b, uint16_t v){
+  b[0] = v;
+  b[1] = v >> 8;
+}
+
+static void _put32(uint8_t* b, uint32_t v){
+  _put16(b, v);
+  _put16(b + 2, v >> 16);
+}
+
+static void _put64(uint8_t* b, uint64_t v){
+  _put32(b, v);
+  _put32(b + 4, v >> 32);
+}
+
+static uint16_t _get16(const uint8_t* b){
+  return b[0] | (b[1] << 8);
+}
+
+static uint32_t _get32(const uint8_t* b){
+  return _get16(b) | ((uint32_t) _get16(b + 2) << 16);
+}
+
+static uint64_t _get64(const uint8_t* b){
+  return _get32(b) | ((uint64_t) _get32(b + 4) << 32);
+}
+
+static int _check_header(const uint8_t* buf, size_t size, size_t min_size, uint8_t type){
+  if (size < min_size)
+    return -1;
+  if (buf[0] != RRC_PROTOCOL_VERSION || buf[1] != type)
+    return -1;
+  return 0;
+}
+
+size_t rrc_control_encode(uint8_t* buf, const rrc_control_t* control){
+  uint8_t num_axes = control->num_axes > RRC_MAX_AXES ? RRC_MAX_AXES : control->num_axes;
+  buf[0] = RRC_PROTOCOL_VERSION;
+  buf[1] = RRC_MSG_CONTROL;
+  buf[2] = num_axes;
+  buf[3] = 0;
+  _put32(buf + 4, control->seq);
+  _put64(buf + 8, control->client_stamp_us);
+  _put32(buf + 16, control->buttons);
+  for (int i = 0; i < num_axes; ++i)
+    _put16(buf + RRC_CONTROL_HEADER_SIZE + 2 * i, control->axes[i]);
+  return RRC_CONTROL_HEADER_SIZE + 2 * num_axes;
+}
+
+int rrc_control_decode(rrc_control_t* control, const uint8_t* buf, size_t size){
+  if (_check_header(buf, size, RRC_CONTROL_HEADER_SIZE, RRC_MSG_CONTROL))
+    return -1;
+  uint8_t num_axes = buf[2];
+  if (num_axes > RRC_MAX_AXES || size < RRC_CONTROL_HEADER_SIZE + 2 * num_axes)
+    return -1;
+  memset(control, 0, sizeof(rrc_control_t));
+  control->num_axes = num_axes;
+  control->seq = _get32(buf + 4);
+  control->client_stamp_us = _get64(buf + 8);
+  control->buttons = _get32(buf + 16);
+  for (int i = 0; i < num_axes; ++i)
+    control->axes[i] = (int16_t) _get16(buf + RRC_CONTROL_HEADER_SIZE + 2 * i);
+  return 0;
+}
+
+size_t rrc_echo_encode(uint8_t* buf, const rrc_echo_t* echo){
+  buf[0] = RRC_PROTOCOL_VERSION;
+  buf[1] = RRC_MSG_ECHO;
+  buf[2] = echo->status;
+  buf[3] = 0;
+  _put32(buf + 4, echo->seq);
+  _put64(buf + 8, echo->client_stamp_us);
+  _put32(buf + 16, echo->host_delay_us);
+  return RRC_ECHO_SIZE;
+}
+
+int rrc_echo_decode(rrc_echo_t* echo, const uint8_t* buf, size_t size){
+  if (_check_header(buf, size, RRC_ECHO_SIZE, RRC_MSG_ECHO))
+    return -1;
+  echo->status = buf[2];
+  echo->seq = _get32(buf + 4);
+  echo->client_stamp_us = _get64(buf + 8);
+  echo->host_delay_us = _get32(buf + 16);
+  return 0;
+}
+
+static void _put_header(uint8_t* buf, uint8_t type){
+  buf[0] = RRC_PROTOCOL_VERSION;
+  buf[1] = type;
+  buf[2] = 0;
+  buf[3] = 0;
+}
+
+size_t rrc_frame_header_encode(uint8_t* buf, const rrc_frame_header_t* header){
+  _put_header(buf, RRC_MSG_FRAME);
+  buf[2] = header->tables;
+  buf[3] = header->codec | (header->keyframe ? RRC_FRAME_KEYFRAME : 0);
+  _put32(buf + 4, header->seq);
+  _put64(buf + 8, header->capture_us);
+  _put64(buf + 16, header->encode_start_us);
+  _put64(buf + 24, header->encode_end_us);
+  _put64(buf + 32, header->enqueue_us);
+  return RRC_FRAME_HEADER_SIZE;
+}
+
+int rrc_frame_header_decode(rrc_frame_header_t* header, const uint8_t* buf, size_t size){
+  if (_check_header(buf, size, RRC_FRAME_HEADER_SIZE, RRC_MSG_FRAME))
+    return -1;
+  header->tables = buf[2];
+  header->codec = buf[3] & ~RRC_FRAME_KEYFRAME;
+  header->keyframe = (buf[3] & RRC_FRAME_KEYFRAME) != 0;
+  header->seq = _get32(buf + 4);
+  header->capture_us = _get64(buf + 8);
+  header->encode_start_us = _get64(buf + 16);
+  header->encode_end_us = _get64(buf + 24);
+  header->enqueue_us = _get64(buf + 32);
+  return 0;
+}
+
+void rrc_frame_header_set_enqueue(uint8_t* buf, uint64_t enqueue_us){
+  _put64(buf + 32, enqueue_us);
+}
+
+static size_t _clock_encode(uint8_t* buf, const rrc_clock_t* clock, uint8_t type){
+  _put_header(buf, type);
+  _put32(buf + 4, clock->seq);
+  _put64(buf + 8, clock->client_send_us);
+  if (type == RRC_MSG_CLOCK_PING)
+    return RRC_CLOCK_PING_SIZE;
+  _put64(buf + 16, clock->host_receive_us);
+  _put64(buf + 24, clock->host_send_us);
+  return RRC_CLOCK_PONG_SIZE;
+}
+
+static int _clock_decode(rrc_clock_t* clock, const uint8_t* buf, size_t size, uint8_t type){
+  size_t min_size = type == RRC_MSG_CLOCK_PING ? RRC_CLOCK_PING_SIZE : RRC_CLOCK_PONG_SIZE;
+  if (_check_header(buf, size, min_size, type))
+    return -1;
+  memset(clock, 0, sizeof(rrc_clock_t));
+  clock->seq = _get32(buf + 4);
+  clock->client_send_us = _get64(buf + 8);
+  if (type == RRC_MSG_CLOCK_PONG){
+    clock->host_receive_us = _get64(buf + 16);
+    clock->host_send_us = _get64(buf + 24);
+  }
+  return 0;
+}
+
+size_t rrc_clock_ping_encode(uint8_t* buf, const rrc_clock_t* clock){
+  return _clock_encode(buf, clock, RRC_MSG_CLOCK_PING);
+}
+
+int rrc_clock_ping_decode(rrc_clock_t* clock, const uint8_t* buf, size_t size){
+  return _clock_decode(clock, buf, size, RRC_MSG_CLOCK_PING);
+}
+
+size_t rrc_clock_pong_encode(uint8_t* buf, const rrc_clock_t* clock){
+  return _clock_encode(buf, clock, RRC_MSG_CLOCK_PONG);
+}
+
+int rrc_clock_pong_decode(rrc_clock_t* clock, const uint8_t* buf, size_t size){
+  return _clock_decode(clock, buf, size, RRC_MSG_CLOCK_PONG);
+}
+
+static size_t _camera_encode(uint8_t* buf, const rrc_camera_mode_t* mode, uint8_t type){
+  _put_header(buf, type);
+  buf[2] = mode->flags;
+  _put16(buf + 4, mode->width);
+  _put16(buf + 6, mode->height);
+  _put16(buf + 8, mode->fps);
+  _put16(buf + 10, 0);
+  _put32(buf + 12, mode->exposure);
+  return RRC_CAMERA_MODE_SIZE;
+}
+
+static int _camera_decode(rrc_camera_mode_t* mode, const uint8_t* buf, size_t size, uint8_t type){
+  if (_check_header(buf, size, RRC_CAMERA_MODE_SIZE, type))
+    return -1;
+  mode->flags = buf[2];
+  mode->width = _get16(buf + 4);
+  mode->height = _get16(buf + 6);
+  mode->fps = _get16(buf + 8);
+  mode->exposure = _get32(buf + 12);
+  return 0;
+}
+
+size_t rrc_camera_mode_encode(uint8_t* buf, const rrc_camera_mode_t* mode){
+  return _camera_encode(buf, mode, RRC_MSG_CAMERA_MODE);
+}
+
+int rrc_camera_mode_decode(rrc_camera_mode_t* mode, const uint8_t* buf, size_t size){
+  return _camera_decode(mode, buf, size, RRC_MSG_CAMERA_MODE);
+}
+
+size_t rrc_camera_state_encode(uint8_t* buf, const rrc_camera_mode_t* state){
+  return _camera_encode(buf, state, RRC_MSG_CAMERA_STATE);
+}
+
+int rrc_camera_state_decode(rrc_camera_mode_t* state, const uint8_t* buf, size_t size){
+  return _camera_decode(state, buf, size, RRC_MSG_CAMERA_STATE);
+}
+
+size_t rrc_stream_options_encode(uint8_t* buf, const rrc_stream_options_t* options){
+  _put_header(buf, RRC_MSG_STREAM_OPTIONS);
+  buf[2] = options->flags;
+  buf[3] = options->codec;
+  buf[4] = options->layer;
+  memset(buf + 5, 0, 3);
+  return RRC_STREAM_OPTIONS_SIZE;
+}
+
+int rrc_stream_options_decode(rrc_stream_options_t* options, const uint8_t* buf, size_t size){
+  if (_check_header(buf, size, RRC_STREAM_OPTIONS_SIZE, RRC_MSG_STREAM_OPTIONS))
+    return -1;
+  if (buf[4] >= RRC_LAYER_COUNT)
+    return -1;
+  options->flags = buf[2];
+  options->codec = buf[3];
+  options->layer = buf[4];
+  return 0;
+}
+
+size_t rrc_jpeg_tables_encode(uint8_t* buf, uint8_t quality, size_t tables_size){
+  _put_header(buf, RRC_MSG_JPEG_TABLES);
+  buf[2] = quality;
+  return RRC_JPEG_TABLES_HEADER_SIZE + tables_size;
+}
+
+int rrc_jpeg_tables_decode(uint8_t* quality, const uint8_t** tables, size_t* tables_size,
+                           const uint8_t* buf, size_t size){
+  if (_check_header(buf, size, RRC_JPEG_TABLES_HEADER_SIZE, RRC_MSG_JPEG_TABLES))
+    return -1;
+  if (!buf[2] || buf[2] > RRC_MAX_JPEG_QUALITY || size > RRC_JPEG_TABLES_MAX_SIZE)
+    return -1;
+  *quality = buf[2];
+  *tables = buf + RRC_JPEG_TABLES_HEADER_SIZE;
+  *tables_size = size - RRC_JPEG_TABLES_HEADER_SIZE;
+  return 0;
+}
+
+uint8_t rrc_message_type(const uint8_t* buf, size_t size){
+  if (size < 2 || buf[0] != RRC_PROTOCOL_VERSION)
+    return 0;
+  return buf[1];
+}
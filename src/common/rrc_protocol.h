@@ -0,0 +1,234 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+  Control messages between rrc_client and rrc_host (exec_commands protocol).
+  On the wire everything is little endian and packed:
+
+  control (client -> host), 20 + 2*num_axes bytes
+    0  u8  version
+    1  u8  type (RRC_MSG_CONTROL)
+    2  u8  num_axes
+    3  u8  reserved
+    4  u32 seq, increases with each message
+    8  u64 client stamp, microseconds of the client monotonic clock
+    16 u32 buttons, bit n set if button n is pressed
+    20 s16 axes[num_axes]
+
+  echo (host -> client), 20 bytes
+    0  u8  version
+    1  u8  type (RRC_MSG_ECHO)
+    2  u8  status (rrc_status_t)
+    3  u8  reserved
+    4  u32 seq of the control message
+    8  u64 client stamp of the control message
+    16 u32 microseconds the host held the message before echoing it
+
+  Video (cam_protocol). Each frame is a header followed by the coded
+  image, stamps are microseconds of the host monotonic clock.
+
+  frame header (host -> client), 40 bytes
+    0  u8  version
+    1  u8  type (RRC_MSG_FRAME)
+    2  u8  tables, quality of the jpeg tables left out of the frame, 0 if it has them
+    3  u8  codec (RRC_CODEC_*), with RRC_FRAME_KEYFRAME if the frame decodes alone
+    4  u32 seq of the frame
+    8  u64 capture (driver timestamp)
+    16 u64 encode start
+    24 u64 encode end
+    32 u64 enqueue, when the host started sending it to this client
+
+  The client estimates the offset between the clocks with a ping/pong
+  exchange on the same connection.
+
+  clock ping (client -> host), 16 bytes
+    0  u8  version
+    1  u8  type (RRC_MSG_CLOCK_PING)
+    2  u16 reserved
+    4  u32 seq
+    8  u64 client send, client monotonic clock
+
+  clock pong (host -> client), 32 bytes
+    0-15 as the ping, type RRC_MSG_CLOCK_PONG
+    16 u64 host receive of the ping
+    24 u64 host send of the pong
+
+  The camera mode can be changed by any viewer, the host tells all of
+  them the mode it ended up with.
+
+  camera mode (client -> host), 16 bytes
+    0  u8  version
+    1  u8  type (RRC_MSG_CAMERA_MODE)
+    2  u8  flags, RRC_CAMERA_* of the fields to change
+    3  u8  reserved
+    4  u16 width
+    6  u16 height
+    8  u16 frames per second
+    10 u16 reserved
+    12 u32 exposure time in 100us units, 0 automatic
+
+  camera state (host -> client), 16 bytes
+    as the mode, type RRC_MSG_CAMERA_STATE. The fields are the current
+    settings, flags those of the last request that were applied
+
+  Each viewer picks the stream it gets, the camera mode is shared. The
+  codec asked for is a wish: a host without it sends jpeg, the frame
+  headers say what comes. Frames of an inter-frame codec need all those
+  since the last keyframe, a client that missed some asks for a keyframe.
+  The host encodes each capture in layers of decreasing resolution
+  (simulcast), a viewer subscribes to one of them.
+
+  stream options (client -> host), 8 bytes
+    0  u8  version
+    1  u8  type (RRC_MSG_STREAM_OPTIONS)
+    2  u8  flags, RRC_STREAM_*
+    3  u8  codec, RRC_CODEC_*
+    4  u8  layer, RRC_LAYER_*
+    5  u8  reserved[3]
+
+  The host can leave the quantization and huffman tables out of the jpegs
+  (abbreviated frames). A session gets the tables of a quality before the
+  first frame that needs them; they depend on the quality only, so the
+  client can keep them all.
+
+  jpeg tables (host -> client), 4 + size of the tables bytes
+    0  u8  version
+    1  u8  type (RRC_MSG_JPEG_TABLES)
+    2  u8  quality, 1 to RRC_MAX_JPEG_QUALITY
+    3  u8  reserved
+    4  tables-only jpeg: SOI, DQT, DHT, EOI
+*/
+
+#define RRC_PROTOCOL_VERSION 1
+#define RRC_MAX_AXES 8
+
+#define RRC_MSG_CONTROL 1
+#define RRC_MSG_ECHO 2
+#define RRC_MSG_FRAME 3
+#define RRC_MSG_CLOCK_PING 4
+#define RRC_MSG_CLOCK_PONG 5
+#define RRC_MSG_CAMERA_MODE 6
+#define RRC_MSG_CAMERA_STATE 7
+
+#define RRC_MSG_STREAM_OPTIONS 8
+#define RRC_MSG_JPEG_TABLES 9
+
+#define RRC_CAMERA_SIZE 0x1
+#define RRC_CAMERA_FPS 0x2
+#define RRC_CAMERA_EXPOSURE 0x4
+
+#define RRC_STREAM_GRAY 0x1       // single component jpegs of the luma
+#define RRC_STREAM_KEYFRAME 0x2   // the next frame has to decode alone
+
+#define RRC_CODEC_JPEG 0
+#define RRC_CODEC_VP8 1
+#define RRC_FRAME_KEYFRAME 0x80   // in the codec byte of the frame header
+
+#define RRC_LAYER_FULL 0          // the camera resolution
+#define RRC_LAYER_HALF 1          // each layer halves the one before
+#define RRC_LAYER_QUARTER 2
+#define RRC_LAYER_COUNT 3
+
+#define RRC_CONTROL_HEADER_SIZE 20
+#define RRC_CONTROL_MAX_SIZE (RRC_CONTROL_HEADER_SIZE + 2 * RRC_MAX_AXES)
+#define RRC_ECHO_SIZE 20
+#define RRC_FRAME_HEADER_SIZE 40
+#define RRC_CLOCK_PING_SIZE 16
+#define RRC_CLOCK_PONG_SIZE 32
+#define RRC_CAMERA_MODE_SIZE 16
+#define RRC_STREAM_OPTIONS_SIZE 8
+#define RRC_JPEG_TABLES_HEADER_SIZE 4
+#define RRC_JPEG_TABLES_MAX_SIZE 1024
+#define RRC_MAX_JPEG_QUALITY 100
+
+typedef enum {
+  RrcAccepted = 0,
+  RrcOutOfOrder = 1,  // seq not newer than the last accepted one
+  RrcStale = 2,       // arrived too late compared to the fastest messages
+} rrc_status_t;
+
+typedef struct rrc_control_t{
+  uint32_t seq;
+  uint64_t client_stamp_us;
+  uint32_t buttons;
+  uint8_t num_axes;
+  int16_t axes[RRC_MAX_AXES];
+} rrc_control_t;
+
+typedef struct rrc_echo_t{
+  uint8_t status;
+  uint32_t seq;
+  uint64_t client_stamp_us;
+  uint32_t host_delay_us;
+} rrc_echo_t;
+
+typedef struct rrc_frame_header_t{
+  uint8_t tables;
+  uint8_t codec;
+  uint8_t keyframe;
+  uint32_t seq;
+  uint64_t capture_us;
+  uint64_t encode_start_us;
+  uint64_t encode_end_us;
+  uint64_t enqueue_us;
+} rrc_frame_header_t;
+
+typedef struct rrc_clock_t{
+  uint32_t seq;
+  uint64_t client_send_us;
+  uint64_t host_receive_us;  // pong only
+  uint64_t host_send_us;     // pong only
+} rrc_clock_t;
+
+typedef struct rrc_camera_mode_t{
+  uint8_t flags;
+  uint16_t width;
+  uint16_t height;
+  uint16_t fps;
+  uint32_t exposure;
+} rrc_camera_mode_t;
+
+typedef struct rrc_stream_options_t{
+  uint8_t flags;
+  uint8_t codec;
+  uint8_t layer;
+} rrc_stream_options_t;
+
+// return the size written, buf must hold RRC_CONTROL_MAX_SIZE / RRC_ECHO_SIZE bytes
+size_t rrc_control_encode(uint8_t* buf, const rrc_control_t* control);
+size_t rrc_echo_encode(uint8_t* buf, const rrc_echo_t* echo);
+
+// return 0 on success, -1 if the message is malformed or of another version/type
+int rrc_control_decode(rrc_control_t* control, const uint8_t* buf, size_t size);
+int rrc_echo_decode(rrc_echo_t* echo, const uint8_t* buf, size_t size);
+
+size_t rrc_frame_header_encode(uint8_t* buf, const rrc_frame_header_t* header);
+int rrc_frame_header_decode(rrc_frame_header_t* header, const uint8_t* buf, size_t size);
+// rewrites the enqueue stamp of an encoded header
+void rrc_frame_header_set_enqueue(uint8_t* buf, uint64_t enqueue_us);
+
+size_t rrc_clock_ping_encode(uint8_t* buf, const rrc_clock_t* clock);
+int rrc_clock_ping_decode(rrc_clock_t* clock, const uint8_t* buf, size_t size);
+size_t rrc_clock_pong_encode(uint8_t* buf, const rrc_clock_t* clock);
+int rrc_clock_pong_decode(rrc_clock_t* clock, const uint8_t* buf, size_t size);
+
+// the same layout for the request and the state
+size_t rrc_camera_mode_encode(uint8_t* buf, const rrc_camera_mode_t* mode);
+int rrc_camera_mode_decode(rrc_camera_mode_t* mode, const uint8_t* buf, size_t size);
+size_t rrc_camera_state_encode(uint8_t* buf, const rrc_camera_mode_t* state);
+int rrc_camera_state_decode(rrc_camera_mode_t* state, const uint8_t* buf, size_t size);
+
+size_t rrc_stream_options_encode(uint8_t* buf, const rrc_stream_options_t* options);
+// -1 also if the layer is out of range
+int rrc_stream_options_decode(rrc_stream_options_t* options, const uint8_t* buf, size_t size);
+
+// writes the header in front of tables already in buf + RRC_JPEG_TABLES_HEADER_SIZE,
+// returns the size of the message
+size_t rrc_jpeg_tables_encode(uint8_t* buf, uint8_t quality, size_t tables_size);
+// points tables into buf, -1 if malformed or the quality is out of range
+int rrc_jpeg_tables_decode(uint8_t* quality, const uint8_t** tables, size_t* tables_size,
+                           const uint8_t* buf, size_t size);
+
+// type of a message, 0 if it is not of this protocol version
+uint8_t rrc_message_type(const uint8_t* buf, size_t size);
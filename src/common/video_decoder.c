@@ -0,0 +1,118 @@
+#include <stdlib.h>
+#include <string.h>
+#include "video_decoder.h"
+#ifdef RRC_WITH_VPX
+#include <vpx/vpx_decoder.h>
+#include <vpx/vp8dx.h>
+#endif
+
+struct video_decoder_t{
+  jpeg_decoder_t* jpeg;
+#ifdef RRC_WITH_VPX
+  vpx_codec_ctx_t vp8;
+  int vp8_open;
+#endif
+  int synced;           // the inter-frame decoder got every frame since a keyframe
+  uint32_t last_seq;
+  video_codec_t last_codec;
+  uint8_t* image;       // bgr of the inter-frame codecs
+  size_t image_capacity;
+};
+
+video_decoder_t* video_decoder_create(void){
+  video_decoder_t* dec = calloc(1, sizeof(video_decoder_t));
+  dec->jpeg = jpeg_decoder_create();
+  return dec;
+}
+
+void video_decoder_destroy(video_decoder_t* dec){
+#ifdef RRC_WITH_VPX
+  if (dec->vp8_open)
+    vpx_codec_destroy(&dec->vp8);
+#endif
+  jpeg_decoder_destroy(dec->jpeg);
+  free(dec->image);
+  free(dec);
+}
+
+jpeg_decoder_t* video_decoder_jpeg(video_decoder_t* dec){
+  return dec->jpeg;
+}
+
+#ifdef RRC_WITH_VPX
+
+static inline uint8_t _clip(int v){
+  return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+// the inverse of the conversion of the encoder side, same coefficients as yuyv2rgb_into
+static void _i420_to_bgr(const vpx_image_t* img, uint8_t* bgr){
+  for (uint32_t r = 0; r < img->d_h; ++r){
+    const uint8_t* y = img->planes[VPX_PLANE_Y] + (size_t) r * img->stride[VPX_PLANE_Y];
+    const uint8_t* u = img->planes[VPX_PLANE_U] + (size_t) (r / 2) * img->stride[VPX_PLANE_U];
+    const uint8_t* v = img->planes[VPX_PLANE_V] + (size_t) (r / 2) * img->stride[VPX_PLANE_V];
+    uint8_t* out = bgr + (size_t) r * img->d_w * 3;
+    for (uint32_t c = 0; c < img->d_w; ++c, out += 3){
+      int luma = y[c] << 8;
+      int cb = u[c / 2] - 128;
+      int cr = v[c / 2] - 128;
+      out[0] = _clip((luma + 454 * cb) >> 8);
+      out[1] = _clip((luma + 88 * cr - 183 * cb) >> 8);
+      out[2] = _clip((luma + 359 * cr) >> 8);
+    }
+  }
+}
+
+static int _vp8_decode(video_decoder_t* dec, const uint8_t* data, size_t size,
+                       uint8_t** bgr, uint32_t* width, uint32_t* height){
+  if (!dec->vp8_open){
+    if (vpx_codec_dec_init(&dec->vp8, vpx_codec_vp8_dx(), NULL, 0))
+      return -1;
+    dec->vp8_open = 1;
+  }
+  if (vpx_codec_decode(&dec->vp8, data, size, NULL, 0))
+    return -1;
+  vpx_codec_iter_t iter = NULL;
+  vpx_image_t* img = vpx_codec_get_frame(&dec->vp8, &iter);
+  if (!img || img->fmt != VPX_IMG_FMT_I420)
+    return -1;
+  size_t needed = (size_t) img->d_w * img->d_h * 3;
+  if (needed > dec->image_capacity){
+    free(dec->image);
+    dec->image = malloc(needed);
+    dec->image_capacity = needed;
+  }
+  _i420_to_bgr(img, dec->image);
+  *bgr = dec->image;
+  *width = img->d_w;
+  *height = img->d_h;
+  return 0;
+}
+
+#endif
+
+int video_decoder_decode(video_decoder_t* dec, video_codec_t codec, uint32_t seq, int keyframe,
+                         const uint8_t* data, size_t size,
+                         uint8_t** bgr, uint32_t* width, uint32_t* height){
+  if (codec == VideoCodecJpeg)
+    return jpeg_decoder_decode(dec->jpeg, data, size, bgr, width, height);
+
+  // the chain of references breaks on a gap or a change of codec
+  if (keyframe)
+    dec->synced = 1;
+  else if (codec != dec->last_codec || seq != dec->last_seq + 1)
+    dec->synced = 0;
+  dec->last_codec = codec;
+  dec->last_seq = seq;
+  if (!dec->synced)
+    return VIDEO_DECODER_NEED_KEYFRAME;
+
+  int result = -1;
+#ifdef RRC_WITH_VPX
+  if (codec == VideoCodecVp8)
+    result = _vp8_decode(dec, data, size, bgr, width, height);
+#endif
+  if (result)
+    dec->synced = 0;
+  return result;
+}
@@ -0,0 +1,30 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include "capture_camera_mod.h"
+#include "jpeg_decoder.h"
+
+/*
+  Decoder of the frames of video_encoder_t, to packed bgr.
+  A jpeg frame decodes alone. The frames of an inter-frame codec need all
+  those since the last keyframe: after a gap in the seqs the decoder
+  refuses them until the next keyframe.
+*/
+
+#define VIDEO_DECODER_NEED_KEYFRAME -2
+
+typedef struct video_decoder_t video_decoder_t;
+
+video_decoder_t* video_decoder_create(void);
+
+void video_decoder_destroy(video_decoder_t* dec);
+
+// the jpeg decoder, for the tables of the abbreviated frames
+jpeg_decoder_t* video_decoder_jpeg(video_decoder_t* dec);
+
+// decodes into the internal bgr image, valid until the next call.
+// Returns 0 on success, -1 if the frame is not valid or the codec not built in,
+// VIDEO_DECODER_NEED_KEYFRAME if frames before this one went missing
+int video_decoder_decode(video_decoder_t* dec, video_codec_t codec, uint32_t seq, int keyframe,
+                         const uint8_t* data, size_t size,
+                         uint8_t** bgr, uint32_t* width, uint32_t* height);
@@ -0,0 +1,291 @@
+/*
+  video encoders behind video_encoder_t: jpeg, where each frame stands
+  alone, and vp8 (with RRC_WITH_VPX), inter-frame and set up for zero
+  latency: no lookahead, one packet out of each call, constant bitrate
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "capture_camera_mod.h"
+#ifdef RRC_WITH_VPX
+#include <vpx/vpx_encoder.h>
+#include <vpx/vp8cx.h>
+#endif
+
+static const char* codec_names[VideoCodecCount] = { "jpeg", "vp8" };
+
+// grows the conversion buffer
+static uint8_t* _pixels(video_encoder_t* enc, size_t size){
+  if (size > enc->pixels_capacity){
+    free(enc->pixels);
+    enc->pixels = malloc(size);
+    enc->pixels_capacity = enc->pixels ? size : 0;
+  }
+  return enc->pixels;
+}
+
+/* --- jpeg --- */
+
+// the capture last converted: a frame that did not fit is encoded again
+// at a lower quality without converting it again
+typedef struct jpeg_state_t{
+  const uint8_t* yuyv;
+  uint64_t stamp_us;
+  int scale;
+} jpeg_state_t;
+
+static int _jpeg_init(video_encoder_t* enc){
+  enc->backend_data = calloc(1, sizeof(jpeg_state_t));
+  return enc->backend_data ? 0 : -1;
+}
+
+static size_t _jpeg_encode(video_encoder_t* enc, const uint8_t* yuyv, uint32_t width, uint32_t height,
+                           uint64_t stamp_us, uint8_t* dest, size_t capacity){
+  jpeg_state_t* state = (jpeg_state_t*) enc->backend_data;
+  uint32_t out_width = width / enc->scale;
+  uint32_t out_height = height / enc->scale;
+  int components = enc->gray ? 1 : 3;
+  uint8_t* pixels = _pixels(enc, (size_t) out_width * out_height * components);
+  if (!pixels)
+    return 0;
+  if (yuyv != state->yuyv || stamp_us != state->stamp_us || enc->scale != state->scale){
+    if (enc->gray)
+      yuyv2gray_scaled_into(yuyv, pixels, width, height, enc->scale);
+    else
+      yuyv2rgb_scaled_into(yuyv, pixels, width, height, enc->scale);
+    state->yuyv = yuyv;
+    state->stamp_us = stamp_us;
+    state->scale = enc->scale;
+  }
+  enc->keyframe = 1;
+  if (enc->gray)
+    return jpeg_mem_gray(dest, capacity, pixels, out_width, out_height, enc->quality);
+  return jpeg_mem(dest, capacity, pixels, out_width, out_height, enc->quality);
+}
+
+static void _jpeg_destroy(video_encoder_t* enc){
+  free(enc->backend_data);
+  enc->backend_data = NULL;
+}
+
+static const video_encoder_backend_t jpeg_backend = {
+  .name = "jpeg",
+  .inter = 0,
+  .init = _jpeg_init,
+  .encode = _jpeg_encode,
+  .destroy = _jpeg_destroy
+};
+
+/* --- vp8 --- */
+
+#ifdef RRC_WITH_VPX
+
+#define VP8_CPU_USED 16             // fastest realtime setting, -16 to 16
+#define VP8_KEYFRAME_DISTANCE 300   // frames, on top of the keyframes forced for new viewers
+#define VP8_DEFAULT_BITRATE 500000
+#define VP8_BUFFER_MS 200           // short rate control buffer: no bursts to catch up
+
+typedef struct vp8_t{
+  vpx_codec_ctx_t codec;
+  vpx_codec_enc_cfg_t cfg;
+  vpx_image_t image;
+  int open;                 // codec holds an encoder of cfg.g_w x cfg.g_h
+  uint64_t first_us;        // pts are milliseconds from the first frame
+  vpx_codec_pts_t last_pts;
+} vp8_t;
+
+static uint32_t _vp8_kbps(const video_encoder_t* enc){
+  return (enc->bitrate ? enc->bitrate : VP8_DEFAULT_BITRATE) / 1000;
+}
+
+static int _vp8_init(video_encoder_t* enc){
+  vp8_t* v = calloc(1, sizeof(vp8_t));
+  if (!v)
+    return -1;
+  if (vpx_codec_enc_config_default(vpx_codec_vp8_cx(), &v->cfg, 0)){
+    free(v);
+    return -1;
+  }
+  enc->backend_data = v;
+  return 0;
+}
+
+// a new frame size needs a new encoder, which starts with a keyframe
+static int _vp8_open(video_encoder_t* enc, vp8_t* v, uint32_t width, uint32_t height, uint64_t stamp_us){
+  if (v->open)
+    vpx_codec_destroy(&v->codec);
+  v->open = 0;
+  vpx_codec_enc_cfg_t* cfg = &v->cfg;
+  cfg->g_w = width;
+  cfg->g_h = height;
+  cfg->g_timebase.num = 1;
+  cfg->g_timebase.den = 1000;
+  cfg->g_threads = 1;
+  cfg->g_pass = VPX_RC_ONE_PASS;
+  cfg->g_lag_in_frames = 0;
+  cfg->g_error_resilient = VPX_ERROR_RESILIENT_DEFAULT;
+  cfg->rc_end_usage = VPX_CBR;
+  cfg->rc_target_bitrate = _vp8_kbps(enc);
+  // the motion gate and the sessions skip frames, the encoder does not
+  cfg->rc_dropframe_thresh = 0;
+  cfg->rc_buf_sz = VP8_BUFFER_MS;
+  cfg->rc_buf_initial_sz = VP8_BUFFER_MS / 2;
+  cfg->rc_buf_optimal_sz = VP8_BUFFER_MS / 2;
+  cfg->kf_mode = VPX_KF_AUTO;
+  cfg->kf_min_dist = 0;
+  cfg->kf_max_dist = VP8_KEYFRAME_DISTANCE;
+  if (vpx_codec_enc_init(&v->codec, vpx_codec_vp8_cx(), cfg, 0))
+    return -1;
+  vpx_codec_control(&v->codec, VP8E_SET_CPUUSED, VP8_CPU_USED);
+  vpx_codec_control(&v->codec, VP8E_SET_NOISE_SENSITIVITY, 0);
+  // keyframes at most 3 times an average frame, they are what new viewers wait for
+  vpx_codec_control(&v->codec, VP8E_SET_MAX_INTRA_BITRATE_PCT, 300);
+  v->open = 1;
+  v->first_us = stamp_us;
+  v->last_pts = -1;
+  return 0;
+}
+
+static size_t _vp8_encode(video_encoder_t* enc, const uint8_t* yuyv, uint32_t width, uint32_t height,
+                          uint64_t stamp_us, uint8_t* dest, size_t capacity){
+  vp8_t* v = (vp8_t*) enc->backend_data;
+  uint32_t out_width = (width / enc->scale) & ~1u;
+  uint32_t out_height = (height / enc->scale) & ~1u;
+  // the encoder refuses an empty image, a 1 pixel wide one rounds to it
+  if (!out_width || !out_height)
+    return 0;
+  if (!v->open || out_width != v->cfg.g_w || out_height != v->cfg.g_h){
+    if (_vp8_open(enc, v, out_width, out_height, stamp_us))
+      return 0;
+  }
+  else if (v->cfg.rc_target_bitrate != _vp8_kbps(enc)){
+    v->cfg.rc_target_bitrate = _vp8_kbps(enc);
+    vpx_codec_enc_config_set(&v->codec, &v->cfg);
+  }
+
+  uint8_t* pixels = _pixels(enc, (size_t) out_width * out_height * 3 / 2);
+  if (!pixels)
+    return 0;
+  yuyv2i420_scaled_into(yuyv, pixels, width, height, enc->scale, enc->gray);
+  vpx_img_wrap(&v->image, VPX_IMG_FMT_I420, out_width, out_height, 1, pixels);
+
+  // real capture times, so that the rate control sees the skipped frames
+  vpx_codec_pts_t pts = (stamp_us - v->first_us) / 1000;
+  if (pts <= v->last_pts)
+    pts = v->last_pts + 1;
+  unsigned long duration = v->last_pts < 0 ? 1 : pts - v->last_pts;
+  v->last_pts = pts;
+  vpx_enc_frame_flags_t flags = enc->force_keyframe ? VPX_EFLAG_FORCE_KF : 0;
+  if (vpx_codec_encode(&v->codec, &v->image, pts, duration, flags, VPX_DL_REALTIME))
+    return 0;
+
+  size_t size = 0;
+  int overflow = 0;
+  vpx_codec_iter_t iter = NULL;
+  const vpx_codec_cx_pkt_t* pkt;
+  while ((pkt = vpx_codec_get_cx_data(&v->codec, &iter))){
+    if (pkt->kind != VPX_CODEC_CX_FRAME_PKT)
+      continue;
+    if (size + pkt->data.frame.sz > capacity){
+      overflow = 1;
+      continue;
+    }
+    memcpy(dest + size, pkt->data.frame.buf, pkt->data.frame.sz);
+    size += pkt->data.frame.sz;
+    enc->keyframe = (pkt->data.frame.flags & VPX_FRAME_IS_KEY) != 0;
+  }
+  return overflow ? 0 : size;
+}
+
+static void _vp8_destroy(video_encoder_t* enc){
+  vp8_t* v = (vp8_t*) enc->backend_data;
+  if (v->open)
+    vpx_codec_destroy(&v->codec);
+  free(v);
+  enc->backend_data = NULL;
+}
+
+static const video_encoder_backend_t vp8_backend = {
+  .name = "vp8",
+  .inter = 1,
+  .init = _vp8_init,
+  .encode = _vp8_encode,
+  .destroy = _vp8_destroy
+};
+
+#endif
+
+/* --- interface --- */
+
+static const video_encoder_backend_t* _backend(video_codec_t codec){
+  switch (codec){
+  case VideoCodecJpeg:
+    return &jpeg_backend;
+#ifdef RRC_WITH_VPX
+  case VideoCodecVp8:
+    return &vp8_backend;
+#endif
+  default:
+    return NULL;
+  }
+}
+
+const char* video_codec_name(video_codec_t codec){
+  if (codec < 0 || codec >= VideoCodecCount)
+    return "unknown";
+  return codec_names[codec];
+}
+
+int video_encoder_available(video_codec_t codec){
+  return _backend(codec) != NULL;
+}
+
+video_encoder_t* video_encoder_create(video_codec_t codec, int gray){
+  const video_encoder_backend_t* backend = _backend(codec);
+  if (!backend)
+    return NULL;
+  video_encoder_t* enc = calloc(1, sizeof(video_encoder_t));
+  if (!enc)
+    return NULL;
+  enc->codec = codec;
+  enc->gray = gray;
+  enc->quality = 15;
+  enc->scale = 1;
+  enc->backend = backend;
+  if (backend->init(enc)){
+    free(enc);
+    return NULL;
+  }
+  return enc;
+}
+
+void video_encoder_destroy(video_encoder_t* enc){
+  enc->backend->destroy(enc);
+  free(enc->pixels);
+  free(enc);
+}
+
+void video_encoder_set_quality(video_encoder_t* enc, int quality, int scale){
+  enc->quality = quality;
+  enc->scale = scale < 1 ? 1 : scale;
+}
+
+void video_encoder_set_bitrate(video_encoder_t* enc, uint32_t bitrate){
+  enc->bitrate = bitrate;
+}
+
+void video_encoder_force_keyframe(video_encoder_t* enc){
+  enc->force_keyframe = 1;
+}
+
+size_t video_encoder_encode(video_encoder_t* enc, const uint8_t* yuyv, uint32_t width, uint32_t height,
+                            uint64_t stamp_us, uint8_t* dest, size_t capacity){
+  size_t size = enc->backend->encode(enc, yuyv, width, height, stamp_us, dest, capacity);
+  if (size)
+    enc->force_keyframe = 0;
+  else if (enc->backend->inter)
+    // the decoders will miss this frame
+    enc->force_keyframe = 1;
+  return size;
+}
@@ -0,0 +1,387 @@
+/*  Load generator for the video plane: opens -viewers headless cam_protocol
+    sessions to rrc_host, counts the complete frames each one receives
+    without decoding them and reports every second the connected viewers,
+    the min/p50/max of their fps and the received Mbit/s. With -pid it
+    also reports the cpu of the host process, and its own to tell when the
+    generator rather than the host is the limit.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <libwebsockets.h>
+#include "rrc_protocol.h"
+
+#define STATS_PERIOD_US 1000000
+#define MAX_VIEWERS 4096
+
+const char *banner[]={
+  "cam_load",
+  "many headless viewers of rrc_host, measures the fps of each and the host cpu",
+  "usage:"
+  "$> cam_load <parameters>",
+  "parameters: ",
+  "-address <string>: host address (default localhost)",
+  "-port    <int>   : video port (default 9000)",
+  "-viewers <int>   : concurrent sessions (default 200)",
+  "-duration <int>  : seconds of the run after the warm up, 0 runs until ctrl-c (default 0)",
+  "-warmup  <int>   : seconds before the summary starts counting (default 2)",
+  "-gray            : the luma only stream",
+  "-vp8             : the vp8 stream",
+  "-layer <full|half|quarter>: simulcast layer (default full)",
+  "-pid     <int>   : rrc_host process, its cpu is reported",
+  0
+};
+
+void printBanner(){
+  const char*const* line=banner;
+  while (*line) {
+    printf("%s\n",*line);
+    line++;
+  }
+}
+
+static volatile sig_atomic_t interrupted = 0;
+
+static void sigint_handler(int sig){
+  interrupted = 1;
+}
+
+// a session, fed by the service loop and read by the reporter with atomics
+typedef struct Viewer{
+  struct lws* wsi;
+  int established;
+  int options_sent;
+  int in_frame;               // the message being received started as a frame
+  uint32_t frames;
+  uint64_t bytes;
+} Viewer;
+
+static const char* address = "localhost";
+static int port = 9000;
+static int num_viewers = 200;
+static rrc_stream_options_t stream_options = { .codec = RRC_CODEC_JPEG, .layer = RRC_LAYER_FULL };
+static int send_options = 0;
+static Viewer* viewers;
+static struct lws_context* context;
+static struct lws_vhost* vhost;
+static const struct lws_protocols* protocol;
+
+static uint64_t _nowUs(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void _connect(Viewer* v){
+  struct lws_client_connect_info i;
+  memset(&i, 0, sizeof(i));
+  i.context = context;
+  i.port = port;
+  i.address = address;
+  i.path = "/client";
+  i.host = address;
+  i.origin = address;
+  i.protocol = protocol->name;
+  i.vhost = vhost;
+  i.userdata = v;
+  i.pwsi = &v->wsi;
+  v->established = 0;
+  v->options_sent = 0;
+  v->in_frame = 0;
+  lws_client_connect_via_info(&i);
+}
+
+static int callback_cam_load(struct lws *wsi, enum lws_callback_reasons reason,
+                             void *user, void *in, size_t len){
+  Viewer* v = (Viewer*) user;
+  unsigned char options_buf[LWS_PRE + RRC_STREAM_OPTIONS_SIZE];
+  switch (reason) {
+  case LWS_CALLBACK_PROTOCOL_INIT:
+    vhost = lws_get_vhost(wsi);
+    protocol = lws_get_protocol(wsi);
+    for (int k = 0; k < num_viewers; ++k)
+      _connect(viewers + k);
+    lws_timed_callback_vh_protocol(vhost, protocol, LWS_CALLBACK_USER, 1);
+    break;
+
+  case LWS_CALLBACK_USER:
+    // reconnects the sessions that failed or were closed
+    for (int k = 0; k < num_viewers && !interrupted; ++k)
+      if (!viewers[k].wsi)
+        _connect(viewers + k);
+    lws_timed_callback_vh_protocol(vhost, protocol, LWS_CALLBACK_USER, 1);
+    break;
+
+  case LWS_CALLBACK_CLIENT_CONNECTION_ERROR:
+    if (v)
+      v->wsi = NULL;
+    break;
+
+  case LWS_CALLBACK_CLIENT_ESTABLISHED:
+    __atomic_store_n(&v->established, 1, __ATOMIC_RELAXED);
+    if (send_options)
+      lws_callback_on_writable(wsi);
+    break;
+
+  case LWS_CALLBACK_CLIENT_WRITEABLE:
+    if (v->options_sent)
+      break;
+    rrc_stream_options_encode(options_buf + LWS_PRE, &stream_options);
+    if (lws_write(wsi, options_buf + LWS_PRE, RRC_STREAM_OPTIONS_SIZE, LWS_WRITE_BINARY) < RRC_STREAM_OPTIONS_SIZE)
+      return -1;
+    v->options_sent = 1;
+    break;
+
+  case LWS_CALLBACK_CLIENT_RECEIVE:
+    if (lws_is_first_fragment(wsi))
+      v->in_frame = rrc_message_type(in, len) == RRC_MSG_FRAME;
+    __atomic_add_fetch(&v->bytes, len, __ATOMIC_RELAXED);
+    if (lws_is_final_fragment(wsi) && v->in_frame)
+      __atomic_add_fetch(&v->frames, 1, __ATOMIC_RELAXED);
+    break;
+
+  case LWS_CALLBACK_CLOSED:
+  case LWS_CALLBACK_CLIENT_CLOSED:
+    __atomic_store_n(&v->established, 0, __ATOMIC_RELAXED);
+    v->wsi = NULL;
+    break;
+
+  default:
+    break;
+  }
+  return 0;
+}
+
+// user+system ticks of a process, 0 if it is gone
+static uint64_t _processTicks(int pid){
+  char path[64];
+  char line[1024];
+  snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+  FILE* f = fopen(path, "r");
+  if (!f)
+    return 0;
+  size_t n = fread(line, 1, sizeof(line) - 1, f);
+  fclose(f);
+  line[n] = 0;
+  // the command name can hold spaces, the fields count from its closing parenthesis
+  char* p = strrchr(line, ')');
+  unsigned long utime = 0, stime = 0;
+  if (!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+    return 0;
+  return utime + stime;
+}
+
+static uint64_t _ownUs(void){
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return (uint64_t) (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000
+    + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+static int _compareFloat(const void* a, const void* b){
+  float fa = *(const float*) a, fb = *(const float*) b;
+  return (fa > fb) - (fa < fb);
+}
+
+typedef struct Report{
+  int connected;
+  float fps_min, fps_p50, fps_max;
+  float mbits;
+  float host_cpu;             // percent, <0 without -pid
+  float own_cpu;
+} Report;
+
+static void _printReport(const char* label, const Report* r){
+  printf("[cam_load] %s: %d viewers, fps min %.1f p50 %.1f max %.1f, %.1f Mbit/s",
+         label, r->connected, r->fps_min, r->fps_p50, r->fps_max, r->mbits);
+  if (r->host_cpu >= 0)
+    printf(", host cpu %.1f%%", r->host_cpu);
+  printf(", cam_load cpu %.1f%%\n", r->own_cpu);
+  fflush(stdout);
+}
+
+// per viewer fps from frame counts at the start and the end of the period
+static void _fpsStats(Report* r, const uint32_t* start, const uint32_t* end, float seconds, float* fps){
+  int n = 0;
+  for (int k = 0; k < num_viewers; ++k)
+    if (__atomic_load_n(&viewers[k].established, __ATOMIC_RELAXED))
+      fps[n++] = (end[k] - start[k]) / seconds;
+  r->connected = n;
+  r->fps_min = r->fps_p50 = r->fps_max = 0;
+  if (!n)
+    return;
+  qsort(fps, n, sizeof(float), _compareFloat);
+  r->fps_min = fps[0];
+  r->fps_p50 = fps[n / 2];
+  r->fps_max = fps[n - 1];
+}
+
+typedef struct ReporterArgs{
+  int duration;
+  int warmup;
+  int pid;
+} ReporterArgs;
+
+static void* _reporterFn(void* arg){
+  ReporterArgs* args = (ReporterArgs*) arg;
+  float hz = sysconf(_SC_CLK_TCK);
+  uint32_t* last = calloc(num_viewers, sizeof(uint32_t));
+  uint32_t* now_frames = calloc(num_viewers, sizeof(uint32_t));
+  uint32_t* run_frames = calloc(num_viewers, sizeof(uint32_t));
+  float* fps = calloc(num_viewers, sizeof(float));
+  uint64_t start = _nowUs();
+  uint64_t last_us = start, last_bytes = 0, last_host = args->pid ? _processTicks(args->pid) : 0, last_own = _ownUs();
+  uint64_t run_us = 0, run_bytes = 0, run_host = 0, run_own = 0;
+  while (!interrupted){
+    usleep(STATS_PERIOD_US);
+    uint64_t now = _nowUs();
+    uint64_t bytes = 0;
+    for (int k = 0; k < num_viewers; ++k){
+      now_frames[k] = __atomic_load_n(&viewers[k].frames, __ATOMIC_RELAXED);
+      bytes += __atomic_load_n(&viewers[k].bytes, __ATOMIC_RELAXED);
+    }
+    uint64_t host = args->pid ? _processTicks(args->pid) : 0;
+    uint64_t own = _ownUs();
+    float seconds = (now - last_us) * 1e-6f;
+    Report r;
+    _fpsStats(&r, last, now_frames, seconds, fps);
+    r.mbits = (bytes - last_bytes) * 8e-6f / seconds;
+    r.host_cpu = args->pid ? 100.f * (host - last_host) / hz / seconds : -1;
+    r.own_cpu = 100.f * (own - last_own) * 1e-6f / seconds;
+    _printReport("1s", &r);
+    memcpy(last, now_frames, num_viewers * sizeof(uint32_t));
+    last_us = now;
+    last_bytes = bytes;
+    last_host = host;
+    last_own = own;
+
+    // the summary counts from the end of the warm up
+    uint64_t elapsed = now - start;
+    if (!run_us && elapsed >= (uint64_t) args->warmup * 1000000){
+      run_us = now;
+      run_bytes = bytes;
+      run_host = host;
+      run_own = own;
+      memcpy(run_frames, now_frames, num_viewers * sizeof(uint32_t));
+    }
+    if (run_us && args->duration > 0 && now - run_us >= (uint64_t) args->duration * 1000000)
+      break;
+  }
+  if (run_us && last_us > run_us){
+    float seconds = (last_us - run_us) * 1e-6f;
+    Report r;
+    _fpsStats(&r, run_frames, last, seconds, fps);
+    r.mbits = (last_bytes - run_bytes) * 8e-6f / seconds;
+    r.host_cpu = args->pid ? 100.f * (last_host - run_host) / hz / seconds : -1;
+    r.own_cpu = 100.f * (last_own - run_own) * 1e-6f / seconds;
+    _printReport("summary", &r);
+  }
+  interrupted = 1;
+  lws_cancel_service(context);
+  free(last);
+  free(now_frames);
+  free(run_frames);
+  free(fps);
+  return 0;
+}
+
+int main(int argc, char** argv){
+  ReporterArgs args = { .duration = 0, .warmup = 2, .pid = 0 };
+  int c = 1;
+  while(c < argc){
+    if(!strcmp(argv[c], "-address") && c+1 < argc){
+      c++;
+      address = argv[c];
+    }
+    else if(!strcmp(argv[c], "-port") && c+1 < argc){
+      c++;
+      port = atoi(argv[c]);
+    }
+    else if(!strcmp(argv[c], "-viewers") && c+1 < argc){
+      c++;
+      num_viewers = atoi(argv[c]);
+    }
+    else if(!strcmp(argv[c], "-duration") && c+1 < argc){
+      c++;
+      args.duration = atoi(argv[c]);
+    }
+    else if(!strcmp(argv[c], "-warmup") && c+1 < argc){
+      c++;
+      args.warmup = atoi(argv[c]);
+    }
+    else if(!strcmp(argv[c], "-gray")){
+      stream_options.flags |= RRC_STREAM_GRAY;
+    }
+    else if(!strcmp(argv[c], "-vp8")){
+      stream_options.codec = RRC_CODEC_VP8;
+    }
+    else if(!strcmp(argv[c], "-layer") && c+1 < argc){
+      c++;
+      if(!strcmp(argv[c], "full"))
+        stream_options.layer = RRC_LAYER_FULL;
+      else if(!strcmp(argv[c], "half"))
+        stream_options.layer = RRC_LAYER_HALF;
+      else if(!strcmp(argv[c], "quarter"))
+        stream_options.layer = RRC_LAYER_QUARTER;
+      else {
+        printBanner();
+        return 0;
+      }
+    }
+    else if(!strcmp(argv[c], "-pid") && c+1 < argc){
+      c++;
+      args.pid = atoi(argv[c]);
+    }
+    else {
+      printBanner();
+      return 0;
+    }
+    c++;
+  }
+  if (num_viewers < 1)
+    num_viewers = 1;
+  if (num_viewers > MAX_VIEWERS)
+    num_viewers = MAX_VIEWERS;
+  // sessions start in color jpeg at full resolution
+  send_options = stream_options.flags || stream_options.codec != RRC_CODEC_JPEG
+    || stream_options.layer != RRC_LAYER_FULL;
+
+  signal(SIGINT, sigint_handler);
+  signal(SIGTERM, sigint_handler);
+  lws_set_log_level(LLL_ERR, NULL);
+  viewers = calloc(num_viewers, sizeof(Viewer));
+
+  struct lws_protocols protocols[] = {
+    { "cam_protocol", callback_cam_load, 0, 0 },
+    { NULL, NULL, 0, 0 }
+  };
+  struct lws_context_creation_info info;
+  memset(&info, 0, sizeof(info));
+  info.port = CONTEXT_PORT_NO_LISTEN;
+  info.protocols = protocols;
+  context = lws_create_context(&info);
+  if (!context){
+    fprintf(stderr, "[cam_load] cannot create the lws context\n");
+    free(viewers);
+    return -1;
+  }
+  printf("[cam_load] %d viewers of %s:%d\n", num_viewers, address, port);
+
+  pthread_t reporter;
+  pthread_create(&reporter, NULL, _reporterFn, &args);
+  int n = 0;
+  while (n >= 0 && !interrupted)
+    n = lws_service(context, 100);
+  interrupted = 1;
+  pthread_join(reporter, NULL);
+  lws_context_destroy(context);
+  free(viewers);
+  return 0;
+}
@@ -0,0 +1,169 @@
+#!/bin/bash
+# End to end run of rrc_host and rrc_client on this box: rrc_host drives
+# orazio_sim through a pseudo terminal and streams the camera to a headless
+# rrc_client over localhost, while a scripted joystick sends commands.
+# Reports video fps, frame sizes, command round trip, glass-to-glass
+# latency and the cpu of each process. With -viewers, cam_load adds that
+# many headless sessions and reports their fps and the host cpu.
+# Fails if the p99 command round trip, under that video load, is over
+# -max-command-us (0 to only report it).
+#
+# usage: loopback_bench.sh [-bin-dir <dir>] [-cam <device>] [-duration <s>]
+#                          [-warmup <s>] [-port <int>] [-joy-hz <int>]
+#                          [-viewers <int>] [-service-threads <int>]
+#                          [-max-command-us <int>] [-keep-logs]
+
+BIN_DIR=$(dirname "$0")/../../build
+CAM=synthetic
+DURATION=30
+WARMUP=5
+PORT=9000
+JOY_HZ=20
+VIEWERS=0
+SERVICE_THREADS=1
+MAX_COMMAND_US=20000
+KEEP_LOGS=0
+
+while [ $# -gt 0 ]; do
+  case "$1" in
+    -bin-dir) BIN_DIR=$2; shift ;;
+    -cam) CAM=$2; shift ;;
+    -duration) DURATION=$2; shift ;;
+    -warmup) WARMUP=$2; shift ;;
+    -port) PORT=$2; shift ;;
+    -joy-hz) JOY_HZ=$2; shift ;;
+    -viewers) VIEWERS=$2; shift ;;
+    -service-threads) SERVICE_THREADS=$2; shift ;;
+    -max-command-us) MAX_COMMAND_US=$2; shift ;;
+    -keep-logs) KEEP_LOGS=1 ;;
+    *) sed -n '2,15p' "$0"; exit 1 ;;
+  esac
+  shift
+done
+
+BINS="orazio_sim rrc_host rrc_client"
+[ "$VIEWERS" -gt 0 ] && BINS="$BINS cam_load"
+for bin in $BINS; do
+  if [ ! -x "$BIN_DIR/$bin" ]; then
+    echo "missing $BIN_DIR/$bin, run make all orazio_sim cam_load first" >&2
+    exit 1
+  fi
+done
+
+WORK=$(mktemp -d /tmp/rrc_loopback.XXXXXX)
+TTY=$WORK/tty
+PIDS=""
+
+cleanup(){
+  [ -n "$PIDS" ] && kill -INT $PIDS 2>/dev/null
+  for pid in $PIDS; do
+    wait $pid 2>/dev/null
+  done
+  if [ $KEEP_LOGS = 1 ]; then
+    echo "logs in $WORK"
+  else
+    rm -rf "$WORK"
+  fi
+}
+trap cleanup EXIT
+
+# user+system ticks of a process
+cpu_ticks(){
+  awk '{ print $14 + $15 }' /proc/$1/stat 2>/dev/null || echo 0
+}
+
+"$BIN_DIR/orazio_sim" -link "$TTY" > "$WORK/sim.log" 2>&1 &
+SIM_PID=$!
+PIDS="$SIM_PID"
+for i in $(seq 50); do
+  [ -e "$TTY" ] && break
+  sleep 0.1
+done
+
+# rrc_host syncs and reads the configuration before opening the ports
+"$BIN_DIR/rrc_host" -serial-dev "$TTY" -cam "$CAM" -no-keyboard \
+  -control-port $((PORT+1)) -service-threads $SERVICE_THREADS < /dev/null > "$WORK/host.log" 2>&1 &
+HOST_PID=$!
+PIDS="$HOST_PID $PIDS"
+sleep 2
+
+"$BIN_DIR/rrc_client" -address 127.0.0.1 -port $PORT -control-port $((PORT+1)) \
+  -headless -scripted-joy $JOY_HZ > "$WORK/client.log" 2>&1 &
+CLIENT_PID=$!
+PIDS="$CLIENT_PID $PIDS"
+
+# counts its own warm up and stops after the run
+if [ "$VIEWERS" -gt 0 ]; then
+  "$BIN_DIR/cam_load" -address 127.0.0.1 -port $PORT -viewers $VIEWERS \
+    -warmup $WARMUP -duration $DURATION -pid $HOST_PID > "$WORK/load.log" 2>&1 &
+  LOAD_PID=$!
+  PIDS="$LOAD_PID $PIDS"
+fi
+
+sleep $WARMUP
+for pid in $PIDS; do
+  if ! kill -0 $pid 2>/dev/null; then
+    echo "a process exited early, logs in $WORK" >&2
+    KEEP_LOGS=1
+    exit 1
+  fi
+done
+CLIENT_LINE=$(wc -l < "$WORK/client.log")
+START_SIM=$(cpu_ticks $SIM_PID)
+START_HOST=$(cpu_ticks $HOST_PID)
+START_CLIENT=$(cpu_ticks $CLIENT_PID)
+sleep $DURATION
+END_SIM=$(cpu_ticks $SIM_PID)
+END_HOST=$(cpu_ticks $HOST_PID)
+END_CLIENT=$(cpu_ticks $CLIENT_PID)
+
+HZ=$(getconf CLK_TCK)
+cpu_percent(){
+  awk -v t=$(( $2 - $1 )) -v hz=$HZ -v s=$DURATION 'BEGIN { printf "%.1f", 100 * t / hz / s }'
+}
+
+# only what the client reported after the warm up
+tail -n +$((CLIENT_LINE + 1)) "$WORK/client.log" > "$WORK/client.run"
+
+echo "loopback run: ${DURATION}s after ${WARMUP}s of warm up, camera $CAM"
+awk '/\[render\] .* fps received/ {
+       for (i = 1; i <= NF; ++i) {
+         if ($(i+1) == "fps" && $(i+2) == "received,") { rx += $i; ++n }
+         if ($(i+1) == "fps" && $(i+2) == "rendered,") dec += $i
+       }
+     }
+     END { if (n) printf "video:          %.1f fps received, %.1f fps decoded\n", rx / n, dec / n;
+           else print "video:          no frames" }' "$WORK/client.run"
+last_stat(){
+  grep -E "$1" "$WORK/client.run" | tail -1 | sed -E "s/.*$1 *//"
+}
+echo "frame size:     $(last_stat 'frame size')"
+echo "command rtt:    $(last_stat 'command rtt')"
+grep "\[Control\] receive to control loop pickup" "$WORK/host.log" | tail -1 | \
+  sed 's/.*pickup: /command pickup: /'
+echo "network:        $(last_stat 'network')"
+echo "glass-to-glass: $(last_stat 'glass-to-glass')"
+echo "cpu:            rrc_host $(cpu_percent $START_HOST $END_HOST)%," \
+     "rrc_client $(cpu_percent $START_CLIENT $END_CLIENT)%," \
+     "orazio_sim $(cpu_percent $START_SIM $END_SIM)%"
+grep "orazio_sim\] .*epochs/s" "$WORK/sim.log" | tail -1 | sed 's/^/robot:          /'
+if [ "$VIEWERS" -gt 0 ]; then
+  # the summary comes at the end of its run, a second after ours at most
+  wait $LOAD_PID 2>/dev/null
+  echo "load:           $VIEWERS viewers, $SERVICE_THREADS service threads"
+  grep "\[cam_load\] summary" "$WORK/load.log" | tail -1 | sed 's/.*summary: /                /'
+fi
+
+# the commands have to keep up with the video, not just get there
+if [ "$MAX_COMMAND_US" -gt 0 ]; then
+  P99=$(last_stat 'command rtt' | sed -nE 's/.*p99 ([0-9]+)us.*/\1/p')
+  if [ -z "$P99" ]; then
+    echo "command rtt:    no samples, the bound of ${MAX_COMMAND_US}us cannot be checked" >&2
+    exit 1
+  fi
+  if [ "$P99" -gt "$MAX_COMMAND_US" ]; then
+    echo "command rtt:    p99 ${P99}us over the bound of ${MAX_COMMAND_US}us" >&2
+    exit 1
+  fi
+  echo "command bound:  p99 ${P99}us within ${MAX_COMMAND_US}us"
+fi
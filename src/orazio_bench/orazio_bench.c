@@ -0,0 +1,664 @@
+/*  Micro-benchmarks of the hot paths of host and client, on synthetic data.
+    Every case is calibrated to run for about -min-time ms, repeated
+    -repeats times, and the best repetition is reported as a tab separated
+    line: bench, case, operations, ns/op, MB/s (0 when it does not apply).
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "packet_handler.h"
+#include "deferred_packet_handler.h"
+#include "orazio_packets.h"
+#include "orazio_print_packet.h"
+#include "capture_camera_mod.h"
+#include "motion_gate.h"
+#include "video_decoder.h"
+
+#define STREAM_PACKETS 64   // distinct packets in the synthetic serial stream
+
+typedef void (*BenchFn)(void* ctx, long iterations);
+
+const char *banner[]={
+  "orazio_bench",
+  "micro-benchmarks of packet handling, color conversion, jpeg and printing",
+  "usage:"
+  "$> orazio_bench <parameters>",
+  "parameters: ",
+  "-filter <string>: only the benchmarks whose name contains it",
+  "-min-time  <int>: milliseconds per repetition (default 200)",
+  "-repeats   <int>: repetitions of each case, the best is reported (default 5)",
+  "-workers   <int>: max strip workers of the jpeg_mem sweep (default online cpus)",
+  0
+};
+
+void printBanner(){
+  const char*const* line=banner;
+  while (*line) {
+    printf("%s\n",*line);
+    line++;
+  }
+}
+
+static const char* filter = NULL;
+static double min_time_ms = 200;
+static int repeats = 5;
+static volatile uint64_t sink;  // results go here so that nothing is optimized away
+
+static double now_ns(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1e9 + ts.tv_nsec;
+}
+
+static int selected(const char* name){
+  return !filter || strstr(name, filter);
+}
+
+/*
+  doubles the iterations until a run takes a tenth of the target,
+  then scales them to the target and keeps the best repetition
+*/
+static void measure(const char* name, const char* params, BenchFn fn, void* ctx, double bytes_per_op){
+  long iterations = 1;
+  double elapsed = 0;
+  fn(ctx, 1); // warm up caches and lazy allocations
+  while (1){
+    double start = now_ns();
+    fn(ctx, iterations);
+    elapsed = now_ns() - start;
+    if (elapsed*1e-6 >= min_time_ms/10 || iterations > (1L << 40))
+      break;
+    iterations *= 2;
+  }
+  iterations = iterations*(min_time_ms*1e6/elapsed);
+  if (iterations < 1)
+    iterations = 1;
+  double best = 1e300;
+  for (int r = 0; r < repeats; ++r){
+    double start = now_ns();
+    fn(ctx, iterations);
+    double ns_per_op = (now_ns() - start)/iterations;
+    if (ns_per_op < best)
+      best = ns_per_op;
+  }
+  double mb_per_s = bytes_per_op > 0 ? bytes_per_op/best*1e3 : 0;
+  printf("%s\t%s\t%ld\t%.1f\t%.2f\n", name, params, iterations, best, mb_per_s);
+  fflush(stdout);
+}
+
+/* --- packets --- */
+
+// a drive status packet stream, as the firmware would send it
+typedef struct PacketStream{
+  uint8_t* bytes;
+  int packet_size;      // bytes of each packet on the wire
+  int count;
+} PacketStream;
+
+static void makeStream(PacketStream* s){
+  PacketHandler tx;
+  PacketHandler_initialize(&tx);
+  DifferentialDriveStatusPacket p;
+  memset(&p, 0, sizeof(p));
+  p.header.type = DIFFERENTIAL_DRIVE_STATUS_PACKET_ID;
+  p.header.size = sizeof(p);
+  s->packet_size = sizeof(p) + 3;
+  s->count = STREAM_PACKETS;
+  s->bytes = malloc(s->packet_size*s->count);
+  uint8_t* b = s->bytes;
+  for (int i = 0; i < s->count; ++i){
+    p.header.seq = i;
+    p.odom_x = i*0.1f;
+    p.odom_theta = -i*0.01f;
+    p.translational_velocity_measured = (i%7)*0.05f;
+    PacketHandler_sendPacket(&tx, (PacketHeader*) &p);
+    while (tx.tx_size)
+      *b++ = PacketHandler_txByte(&tx);
+  }
+}
+
+typedef struct RxCtx{
+  PacketStream stream;
+  PacketHandler handler;
+  PacketOperations ops;
+  DifferentialDriveStatusPacket buffer;
+  uint64_t received;
+} RxCtx;
+
+static PacketHeader* _rxBuffer(PacketType type, PacketSize size, void* args){
+  return (PacketHeader*) &((RxCtx*) args)->buffer;
+}
+
+static PacketStatus _rxDone(PacketHeader* p, void* args){
+  ++((RxCtx*) args)->received;
+  return Success;
+}
+
+static void benchRx(void* ctx_, long iterations){
+  RxCtx* ctx = (RxCtx*) ctx_;
+  for (long i = 0; i < iterations; ++i){
+    const uint8_t* b = ctx->stream.bytes + (i%ctx->stream.count)*ctx->stream.packet_size;
+    for (int k = 0; k < ctx->stream.packet_size; ++k)
+      PacketHandler_rxByte(&ctx->handler, b[k]);
+  }
+  sink = ctx->received;
+}
+
+typedef struct TxCtx{
+  PacketHandler handler;
+  DifferentialDriveControlPacket packet;
+} TxCtx;
+
+// queue a packet and drain it, as the client does before each write
+static void benchTx(void* ctx_, long iterations){
+  TxCtx* ctx = (TxCtx*) ctx_;
+  uint64_t sum = 0;
+  for (long i = 0; i < iterations; ++i){
+    ctx->packet.header.seq = i;
+    PacketHandler_sendPacket(&ctx->handler, (PacketHeader*) &ctx->packet);
+    while (ctx->handler.tx_size)
+      sum += PacketHandler_txByte(&ctx->handler);
+  }
+  sink = sum;
+}
+
+typedef struct DeferredCtx{
+  PacketStream stream;
+  DeferredPacketHandler handler;
+  DifferentialDriveStatusPacket buffers[PACKETS_PER_TYPE_MAX];
+  uint64_t processed;
+  int batch;            // packets received before each processing
+} DeferredCtx;
+
+static PacketStatus _deferredAction(PacketHeader* p, void* args){
+  ++((DeferredCtx*) args)->processed;
+  return Success;
+}
+
+static void benchDeferred(void* ctx_, long iterations){
+  DeferredCtx* ctx = (DeferredCtx*) ctx_;
+  for (long i = 0; i < iterations; ++i){
+    const uint8_t* b = ctx->stream.bytes + (i%ctx->stream.count)*ctx->stream.packet_size;
+    for (int k = 0; k < ctx->stream.packet_size; ++k)
+      PacketHandler_rxByte(&ctx->handler.base_handler, b[k]);
+    if ((i+1)%ctx->batch == 0)
+      DeferredPacketHandler_processPendingPackets(&ctx->handler);
+  }
+  DeferredPacketHandler_processPendingPackets(&ctx->handler);
+  sink = ctx->processed;
+}
+
+static void runPacketBenchmarks(){
+  char params[64];
+  if (selected("packet_rx")){
+    RxCtx* ctx = calloc(1, sizeof(RxCtx));
+    makeStream(&ctx->stream);
+    PacketHandler_initialize(&ctx->handler);
+    ctx->ops.type = DIFFERENTIAL_DRIVE_STATUS_PACKET_ID;
+    ctx->ops.size = sizeof(DifferentialDriveStatusPacket);
+    ctx->ops.initialize_buffer_fn = _rxBuffer;
+    ctx->ops.initialize_buffer_args = ctx;
+    ctx->ops.on_receive_fn = _rxDone;
+    ctx->ops.on_receive_args = ctx;
+    PacketHandler_installPacket(&ctx->handler, &ctx->ops);
+    snprintf(params, sizeof(params), "drive_status/%dB", ctx->stream.packet_size);
+    measure("packet_rx", params, benchRx, ctx, ctx->stream.packet_size);
+    free(ctx->stream.bytes);
+    free(ctx);
+  }
+  if (selected("packet_tx")){
+    TxCtx* ctx = calloc(1, sizeof(TxCtx));
+    PacketHandler_initialize(&ctx->handler);
+    ctx->packet.header.type = DIFFERENTIAL_DRIVE_CONTROL_PACKET_ID;
+    ctx->packet.header.size = sizeof(DifferentialDriveControlPacket);
+    ctx->packet.translational_velocity = 0.3f;
+    ctx->packet.rotational_velocity = -0.1f;
+    snprintf(params, sizeof(params), "drive_control/%dB", (int) sizeof(DifferentialDriveControlPacket)+3);
+    measure("packet_tx", params, benchTx, ctx, sizeof(DifferentialDriveControlPacket)+3);
+    free(ctx);
+  }
+  if (selected("deferred")){
+    // a batch bigger than the buffers of the type would drop packets
+    int batches[] = {1, PACKETS_PER_TYPE_MAX};
+    for (int i = 0; i < 2; ++i){
+      DeferredCtx* ctx = calloc(1, sizeof(DeferredCtx));
+      makeStream(&ctx->stream);
+      DeferredPacketHandler_initialize(&ctx->handler);
+      ctx->batch = batches[i];
+      DeferredPacketHandler_installPacket(&ctx->handler, DIFFERENTIAL_DRIVE_STATUS_PACKET_ID,
+                                          sizeof(DifferentialDriveStatusPacket),
+                                          ctx->buffers, ctx->batch, _deferredAction, ctx);
+      snprintf(params, sizeof(params), "batch %d", ctx->batch);
+      measure("deferred_rx_process", params, benchDeferred, ctx, ctx->stream.packet_size);
+      free(ctx->stream.bytes);
+      free(ctx);
+    }
+  }
+}
+
+/* --- printing --- */
+
+typedef struct PrintCtx{
+  PacketHeader* packet;
+  char buffer[1024];
+} PrintCtx;
+
+static void benchPrint(void* ctx_, long iterations){
+  PrintCtx* ctx = (PrintCtx*) ctx_;
+  uint64_t sum = 0;
+  for (long i = 0; i < iterations; ++i)
+    sum += Orazio_printPacket(ctx->buffer, ctx->packet);
+  sink = sum;
+}
+
+static void runPrintBenchmarks(){
+  if (!selected("print_packet"))
+    return;
+  Orazio_printPacketInit();
+  SystemStatusPacket system_status = {
+    .header.type = SYSTEM_STATUS_PACKET_ID,
+    .header.size = sizeof(SystemStatusPacket),
+    .header.seq = 1234,
+    .rx_packets = 5000,
+    .battery_level = 780,
+    .idle_cycles = 123456
+  };
+  DifferentialDriveStatusPacket drive_status = {
+    .header.type = DIFFERENTIAL_DRIVE_STATUS_PACKET_ID,
+    .header.size = sizeof(DifferentialDriveStatusPacket),
+    .header.seq = 4321,
+    .odom_x = 1.25f,
+    .odom_y = -0.5f,
+    .odom_theta = 0.78f,
+    .enabled = 1
+  };
+  JointStatusPacket joint_status = {
+    .header.header.type = JOINT_STATUS_PACKET_ID,
+    .header.header.size = sizeof(JointStatusPacket),
+    .header.index = 1
+  };
+  PrintCtx ctx;
+  ctx.packet = (PacketHeader*) &system_status;
+  measure("print_packet", "system_status", benchPrint, &ctx, 0);
+  ctx.packet = (PacketHeader*) &drive_status;
+  measure("print_packet", "drive_status", benchPrint, &ctx, 0);
+  ctx.packet = (PacketHeader*) &joint_status;
+  measure("print_packet", "joint_status", benchPrint, &ctx, 0);
+}
+
+/* --- images --- */
+
+typedef struct ImageCtx{
+  uint32_t width;
+  uint32_t height;
+  int quality;
+  uint8_t* yuyv;
+  uint8_t* rgb;
+  uint8_t* gray;
+  uint8_t* out;
+  size_t out_capacity;
+  FILE* null;
+  size_t bytes;
+  video_encoder_t* encoder;
+  uint8_t* moving;    // taller yuyv, the frames of the encoder scroll through it
+  uint64_t stamp_us;
+  video_decoder_t* decoder;
+  uint32_t seq;       // of the frames given to the decoder
+  int check;          // the round trip counts the frames back and their error
+  int frames;
+  int decoded;
+  double luma_error;  // sum over the decoded frames of the mean absolute error
+} ImageCtx;
+
+// gradients plus noise, so the entropy coder has some work to do
+static void fillFrame(uint8_t* rgb, uint32_t width, uint32_t height){
+  uint32_t seed = 1;
+  for (uint32_t r = 0; r < height; ++r){
+    for (uint32_t c = 0; c < width; ++c){
+      seed = seed*1103515245 + 12345;
+      uint8_t noise = (seed >> 16) & 0x1F;
+      uint8_t* p = rgb + ((size_t)r*width + c)*3;
+      p[0] = (c*255/width) ^ noise;
+      p[1] = (r*255/height) + noise;
+      p[2] = ((r+c)*127/(width+height)) ^ (noise << 2);
+    }
+  }
+}
+
+static void fillYuyv(uint8_t* yuyv, uint32_t width, uint32_t height){
+  uint32_t seed = 7;
+  for (size_t i = 0; i < (size_t)width*height*2; ++i){
+    seed = seed*1103515245 + 12345;
+    yuyv[i] = (i & 1) ? 128 + ((seed >> 16) & 0x3F) - 32 : (i/2)%width*255/width;
+  }
+}
+
+static void benchYuyv(void* ctx_, long iterations){
+  ImageCtx* ctx = (ImageCtx*) ctx_;
+  for (long i = 0; i < iterations; ++i)
+    yuyv2rgb_into(ctx->yuyv, ctx->rgb, ctx->width, ctx->height);
+  sink = ctx->rgb[0];
+}
+
+static void benchGray(void* ctx_, long iterations){
+  ImageCtx* ctx = (ImageCtx*) ctx_;
+  for (long i = 0; i < iterations; ++i)
+    yuyv2gray_into(ctx->yuyv, ctx->gray, ctx->width, ctx->height);
+  sink = ctx->gray[0];
+}
+
+// a simulcast layer from the one above it
+static void benchHalf(void* ctx_, long iterations){
+  ImageCtx* ctx = (ImageCtx*) ctx_;
+  for (long i = 0; i < iterations; ++i)
+    yuyv_half_into(ctx->yuyv, ctx->out, ctx->width, ctx->height);
+  sink = ctx->out[0];
+}
+
+// what the motion gate does on each frame: thumbnail and tile differences
+static void benchMotion(void* ctx_, long iterations){
+  ImageCtx* ctx = (ImageCtx*) ctx_;
+  uint32_t w = ctx->width/2, h = ctx->height/2;
+  int change = 0;
+  for (long i = 0; i < iterations; ++i){
+    motion_gate_thumbnail(ctx->yuyv, ctx->out, ctx->width, ctx->height);
+    change += motion_gate_difference(ctx->out, ctx->gray, w, h);
+  }
+  sink = change;
+}
+
+static void benchJpegFile(void* ctx_, long iterations){
+  ImageCtx* ctx = (ImageCtx*) ctx_;
+  for (long i = 0; i < iterations; ++i)
+    jpeg(ctx->null, ctx->rgb, ctx->width, ctx->height, ctx->quality);
+  sink = ftell(ctx->null);
+}
+
+static void benchJpegMem(void* ctx_, long iterations){
+  ImageCtx* ctx = (ImageCtx*) ctx_;
+  size_t bytes = 0;
+  for (long i = 0; i < iterations; ++i)
+    bytes = jpeg_mem(ctx->out, ctx->out_capacity, ctx->rgb, ctx->width, ctx->height, ctx->quality);
+  ctx->bytes = bytes;
+  sink = bytes;
+}
+
+static void benchJpegGray(void* ctx_, long iterations){
+  ImageCtx* ctx = (ImageCtx*) ctx_;
+  size_t bytes = 0;
+  for (long i = 0; i < iterations; ++i)
+    bytes = jpeg_mem_gray(ctx->out, ctx->out_capacity, ctx->gray, ctx->width, ctx->height, ctx->quality);
+  ctx->bytes = bytes;
+  sink = bytes;
+}
+
+// tables-only jpeg a session gets for each quality of the abbreviated frames
+static void benchJpegTables(void* ctx_, long iterations){
+  ImageCtx* ctx = (ImageCtx*) ctx_;
+  size_t bytes = 0;
+  for (long i = 0; i < iterations; ++i)
+    bytes = jpeg_mem_tables(ctx->out, ctx->out_capacity, ctx->quality);
+  ctx->bytes = bytes;
+  sink = bytes;
+}
+
+#define MOVING_ROWS 16
+
+// a capture every 33ms, each one a row lower: the inter-frame codecs
+// have some motion to code, the jpegs convert every frame
+static void benchVideoEncoder(void* ctx_, long iterations){
+  ImageCtx* ctx = (ImageCtx*) ctx_;
+  size_t bytes = 0;
+  for (long i = 0; i < iterations; ++i){
+    ctx->stamp_us += 33333;
+    const uint8_t* yuyv = ctx->moving + (ctx->stamp_us / 33333 % MOVING_ROWS) * ctx->width * 2;
+    bytes += video_encoder_encode(ctx->encoder, yuyv, ctx->width, ctx->height,
+                                  ctx->stamp_us, ctx->out, ctx->out_capacity);
+  }
+  ctx->bytes = iterations ? bytes / iterations : 0;
+  sink = bytes;
+}
+
+// mean absolute difference between the luma of a capture and of its decoded bgr
+static double lumaError(const uint8_t* yuyv, const uint8_t* bgr, uint32_t width, uint32_t height){
+  uint64_t sum = 0;
+  for (size_t i = 0; i < (size_t)width*height; ++i){
+    const uint8_t* p = bgr + i*3;
+    int luma = (29*p[0] + 150*p[1] + 77*p[2]) >> 8;
+    sum += abs(luma - yuyv[i*2]);
+  }
+  return (double)sum/((size_t)width*height);
+}
+
+// each frame is encoded and decoded in order, as a viewer of the stream
+// gets them: an inter-frame codec that loses a frame waits for a keyframe
+static void benchVideoRoundtrip(void* ctx_, long iterations){
+  ImageCtx* ctx = (ImageCtx*) ctx_;
+  for (long i = 0; i < iterations; ++i){
+    ctx->stamp_us += 33333;
+    const uint8_t* yuyv = ctx->moving + (ctx->stamp_us / 33333 % MOVING_ROWS) * ctx->width * 2;
+    size_t size = video_encoder_encode(ctx->encoder, yuyv, ctx->width, ctx->height,
+                                       ctx->stamp_us, ctx->out, ctx->out_capacity);
+    uint8_t* bgr;
+    uint32_t width, height;
+    ++ctx->seq;
+    ++ctx->frames;
+    if (!size || video_decoder_decode(ctx->decoder, ctx->encoder->codec, ctx->seq, ctx->encoder->keyframe,
+                                      ctx->out, size, &bgr, &width, &height))
+      continue;
+    if (width != ctx->width || height != ctx->height)
+      continue;
+    ++ctx->decoded;
+    if (ctx->check)
+      ctx->luma_error += lumaError(yuyv, bgr, width, height);
+    sink = bgr[0];
+  }
+}
+
+static void imageInit(ImageCtx* ctx, uint32_t width, uint32_t height){
+  ctx->width = width;
+  ctx->height = height;
+  ctx->yuyv = malloc((size_t)width*height*2);
+  ctx->rgb = malloc((size_t)width*height*3);
+  ctx->gray = malloc((size_t)width*height);
+  ctx->out_capacity = (size_t)width*height*3;
+  ctx->out = malloc(ctx->out_capacity);
+  fillYuyv(ctx->yuyv, width, height);
+  fillFrame(ctx->rgb, width, height);
+  // the luma of the rgb frame, so that the gray jpegs compare with the color ones
+  for (size_t i = 0; i < (size_t)width*height; ++i){
+    const uint8_t* p = ctx->rgb + i*3;
+    ctx->gray[i] = (77*p[0] + 150*p[1] + 29*p[2]) >> 8;
+  }
+}
+
+static void imageFree(ImageCtx* ctx){
+  free(ctx->yuyv);
+  free(ctx->rgb);
+  free(ctx->gray);
+  free(ctx->out);
+}
+
+static void runImageBenchmarks(int max_workers){
+  static const uint32_t sizes[][2] = {{320, 240}, {640, 480}, {1280, 720}};
+  static const int qualities[] = {15, 50, 90};
+  char params[64];
+  for (int s = 0; s < 3; ++s){
+    ImageCtx ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    imageInit(&ctx, sizes[s][0], sizes[s][1]);
+    if (selected("yuyv2rgb")){
+      snprintf(params, sizeof(params), "%ux%u", ctx.width, ctx.height);
+      measure("yuyv2rgb", params, benchYuyv, &ctx, (double)ctx.width*ctx.height*2);
+    }
+    if (selected("yuyv2gray")){
+      snprintf(params, sizeof(params), "%ux%u", ctx.width, ctx.height);
+      measure("yuyv2gray", params, benchGray, &ctx, (double)ctx.width*ctx.height*2);
+    }
+    if (selected("yuyv_half")){
+      snprintf(params, sizeof(params), "%ux%u", ctx.width, ctx.height);
+      measure("yuyv_half", params, benchHalf, &ctx, (double)ctx.width*ctx.height*2);
+    }
+    if (selected("motion_gate")){
+      snprintf(params, sizeof(params), "%ux%u", ctx.width, ctx.height);
+      measure("motion_gate", params, benchMotion, &ctx, (double)ctx.width*ctx.height*2);
+    }
+    if (selected("jpeg_file")){
+      ctx.null = fopen("/dev/null", "w");
+      for (int q = 0; q < 3; ++q){
+        ctx.quality = qualities[q];
+        snprintf(params, sizeof(params), "%ux%u q%d", ctx.width, ctx.height, ctx.quality);
+        measure("jpeg_file", params, benchJpegFile, &ctx, (double)ctx.width*ctx.height*3);
+      }
+      fclose(ctx.null);
+    }
+    if (selected("jpeg_mem")){
+      for (int q = 0; q < 3; ++q){
+        ctx.quality = qualities[q];
+        benchJpegMem(&ctx, 1);
+        snprintf(params, sizeof(params), "%ux%u q%d %zuB", ctx.width, ctx.height, ctx.quality, ctx.bytes);
+        measure("jpeg_mem", params, benchJpegMem, &ctx, (double)ctx.width*ctx.height*3);
+      }
+    }
+    if (selected("jpeg_gray")){
+      for (int q = 0; q < 3; ++q){
+        ctx.quality = qualities[q];
+        benchJpegGray(&ctx, 1);
+        snprintf(params, sizeof(params), "%ux%u q%d %zuB", ctx.width, ctx.height, ctx.quality, ctx.bytes);
+        measure("jpeg_gray", params, benchJpegGray, &ctx, (double)ctx.width*ctx.height);
+      }
+    }
+    // size and time of the tables left out of abbreviated frames and of
+    // huffman tables fitted to each frame
+    if (selected("jpeg_coding")){
+      static const int options[] = {0, JPEG_ABBREVIATED, JPEG_OPTIMIZE_CODING,
+                                    JPEG_ABBREVIATED | JPEG_OPTIMIZE_CODING};
+      static const char* option_names[] = {"full", "abbreviated", "optimized", "abbreviated+optimized"};
+      for (int q = 0; q < 3; ++q){
+        ctx.quality = qualities[q];
+        for (int o = 0; o < 4; ++o){
+          jpeg_set_options(options[o]);
+          benchJpegMem(&ctx, 1);
+          snprintf(params, sizeof(params), "%ux%u q%d %s %zuB", ctx.width, ctx.height,
+                   ctx.quality, option_names[o], ctx.bytes);
+          measure("jpeg_coding", params, benchJpegMem, &ctx, (double)ctx.width*ctx.height*3);
+        }
+      }
+      jpeg_set_options(0);
+    }
+    // whole pipeline from the capture, per codec, at the default quality
+    if (selected("video_encoder")){
+      ctx.moving = malloc((size_t)ctx.width*(ctx.height + MOVING_ROWS)*2);
+      fillYuyv(ctx.moving, ctx.width, ctx.height + MOVING_ROWS);
+      for (int codec = 0; codec < VideoCodecCount; ++codec){
+        if (!video_encoder_available(codec))
+          continue;
+        for (int gray = 0; gray < 2; ++gray){
+          ctx.encoder = video_encoder_create(codec, gray);
+          ctx.stamp_us = 0;
+          // the first frame of an inter-frame codec is a keyframe
+          benchVideoEncoder(&ctx, 1);
+          benchVideoEncoder(&ctx, 30);
+          snprintf(params, sizeof(params), "%ux%u %s%s %zuB", ctx.width, ctx.height,
+                   video_codec_name(codec), gray ? " gray" : "", ctx.bytes);
+          measure("video_encoder", params, benchVideoEncoder, &ctx, (double)ctx.width*ctx.height*2);
+          video_encoder_destroy(ctx.encoder);
+        }
+      }
+      free(ctx.moving);
+    }
+    // the decoder of the viewers behind each encoder: the frames that came
+    // back and the error of their luma, then the time of both ends
+    if (selected("video_roundtrip")){
+      ctx.moving = malloc((size_t)ctx.width*(ctx.height + MOVING_ROWS)*2);
+      fillYuyv(ctx.moving, ctx.width, ctx.height + MOVING_ROWS);
+      for (int codec = 0; codec < VideoCodecCount; ++codec){
+        if (!video_encoder_available(codec))
+          continue;
+        for (int gray = 0; gray < 2; ++gray){
+          ctx.encoder = video_encoder_create(codec, gray);
+          ctx.decoder = video_decoder_create();
+          ctx.stamp_us = 0;
+          ctx.seq = 0;
+          ctx.frames = ctx.decoded = 0;
+          ctx.luma_error = 0;
+          ctx.check = 1;
+          benchVideoRoundtrip(&ctx, 60);
+          ctx.check = 0;
+          snprintf(params, sizeof(params), "%ux%u %s%s %d/%d decoded luma err %.1f",
+                   ctx.width, ctx.height, video_codec_name(codec), gray ? " gray" : "",
+                   ctx.decoded, ctx.frames, ctx.decoded ? ctx.luma_error/ctx.decoded : 0);
+          measure("video_roundtrip", params, benchVideoRoundtrip, &ctx, (double)ctx.width*ctx.height*2);
+          video_decoder_destroy(ctx.decoder);
+          video_encoder_destroy(ctx.encoder);
+        }
+      }
+      free(ctx.moving);
+    }
+    if (s == 0 && selected("jpeg_tables")){
+      for (int q = 0; q < 3; ++q){
+        ctx.quality = qualities[q];
+        benchJpegTables(&ctx, 1);
+        snprintf(params, sizeof(params), "q%d %zuB", ctx.quality, ctx.bytes);
+        measure("jpeg_tables", params, benchJpegTables, &ctx, 0);
+      }
+    }
+    imageFree(&ctx);
+  }
+
+  // strip encoder scaling on the biggest frame
+  if (selected("jpeg_strips")){
+    ImageCtx ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    imageInit(&ctx, 1280, 720);
+    ctx.quality = 15;
+    for (int workers = 1; workers <= max_workers; ++workers){
+      jpeg_set_workers(workers);
+      snprintf(params, sizeof(params), "%ux%u q%d workers %d", ctx.width, ctx.height, ctx.quality, workers);
+      measure("jpeg_strips", params, benchJpegMem, &ctx, (double)ctx.width*ctx.height*3);
+    }
+    jpeg_set_workers(1);
+    imageFree(&ctx);
+  }
+}
+
+int main(int argc, char** argv){
+  int max_workers = sysconf(_SC_NPROCESSORS_ONLN);
+  int c = 1;
+  while(c < argc){
+    if(!strcmp(argv[c], "-filter") && c+1 < argc){
+      c++;
+      filter = argv[c];
+    }
+    else if(!strcmp(argv[c], "-min-time") && c+1 < argc){
+      c++;
+      min_time_ms = atoi(argv[c]);
+    }
+    else if(!strcmp(argv[c], "-repeats") && c+1 < argc){
+      c++;
+      repeats = atoi(argv[c]);
+    }
+    else if(!strcmp(argv[c], "-workers") && c+1 < argc){
+      c++;
+      max_workers = atoi(argv[c]);
+    }
+    else {
+      printBanner();
+      return 0;
+    }
+    c++;
+  }
+  if (max_workers < 1)
+    max_workers = 1;
+  if (repeats < 1)
+    repeats = 1;
+
+  printf("bench\tcase\tops\tns_per_op\tmb_per_s\n");
+  runPacketBenchmarks();
+  runPrintBenchmarks();
+  runImageBenchmarks(max_workers);
+  return 0;
+}
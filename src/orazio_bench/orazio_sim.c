@@ -0,0 +1,497 @@
+/*  Firmware emulator: speaks the orazio serial protocol on a pseudo terminal,
+    so that rrc_host can run without a robot. It answers the parameter
+    queries, applies the drive and joint controls, integrates the odometry
+    and closes an epoch every -period-ms with the status packets selected by
+    the periodic mask followed by the end epoch packet.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/timerfd.h>
+#include "deferred_packet_handler.h"
+#include "orazio_packets.h"
+
+#define FIRMWARE_VERSION 0x20181015
+#define TICKS_PER_METER 8000.f    // encoder ticks of a wheel per meter
+#define STATS_PERIOD_US 1000000
+#define BACKLOG_MAX 1024          // unread bytes on the terminal that mean nobody reads it
+
+const char *banner[]={
+  "orazio_sim",
+  "emulates the orazio firmware on a pseudo terminal",
+  "usage:"
+  "$> orazio_sim <parameters>",
+  "parameters: ",
+  "-link  <string>: symlink to the terminal, to pass as -serial-dev (default /tmp/orazio_sim)",
+  "-period-ms <int>: epoch period (default 10)",
+  "-quiet         : no statistics",
+  0
+};
+
+void printBanner(){
+  const char*const* line=banner;
+  while (*line) {
+    printf("%s\n",*line);
+    line++;
+  }
+}
+
+static volatile sig_atomic_t interrupted = 0;
+
+static void sigint_handler(int sig){
+  interrupted = 1;
+}
+
+typedef struct OrazioSim{
+  int fd;                     // master side of the terminal
+  int slave;                  // kept open, the host opens it by name
+  DeferredPacketHandler handler;
+  uint16_t seq;
+
+  SystemParamPacket system_param;
+  SystemStatusPacket system_status;
+  JointParamPacket joint_param[NUM_JOINTS];
+  JointStatusPacket joint_status[NUM_JOINTS];
+  DifferentialDriveParamPacket drive_param;
+  DifferentialDriveStatusPacket drive_status;
+  SonarParamPacket sonar_param;
+  SonarStatusPacket sonar_status;
+
+  // receive buffers of the deferred handler
+  ParamControlPacket param_control_buffers[PACKETS_PER_TYPE_MAX];
+  SystemParamPacket system_param_buffers[PACKETS_PER_TYPE_MAX];
+  JointParamPacket joint_param_buffers[PACKETS_PER_TYPE_MAX];
+  JointControlPacket joint_control_buffers[PACKETS_PER_TYPE_MAX];
+  DifferentialDriveParamPacket drive_param_buffers[PACKETS_PER_TYPE_MAX];
+  DifferentialDriveControlPacket drive_control_buffers[PACKETS_PER_TYPE_MAX];
+  SonarParamPacket sonar_param_buffers[PACKETS_PER_TYPE_MAX];
+
+  int watchdog;               // epochs left before the base stops
+
+  // since the last report
+  uint32_t epochs;
+  uint32_t drive_controls;
+  uint32_t rx_bytes;
+  uint32_t tx_bytes;
+} OrazioSim;
+
+static void _write(OrazioSim* sim, const uint8_t* buf, size_t size){
+  while (size){
+    ssize_t n = write(sim->fd, buf, size);
+    if (n < 0){
+      if (errno == EINTR)
+        continue;
+      // nobody reads the terminal and its queue is full: drop the rest
+      return;
+    }
+    buf += n;
+    size -= n;
+    sim->tx_bytes += n;
+  }
+}
+
+// sends a packet right away, the tx buffer of the handler holds just a few
+static void _send(OrazioSim* sim, PacketHeader* p){
+  PacketHandler* h = &sim->handler.base_handler;
+  p->seq = ++sim->seq;
+  if (PacketHandler_sendPacket(h, p) != Success)
+    return;
+  uint8_t buf[PACKET_SIZE_MAX];
+  size_t size = 0;
+  while (h->tx_size)
+    buf[size++] = PacketHandler_txByte(h);
+  _write(sim, buf, size);
+}
+
+static void _respond(OrazioSim* sim, PacketHeader* p, PacketStatus result){
+  ResponsePacket response;
+  INIT_PACKET(response, RESPONSE_PACKET_ID);
+  response.p_type = p->type;
+  response.p_seq = p->seq;
+  response.p_result = result;
+  _send(sim, (PacketHeader*) &response);
+}
+
+static PacketStatus _onParamControl(PacketHeader* p, void* args){
+  OrazioSim* sim = (OrazioSim*) args;
+  ParamControlPacket* query = (ParamControlPacket*) p;
+  PacketStatus result = Success;
+  switch (query->param_type){
+  case ParamSystem:
+    _send(sim, (PacketHeader*) &sim->system_param);
+    break;
+  case ParamJointsSingle:
+    if (query->index < NUM_JOINTS)
+      _send(sim, (PacketHeader*) &sim->joint_param[query->index]);
+    else
+      result = GenericError;
+    break;
+  case ParamDrive:
+    _send(sim, (PacketHeader*) &sim->drive_param);
+    break;
+  case ParamSonar:
+    _send(sim, (PacketHeader*) &sim->sonar_param);
+    break;
+  default:
+    result = UnknownType;
+  }
+  _respond(sim, p, result);
+  return result;
+}
+
+static PacketStatus _onSystemParam(PacketHeader* p, void* args){
+  OrazioSim* sim = (OrazioSim*) args;
+  SystemParamPacket* param = (SystemParamPacket*) p;
+  // the host can change what it receives, not what the firmware is
+  sim->system_param.periodic_packet_mask = param->periodic_packet_mask;
+  sim->system_param.watchdog_cycles = param->watchdog_cycles;
+  _send(sim, (PacketHeader*) &sim->system_param);
+  _respond(sim, p, Success);
+  return Success;
+}
+
+static PacketStatus _onJointParam(PacketHeader* p, void* args){
+  OrazioSim* sim = (OrazioSim*) args;
+  JointParamPacket* param = (JointParamPacket*) p;
+  if (param->header.index >= NUM_JOINTS){
+    _respond(sim, p, GenericError);
+    return GenericError;
+  }
+  sim->joint_param[param->header.index].param = param->param;
+  _send(sim, (PacketHeader*) &sim->joint_param[param->header.index]);
+  _respond(sim, p, Success);
+  return Success;
+}
+
+static PacketStatus _onJointControl(PacketHeader* p, void* args){
+  OrazioSim* sim = (OrazioSim*) args;
+  JointControlPacket* control = (JointControlPacket*) p;
+  if (control->header.index >= NUM_JOINTS)
+    return GenericError;
+  JointInfo* info = &sim->joint_status[control->header.index].info;
+  info->mode = control->control.mode;
+  info->desired_speed = control->control.speed;
+  sim->watchdog = sim->system_param.watchdog_cycles;
+  return Success;
+}
+
+static PacketStatus _onDriveParam(PacketHeader* p, void* args){
+  OrazioSim* sim = (OrazioSim*) args;
+  PacketHeader header = sim->drive_param.header;
+  sim->drive_param = *(DifferentialDriveParamPacket*) p;
+  sim->drive_param.header = header;
+  _send(sim, (PacketHeader*) &sim->drive_param);
+  _respond(sim, p, Success);
+  return Success;
+}
+
+static PacketStatus _onDriveControl(PacketHeader* p, void* args){
+  OrazioSim* sim = (OrazioSim*) args;
+  DifferentialDriveControlPacket* control = (DifferentialDriveControlPacket*) p;
+  sim->drive_status.translational_velocity_desired = control->translational_velocity;
+  sim->drive_status.rotational_velocity_desired = control->rotational_velocity;
+  sim->drive_status.enabled = 1;
+  sim->watchdog = sim->system_param.watchdog_cycles;
+  ++sim->drive_controls;
+  return Success;
+}
+
+static PacketStatus _onSonarParam(PacketHeader* p, void* args){
+  OrazioSim* sim = (OrazioSim*) args;
+  memcpy(sim->sonar_param.pattern, ((SonarParamPacket*) p)->pattern, SONARS_MAX);
+  _send(sim, (PacketHeader*) &sim->sonar_param);
+  _respond(sim, p, Success);
+  return Success;
+}
+
+static void _initIndexed(PacketIndexed* header, PacketType type, PacketSize size, uint8_t index){
+  header->header.type = type;
+  header->header.size = size;
+  header->header.seq = 0;
+  header->index = index;
+}
+
+static void _install(OrazioSim* sim, PacketType type, PacketSize size, void* buffers, PacketFn action){
+  DeferredPacketHandler_installPacket(&sim->handler, type, size, buffers,
+                                      PACKETS_PER_TYPE_MAX, action, sim);
+}
+
+static void OrazioSim_init(OrazioSim* sim, int fd, int slave, int period_ms){
+  memset(sim, 0, sizeof(OrazioSim));
+  sim->fd = fd;
+  sim->slave = slave;
+  DeferredPacketHandler_initialize(&sim->handler);
+  _install(sim, PARAM_CONTROL_PACKET_ID, sizeof(ParamControlPacket),
+           sim->param_control_buffers, _onParamControl);
+  _install(sim, SYSTEM_PARAM_PACKET_ID, sizeof(SystemParamPacket),
+           sim->system_param_buffers, _onSystemParam);
+  _install(sim, JOINT_PARAM_PACKET_ID, sizeof(JointParamPacket),
+           sim->joint_param_buffers, _onJointParam);
+  _install(sim, JOINT_CONTROL_PACKET_ID, sizeof(JointControlPacket),
+           sim->joint_control_buffers, _onJointControl);
+  _install(sim, DIFFERENTIAL_DRIVE_PARAM_PACKET_ID, sizeof(DifferentialDriveParamPacket),
+           sim->drive_param_buffers, _onDriveParam);
+  _install(sim, DIFFERENTIAL_DRIVE_CONTROL_PACKET_ID, sizeof(DifferentialDriveControlPacket),
+           sim->drive_control_buffers, _onDriveControl);
+  _install(sim, SONAR_PARAM_PACKET_ID, sizeof(SonarParamPacket),
+           sim->sonar_param_buffers, _onSonarParam);
+
+  INIT_PACKET(sim->system_param, SYSTEM_PARAM_PACKET_ID);
+  sim->system_param.protocol_version = ORAZIO_PROTOCOL_VERSION;
+  sim->system_param.firmware_version = FIRMWARE_VERSION;
+  sim->system_param.timer_period_ms = period_ms;
+  sim->system_param.comm_speed = 115200;
+  sim->system_param.comm_cycles = 1;
+  sim->system_param.periodic_packet_mask = PSystemStatusFlag|PJointStatusFlag|PDriveStatusFlag;
+  sim->system_param.watchdog_cycles = 50;
+  sim->system_param.num_joints = NUM_JOINTS;
+  INIT_PACKET(sim->system_status, SYSTEM_STATUS_PACKET_ID);
+  sim->system_status.rx_buffer_size = PACKET_SIZE_MAX;
+  sim->system_status.tx_buffer_size = PACKET_SIZE_MAX;
+  sim->system_status.battery_level = 1200;
+
+  for (int i = 0; i < NUM_JOINTS; ++i){
+    _initIndexed(&sim->joint_param[i].header, JOINT_PARAM_PACKET_ID, sizeof(JointParamPacket), i);
+    sim->joint_param[i].param.kp = 255;
+    sim->joint_param[i].param.ki = 32;
+    sim->joint_param[i].param.max_i = 255;
+    sim->joint_param[i].param.max_pwm = 255;
+    sim->joint_param[i].param.max_speed = 100;
+    sim->joint_param[i].param.slope = 5;
+    _initIndexed(&sim->joint_status[i].header, JOINT_STATUS_PACKET_ID, sizeof(JointStatusPacket), i);
+  }
+
+  INIT_PACKET(sim->drive_param, DIFFERENTIAL_DRIVE_PARAM_PACKET_ID);
+  sim->drive_param.ikr = 1/TICKS_PER_METER;
+  sim->drive_param.ikl = -1/TICKS_PER_METER;
+  sim->drive_param.baseline = 0.3f;
+  sim->drive_param.max_translational_velocity = 1;
+  sim->drive_param.max_translational_acceleration = 3;
+  sim->drive_param.max_translational_brake = 6;
+  sim->drive_param.max_rotational_velocity = 2;
+  sim->drive_param.max_rotational_acceleration = 15;
+  sim->drive_param.right_joint_index = 0;
+  sim->drive_param.left_joint_index = 1;
+  INIT_PACKET(sim->drive_status, DIFFERENTIAL_DRIVE_STATUS_PACKET_ID);
+
+  INIT_PACKET(sim->sonar_param, SONAR_PARAM_PACKET_ID);
+  INIT_PACKET(sim->sonar_status, SONAR_STATUS_PACKET_ID);
+}
+
+static float _ramp(float current, float desired, float max_step){
+  float delta = desired - current;
+  if (delta > max_step)
+    delta = max_step;
+  if (delta < -max_step)
+    delta = -max_step;
+  return current + delta;
+}
+
+static float _clampAbs(float v, float max){
+  return v > max ? max : v < -max ? -max : v;
+}
+
+// what the control loop of the firmware does in one epoch, with ideal motors
+static void _integrate(OrazioSim* sim, float dt){
+  DifferentialDriveStatusPacket* s = &sim->drive_status;
+  const DifferentialDriveParamPacket* p = &sim->drive_param;
+  if (sim->watchdog > 0 && !--sim->watchdog){
+    s->translational_velocity_desired = 0;
+    s->rotational_velocity_desired = 0;
+  }
+  float tv = _clampAbs(s->translational_velocity_desired, p->max_translational_velocity);
+  float rv = _clampAbs(s->rotational_velocity_desired, p->max_rotational_velocity);
+  float tv_step = (fabsf(tv) < fabsf(s->translational_velocity_adjusted)
+                   ? p->max_translational_brake : p->max_translational_acceleration)*dt;
+  s->translational_velocity_adjusted = _ramp(s->translational_velocity_adjusted, tv, tv_step);
+  s->rotational_velocity_adjusted = _ramp(s->rotational_velocity_adjusted, rv,
+                                          p->max_rotational_acceleration*dt);
+  s->translational_velocity_measured = s->translational_velocity_adjusted;
+  s->rotational_velocity_measured = s->rotational_velocity_adjusted;
+
+  float ds = s->translational_velocity_measured*dt;
+  float dtheta = s->rotational_velocity_measured*dt;
+  s->odom_x += ds*cosf(s->odom_theta + dtheta/2);
+  s->odom_y += ds*sinf(s->odom_theta + dtheta/2);
+  s->odom_theta = remainderf(s->odom_theta + dtheta, 2*M_PI);
+
+  // wheel speeds in ticks per epoch, right and left
+  float wheel[2] = {ds + dtheta*p->baseline/2, ds - dtheta*p->baseline/2};
+  for (int i = 0; i < NUM_JOINTS; ++i){
+    JointInfo* info = &sim->joint_status[i].info;
+    int16_t speed = (int16_t) lrintf(wheel[i%2]*TICKS_PER_METER);
+    info->encoder_speed = speed;
+    info->encoder_position += speed;
+    info->pwm = speed*4;
+  }
+}
+
+static void _endEpoch(OrazioSim* sim, float dt){
+  _integrate(sim, dt);
+  /* without a host the epochs pile up in the terminal, and a host starting
+     later would wade through them before any reply: drop them as a board
+     does when the port is closed */
+  int unread = 0;
+  if (!ioctl(sim->slave, FIONREAD, &unread) && unread > BACKLOG_MAX)
+    tcflush(sim->slave, TCIFLUSH);
+  uint8_t mask = sim->system_param.periodic_packet_mask;
+  if (mask & PSystemStatusFlag){
+    sim->system_status.idle_cycles += 1000;
+    sim->system_status.watchdog_count = sim->watchdog;
+    _send(sim, (PacketHeader*) &sim->system_status);
+  }
+  if (mask & PJointStatusFlag)
+    for (int i = 0; i < NUM_JOINTS; ++i)
+      _send(sim, (PacketHeader*) &sim->joint_status[i]);
+  if (mask & PDriveStatusFlag)
+    _send(sim, (PacketHeader*) &sim->drive_status);
+  if (mask & PSonarStatusFlag)
+    _send(sim, (PacketHeader*) &sim->sonar_status);
+  EndEpochPacket end_epoch = {
+    .type = END_EPOCH_PACKET_ID,
+    .size = sizeof(EndEpochPacket)
+  };
+  _send(sim, &end_epoch);
+  ++sim->epochs;
+}
+
+static void _receive(OrazioSim* sim){
+  uint8_t buf[256];
+  ssize_t n;
+  while ((n = read(sim->fd, buf, sizeof(buf))) > 0){
+    sim->rx_bytes += n;
+    for (ssize_t i = 0; i < n; ++i){
+      PacketStatus status = PacketHandler_rxByte(&sim->handler.base_handler, buf[i]);
+      if (status == SyncChecksum)
+        ++sim->system_status.rx_packets;
+      else if (status < 0)
+        ++sim->system_status.rx_packet_errors;
+    }
+    // the firmware main loop, the host waits for the replies
+    DeferredPacketHandler_processPendingPackets(&sim->handler);
+  }
+}
+
+static uint64_t _nowUs(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+// opens a pseudo terminal in raw mode, links its slave side to link_path
+static int _openTerminal(const char* link_path, int* slave){
+  int fd = posix_openpt(O_RDWR|O_NOCTTY);
+  if (fd < 0 || grantpt(fd) || unlockpt(fd))
+    return -1;
+  const char* name = ptsname(fd);
+  // holding the slave open keeps the master readable between two hosts
+  *slave = open(name, O_RDWR|O_NOCTTY);
+  if (*slave < 0)
+    return -1;
+  struct termios tty;
+  tcgetattr(*slave, &tty);
+  cfmakeraw(&tty);
+  tcsetattr(*slave, TCSANOW, &tty);
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  unlink(link_path);
+  if (symlink(name, link_path)){
+    perror("symlink");
+    return -1;
+  }
+  printf("[orazio_sim] %s -> %s\n", link_path, name);
+  return fd;
+}
+
+int main(int argc, char** argv){
+  const char* link_path = "/tmp/orazio_sim";
+  int period_ms = 10;
+  int quiet = 0;
+  int c = 1;
+  while(c < argc){
+    if(!strcmp(argv[c], "-link") && c+1 < argc){
+      c++;
+      link_path = argv[c];
+    }
+    else if(!strcmp(argv[c], "-period-ms") && c+1 < argc){
+      c++;
+      period_ms = atoi(argv[c]);
+    }
+    else if(!strcmp(argv[c], "-quiet")){
+      quiet = 1;
+    }
+    else {
+      printBanner();
+      return 0;
+    }
+    c++;
+  }
+  if (period_ms < 1)
+    period_ms = 1;
+
+  signal(SIGINT, sigint_handler);
+  signal(SIGTERM, sigint_handler);
+  int slave;
+  int fd = _openTerminal(link_path, &slave);
+  if (fd < 0){
+    fprintf(stderr, "[orazio_sim] cannot open a pseudo terminal\n");
+    return -1;
+  }
+  int timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+  struct itimerspec period = {
+    .it_interval = { .tv_sec = period_ms/1000, .tv_nsec = (period_ms%1000)*1000000L },
+    .it_value = { .tv_sec = period_ms/1000, .tv_nsec = (period_ms%1000)*1000000L }
+  };
+  timerfd_settime(timer, 0, &period, NULL);
+
+  OrazioSim* sim = malloc(sizeof(OrazioSim));
+  OrazioSim_init(sim, fd, slave, period_ms);
+  uint64_t last_report = _nowUs();
+  while (!interrupted){
+    struct pollfd pfds[2] = {
+      { .fd = fd, .events = POLLIN },
+      { .fd = timer, .events = POLLIN }
+    };
+    if (poll(pfds, 2, -1) < 0)
+      continue;
+    if (pfds[0].revents & POLLIN)
+      _receive(sim);
+    if (pfds[1].revents & POLLIN){
+      uint64_t expirations;
+      if (read(timer, &expirations, sizeof(expirations)) != sizeof(expirations))
+        continue;
+      // a late wake up makes a longer epoch, as a busy firmware would
+      _endEpoch(sim, expirations*period_ms*1e-3f);
+    }
+    uint64_t now = _nowUs();
+    if (now - last_report >= STATS_PERIOD_US){
+      float seconds = (now - last_report)*1e-6f;
+      if (!quiet)
+        printf("[orazio_sim] %.1f epochs/s, %.1f drive controls/s, rx %.0f B/s, tx %.0f B/s, tv %.2f rv %.2f\n",
+               sim->epochs/seconds, sim->drive_controls/seconds,
+               sim->rx_bytes/seconds, sim->tx_bytes/seconds,
+               sim->drive_status.translational_velocity_measured,
+               sim->drive_status.rotational_velocity_measured);
+      fflush(stdout);
+      sim->epochs = sim->drive_controls = sim->rx_bytes = sim->tx_bytes = 0;
+      last_report = now;
+    }
+  }
+  unlink(link_path);
+  close(timer);
+  close(slave);
+  close(fd);
+  free(sim);
+  printf("[orazio_sim] terminated\n");
+  return 0;
+}
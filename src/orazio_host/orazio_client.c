@@ -3,11 +3,14 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include "orazio_client.h"
 #include "orazio_print_packet.h"
 #include "serial_linux.h"
+#include "latency_stats.h"
 
 #define NUM_JOINTS_MAX 4
+#define EPOCH_PERIOD_GAIN 0.05f // weight of the last period in the epoch period average
 const char* download_new_version_message[] ={
   "please download a fresh revision of client and firmware at",
   "  https://gitlab.com/srrg-software/srrg2_orazio_core",
@@ -68,6 +71,16 @@ typedef struct OrazioClient {
   DifferentialDriveControlPacket drive_control_packet; // deferred drive control packet only one per comm cycle will be sent
   JointControlPacket joint_control[NUM_JOINTS_MAX];
   // deferred joint control packet only one per comm cycle will be sent
+  int joint_control_pending[NUM_JOINTS_MAX];
+
+  // epoch scheduler: controls go out right after each EndEpochPacket
+  OrazioClientEpochFn epoch_fn;
+  void* epoch_args;
+  uint64_t last_epoch_us;   // arrival of the last EndEpochPacket
+  float epoch_period_us;    // moving average of the epoch period
+  uint64_t command_stamp_us; // stamp of the command not yet sent, 0 if none
+  latency_stats_t command_phase;  // command stamp after the last epoch
+  latency_stats_t actuation;      // command stamp to the epoch that applies it
 
   int rx_bytes;
   int tx_bytes;
@@ -119,6 +132,12 @@ static PacketStatus _installPacketOp(OrazioClient* cl,
   return install_result;
 }
 
+static uint64_t _now_us(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 static void _flushBuffer(OrazioClient* cl){
   while(cl->packet_handler.tx_size){
     uint8_t c=PacketHandler_txByte(&cl->packet_handler);
@@ -163,6 +182,14 @@ OrazioClient* OrazioClient_init(const char* device, uint32_t baudrate){
   cl->num_joints=0;
   cl->rx_bytes=0;
   cl->tx_bytes=0;
+  memset(cl->joint_control_pending, 0, sizeof(cl->joint_control_pending));
+  cl->epoch_fn=0;
+  cl->epoch_args=0;
+  cl->last_epoch_us=0;
+  cl->epoch_period_us=0;
+  cl->command_stamp_us=0;
+  latency_stats_init(&cl->command_phase);
+  latency_stats_init(&cl->actuation);
   
   // initializes the packets to send
   DifferentialDriveControlPacket ddcp={
@@ -306,12 +333,46 @@ PacketStatus OrazioClient_sendPacket(OrazioClient* cl, PacketHeader* p, int time
   return send_result;
 }
 
+// sends the controls, to be called with the write mutex held
+static void _sendControls(OrazioClient* cl){
+  if(cl->drive_control_packet.header.seq)
+    _sendPacket(cl, (PacketHeader*) (&cl->drive_control_packet));
+  for (int i=0; i<NUM_JOINTS_MAX; ++i){
+    if (! cl->joint_control_pending[i])
+      continue;
+    _sendPacket(cl, (PacketHeader*) (&cl->joint_control[i]));
+    cl->joint_control_pending[i]=0;
+  }
+  _flushBuffer(cl);
+  // the firmware applies what it got during this epoch at the beginning of the next
+  if (cl->command_stamp_us && cl->epoch_period_us>0){
+    uint64_t applied=cl->last_epoch_us+(uint64_t)cl->epoch_period_us;
+    latency_stats_add(&cl->actuation, (int64_t)(applied-cl->command_stamp_us));
+  }
+  cl->command_stamp_us=0;
+}
+
+static void _onEndEpoch(OrazioClient* cl){
+  uint64_t now=_now_us();
+  if (cl->last_epoch_us){
+    float period=now-cl->last_epoch_us;
+    cl->epoch_period_us = cl->epoch_period_us>0
+      ? cl->epoch_period_us+EPOCH_PERIOD_GAIN*(period-cl->epoch_period_us)
+      : period;
+  }
+  cl->last_epoch_us=now;
+  // last chance to pick up a newer command for this epoch
+  if (cl->epoch_fn)
+    (*cl->epoch_fn)(cl, cl->epoch_args);
+  pthread_mutex_lock(&cl->write_mutex);
+  _sendControls(cl);
+  pthread_mutex_unlock(&cl->write_mutex);
+}
+
 PacketStatus OrazioClient_sync(OrazioClient* cl, int cycles) {
   for (int c=0; c<cycles; ++c){
     pthread_mutex_lock(&cl->write_mutex);
     _flushBuffer(cl);
-    if(cl->drive_control_packet.header.seq)
-      _sendPacket(cl, (PacketHeader*) (&cl->drive_control_packet));
     pthread_mutex_unlock(&cl->write_mutex);
     uint16_t current_seq=cl->end_epoch.seq;
     do {
@@ -320,6 +381,7 @@ PacketStatus OrazioClient_sync(OrazioClient* cl, int cycles) {
       pthread_mutex_unlock(&cl->read_mutex);
     } while (current_seq==cl->end_epoch.seq);
     //printf ("Sync! current_seq:%d\n", cl->end_epoch.seq);
+    _onEndEpoch(cl);
   }
   return Success;
 }
@@ -415,12 +477,59 @@ PacketStatus OrazioClient_get(struct OrazioClient* cl, PacketHeader* dest){
   return Success;
 }
 
-void OrazioClient_setBaseVelocity(struct OrazioClient* cl, float tv, float rv){
+// takes note of when a command came in relative to the epochs
+static void _stampCommand(OrazioClient* cl, uint64_t stamp_us){
+  if (cl->last_epoch_us && stamp_us>=cl->last_epoch_us)
+    latency_stats_add(&cl->command_phase, (int64_t)(stamp_us-cl->last_epoch_us));
+  // a command replaced before being sent counts from the older one
+  if (! cl->command_stamp_us)
+    cl->command_stamp_us=stamp_us;
+}
+
+void OrazioClient_setBaseVelocityAt(struct OrazioClient* cl, float tv, float rv, uint64_t stamp_us){
   pthread_mutex_lock(&cl->write_mutex);
   cl->drive_control_packet.translational_velocity=tv;
   cl->drive_control_packet.rotational_velocity=rv;
   cl->drive_control_packet.header.seq=1;
+  _stampCommand(cl, stamp_us);
+  pthread_mutex_unlock(&cl->write_mutex);
+}
+
+void OrazioClient_setBaseVelocity(struct OrazioClient* cl, float tv, float rv){
+  OrazioClient_setBaseVelocityAt(cl, tv, rv, _now_us());
+}
+
+PacketStatus OrazioClient_setJointControl(struct OrazioClient* cl, int index, const JointControl* control){
+  if (index<0||index>=NUM_JOINTS_MAX)
+    return GenericError;
+  pthread_mutex_lock(&cl->write_mutex);
+  JointControlPacket* p=&cl->joint_control[index];
+  p->header.header.type=JOINT_CONTROL_PACKET_ID;
+  p->header.header.size=sizeof(JointControlPacket);
+  p->header.index=index;
+  p->control=*control;
+  cl->joint_control_pending[index]=1;
+  _stampCommand(cl, _now_us());
+  pthread_mutex_unlock(&cl->write_mutex);
+  return Success;
+}
+
+void OrazioClient_setEpochCallback(struct OrazioClient* cl, OrazioClientEpochFn fn, void* args){
+  pthread_mutex_lock(&cl->write_mutex);
+  cl->epoch_fn=fn;
+  cl->epoch_args=args;
+  pthread_mutex_unlock(&cl->write_mutex);
+}
+
+int OrazioClient_printEpochStats(struct OrazioClient* cl, char* buf, int size){
+  char phase[128], actuation[128];
+  pthread_mutex_lock(&cl->write_mutex);
+  float period=cl->epoch_period_us;
+  latency_stats_format(&cl->command_phase, phase, sizeof(phase));
+  latency_stats_format(&cl->actuation, actuation, sizeof(actuation));
   pthread_mutex_unlock(&cl->write_mutex);
+  return snprintf(buf, size, "epoch %.0fus, command phase %s, actuation %s",
+                  period, phase, actuation);
 }
 
 void OrazioClient_getOdometryPosition(struct OrazioClient* cl, float* x, float* y, float* theta){
@@ -8,6 +8,10 @@ extern "C" {
 
   struct OrazioClient;
 
+  // called by OrazioClient_sync right after each EndEpochPacket,
+  // just before the pending controls are sent
+  typedef void (*OrazioClientEpochFn)(struct OrazioClient* cl, void* args);
+
   // creates a new orazio client, opening a serial connection on device at the selected baudrate
   struct OrazioClient* OrazioClient_init(const char* device, uint32_t baudrate);
 
@@ -42,7 +46,21 @@ extern "C" {
   PacketStatus OrazioClient_readConfiguration(struct OrazioClient* cl, int timeout);
 
   // sugar for differentual drive control
-  PacketStatus OrazioClient_setBaseVelocities(struct OrazioClient* cl, float tv, float rv);
+  // the command is sent right after each EndEpochPacket until it is changed
+  void OrazioClient_setBaseVelocity(struct OrazioClient* cl, float tv, float rv);
+
+  // same, stamp_us (CLOCK_MONOTONIC) is when the command was issued, for the statistics
+  void OrazioClient_setBaseVelocityAt(struct OrazioClient* cl, float tv, float rv, uint64_t stamp_us);
+
+  // the joint control is sent once, right after the next EndEpochPacket
+  PacketStatus OrazioClient_setJointControl(struct OrazioClient* cl, int index, const JointControl* control);
+
+  // installs the function called at each epoch (0 to remove it)
+  void OrazioClient_setEpochCallback(struct OrazioClient* cl, OrazioClientEpochFn fn, void* args);
+
+  // epoch period, phase of the commands after the epoch and
+  // latency from a command to the epoch applying it
+  int OrazioClient_printEpochStats(struct OrazioClient* cl, char* buf, int size);
 
   PacketStatus OrazioClient_getBasePosition(struct OrazioClient* cl, float*x, float*y, float*theta);
 
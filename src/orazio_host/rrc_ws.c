@@ -1,9 +1,24 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <libwebsockets.h>
 #include "orazio_client.h"
 #include "capture_camera_mod.h"
+#include "rate_control.h"
+#include "latency_stats.h"
+#include "motion_gate.h"
+#include "command_mailbox.h"
+#include "rrc_protocol.h"
+#include "rrc_ws.h"
 
 #define MAX_CONNECTIONS 1024
 #define TV_AXIS 1
@@ -13,20 +28,103 @@
 #define BOOST_BUTTON 4
 #define HALT_BUTTON 5
 
-#define WIDTH 320
-#define HEIGHT 240
+#define CAM_FRAGMENT_SIZE 4096 // frames are written in websocket fragments of this size
+#define ENCODE_ATTEMPTS 4      // re-encodes of a frame that does not fit its buffer
+#define ENCODED_BUDGET_FACTOR 8 // an encoded frame buffer holds this many rate control targets,
+#define ENCODED_MIN_DIVISOR 8   // and at least this fraction of the rgb image of its layer
+#define ENCODED_POOL_SPARE 8    // buffers past the ones the viewers can hold
+#define STATS_PERIOD_US 1000000
+#define CONTROL_SOCKET_BUFFER 4096 // a command is a few bytes, nothing should queue up
+#define STALE_COMMAND_US 250000    // commands this late compared to the fastest ones are dropped
+#define DELAY_BASELINE_SHIFT 12    // how slowly the delay baseline follows the clock drift
+#define CAMERA_LINGER_US 2000000   // the camera streams this long after the last viewer left
+#define MAX_SERVICE_THREADS 16     // lws service threads of the video plane
+#define THREAD_POOL_BUFFERS 32     // frame copies a service thread can hold, with several of them
+#define ENCODE_COST_SHIFT 4        // how slowly the average cost of encoding a capture moves
+#define KEYFRAME_MIN_INTERVAL_US 500000  // keyframes asked by the viewers come at most this often
 
-typedef struct JoyPacket{
-  int axis;
-  int value;
-  int type;
-}JoyPacket;
+#if LWS_PRE + RRC_FRAME_HEADER_SIZE > CAMERA_FRAME_HEADROOM
+#error "encoded frames need LWS_PRE bytes and the frame header in front of them in the pool buffers"
+#endif
+
+/* what a session watches: a codec, in color or luma only, at the
+   resolution of one of the simulcast layers. A stream is encoded only
+   while somebody watches it */
+
+typedef enum {
+  StreamColor = 0,
+  StreamGray = 1,       /* luma only, single component jpegs */
+  StreamVp8 = 2,        /* inter-frame, when built with RRC_WITH_VPX */
+  StreamVp8Gray = 3,    /* constant chroma */
+  StreamKinds
+} stream_kind_t;
+
+/* the streams go by layer, then by kind */
+enum { StreamCount = StreamKinds * RRC_LAYER_COUNT };
+
+static const char* kind_names[StreamKinds] = { "color", "gray", "vp8", "vp8 gray" };
+static const char* layer_names[RRC_LAYER_COUNT] = { "full", "half", "quarter" };
+static char stream_names[StreamCount][32];  /* "vp8 gray half", for the logs */
+
+static int stream_of(video_codec_t codec, int gray, int layer){
+  return layer * StreamKinds + codec * 2 + (gray ? 1 : 0);
+}
+
+static stream_kind_t stream_kind(int stream){
+  return (stream_kind_t)(stream % StreamKinds);
+}
+
+static video_codec_t stream_codec(int stream){
+  return (video_codec_t)(stream_kind(stream) / 2);
+}
+
+static int stream_gray(int stream){
+  return stream_kind(stream) & 1;
+}
+
+static int stream_layer(int stream){
+  return stream / StreamKinds;
+}
+
+static void init_stream_names(void){
+  for (int s = 0; s < StreamCount; ++s)
+    snprintf(stream_names[s], sizeof(stream_names[s]), "%s %s",
+	     kind_names[stream_kind(s)], layer_names[stream_layer(s)]);
+}
 
 /* one of these created for each message */
 
 struct msg {
-  void *payload; /* is malloc'd */
+  frame_buffer_t *frame; /* from the pool of its layer, LWS_PRE headroom, the frame header, the jpeg */
+  size_t len;            /* header and jpeg */
+  uint32_t seq;          /* increases with each published frame */
+  uint64_t published_us;
+  uint8_t tables;        /* quality of the jpeg tables left out, 0 if the jpeg has them */
+  char keyframe;         /* decodes without the frames before it, always for jpeg */
+};
+
+/* a captured yuyv image waiting to be encoded */
+
+struct raw_frame {
+  frame_buffer_t *frame;
   size_t len;
+  uint32_t width;
+  uint32_t height;
+  uint64_t capture_us;
+};
+
+/* a capture at the resolution of a layer: the full layer is the capture
+   itself, each of the others is halved from the one above. Made once per
+   capture, for all the streams of the layer, by the encoder thread */
+
+struct layer_image {
+  const uint8_t *yuyv;
+  uint32_t width;
+  uint32_t height;
+  uint64_t capture_us;
+  char ready;            /* holds the capture being encoded */
+  uint8_t *buffer;       /* pixels of the scaled layers */
+  size_t capacity;
 };
 
 /* one of these is created for each client connecting to us */
@@ -34,7 +132,64 @@ struct msg {
 struct per_session_data__minimal {
   struct per_session_data__minimal *pss_list;
   struct lws *wsi;
-  uint32_t tail;
+
+  struct msg current;    /* frame being sent, holds a reference */
+  size_t offset;         /* bytes of current already written */
+  uint32_t last_seq;     /* seq of the last frame taken */
+  int stream;            /* stream_of(codec, gray, layer) */
+  char need_keyframe;    /* the client lost the chain of an inter-frame stream */
+
+  /* stats since last_report */
+  uint32_t sent;
+  uint32_t dropped;      /* frames published while we were busy, skipped */
+  uint32_t max_depth;    /* most frames we were behind the newest one */
+  uint64_t last_report;
+  latency_stats_t enqueue_wait;  /* publish to the start of the write */
+  uint64_t established_us;       /* 0 once the first frame went out */
+
+  /* clock offset handshake, answered between frames */
+  rrc_clock_t clock;
+  char clock_pending;
+  unsigned char clock_buf[LWS_PRE + RRC_CLOCK_PONG_SIZE];
+
+  /* camera state, sent on connection and after each mode change */
+  char state_pending;
+  unsigned char state_buf[LWS_PRE + RRC_CAMERA_MODE_SIZE];
+
+  /* jpeg tables of the abbreviated frames, by quality. The client keeps
+     them all, so each goes out once, before the first frame needing it */
+  char tables_sent[RRC_MAX_JPEG_QUALITY + 1];
+  unsigned char tables_buf[LWS_PRE + RRC_JPEG_TABLES_MAX_SIZE];
+
+  /* exec_commands only */
+  uint32_t command_seq;    /* last accepted */
+  int64_t delay_baseline;  /* smallest receive - client stamp, one way delay + clock offset */
+  char has_baseline;
+  rrc_echo_t echo;         /* for the last message received */
+  uint64_t echo_rx_us;     /* when that message came in */
+  char echo_pending;
+  uint32_t accepted;
+  uint32_t out_of_order;
+  uint32_t stale;
+  unsigned char echo_buf[LWS_PRE + RRC_ECHO_SIZE];
+};
+
+/*
+  what a service thread of the video plane keeps for itself. lws calls
+  back a connection on one thread only, the sessions touch nothing of
+  the other threads: frames and camera changes reach them through
+  lws_cancel_service, as LWS_CALLBACK_EVENT_WAIT_CANCELLED
+*/
+
+struct service_thread {
+  struct per_session_data__minimal *pss_list;
+  /* the sessions write ws headers and enqueue stamps into the frame they
+     send. With several threads each one sends its own copy of the latest,
+     the first one too, so those writes never meet a reader elsewhere */
+  struct msg latest[StreamCount];
+  frame_pool_t *pool;              /* of the copies, as big as the camera buffers */
+  int queue_depth[StreamCount];    /* frames behind of the best client of the stream, -1 if none */
+  uint32_t state_version;          /* camera state the sessions were told about */
 };
 
 /* one of these is created for each vhost our protocol is used with */
@@ -44,30 +199,77 @@ struct per_vhost_data__minimal {
   struct lws_vhost *vhost;
   const struct lws_protocols *protocol;
 
-  struct per_session_data__minimal *pss_list; /* linked-list of live pss*/
+  struct per_session_data__minimal *pss_list; /* linked-list of live pss, control plane */
   pthread_t pthread_spam;
 
-  pthread_mutex_t lock_ring;
-  struct lws_ring *ring;
+  /* cam_protocol sessions, by the service thread lws gave them to */
+  struct service_thread threads[MAX_SERVICE_THREADS];
+  int sessions;                    /* of all the threads */
+  uint32_t state_version;          /* bumped by each camera mode change */
+
+  /* latest frame wins: every session picks the newest frame when it is
+     done with the previous one, so a slow client skips frames instead of
+     holding them back for the others */
+  pthread_mutex_t lock_frame;
+  struct msg latest[StreamCount];  /* hold a reference */
+  uint64_t sleep_us;               /* the camera stopped, captures before are never published */
+  int viewers[StreamCount];        /* sessions on each stream, written by the service thread */
+  int gate_reset;                  /* a viewer needs a frame now, the encoder lets the next one through */
+  int keyframe_request[StreamCount]; /* a viewer needs a keyframe, the encoder forces one */
+
+  /* the service thread captures when the camera fd is readable and hands
+     the image to the encoder thread, which signals frames_fd when it has
+     published the jpeg. The newest capture replaces one not taken yet */
+  pthread_mutex_t lock_capture;
+  pthread_cond_t capture_cond;
+  struct raw_frame captured;
+  int frames_fd;
 
   char finished;
 };
 
-typedef struct{
+typedef struct OrazioWSContext{
   struct per_vhost_data__minimal* connections[MAX_CONNECTIONS];
+  pthread_mutex_t connections_lock; // both service threads register connections
   pthread_t thread;
+  pthread_t control_thread;
   volatile int run;
-  int rate;
   int port;
+  int control_port;
   char* cam;
-  DifferentialDriveControlPacket* drive_control;
+  command_mailbox_t* commands;  // written only by callback_rcv_comm
   camera_t* camera;
+  struct lws_context *context;          /* video plane */
+  struct lws_context *control_context;  /* control plane, own thread and port */
+  struct per_vhost_data__minimal *cam_vhd;
+  int service_threads;      /* of the video plane, the first one runs in thread */
+  pthread_t service_thread[MAX_SERVICE_THREADS];
+  /* the camera, between the service threads */
+  pthread_mutex_t camera_lock;
+  struct lws *camera_wsi;   /* camera fd adopted in the service loop, NULL when stopped */
+  int camera_tsi;           /* service thread of camera_wsi, -1 until its first capture */
+  char camera_wake_pending; /* a viewer came on another thread, the first one adopts */
+  char camera_stop_pending; /* the camera stopped, the thread of camera_wsi drops it */
+  uint64_t resume_us;       /* camera restarted, 0 once its first frame is captured */
+  uint64_t idle_since_us;   /* capturing with no viewers since, 0 while watched */
+  rrc_camera_mode_t camera_state;  /* current mode */
+  struct lws *frames_wsi;   /* encoder eventfd adopted in the service loop */
   struct OrazioClient *client;
+  OrazioWSParams params;
+  rate_control_t rate_control[StreamCount];  // only touched by thread_spam
+  motion_gate_t motion_gate;                 // only touched by thread_spam
+
+  latency_stats_t command_latency;  // only touched by the control loop
+  uint64_t last_command_report;
 } OrazioWSContext;
 
 static OrazioWSContext* ws_ctx = 0;
 float gain = 1.0;
 
+/* video plane thread running the callback, set by each service loop.
+   0 on the first one and outside the loops */
+static __thread int service_tsi = 0;
+
 int findConnection(OrazioWSContext *ctx, struct per_vhost_data__minimal* conn){
   for (int i = 0; i < MAX_CONNECTIONS; ++i)
     if (ctx->connections[i] == conn)
@@ -83,92 +285,391 @@ int getFreeConnectionIdx(OrazioWSContext *ctx){
   return -1;
 }
 
+int addConnection(OrazioWSContext *ctx, struct per_vhost_data__minimal* conn){
+  pthread_mutex_lock(&ctx->connections_lock);
+  int idx = getFreeConnectionIdx(ctx);
+  if (idx >= 0)
+    ctx->connections[idx] = conn;
+  pthread_mutex_unlock(&ctx->connections_lock);
+  return idx;
+}
+
 int freeConnection(OrazioWSContext *ctx, struct per_vhost_data__minimal* conn){
+  pthread_mutex_lock(&ctx->connections_lock);
   int idx = findConnection(ctx, conn);
-  if (idx < 0)
-    return -1;
-  ctx->connections[idx] = 0;
-  return 0;
+  if (idx >= 0)
+    ctx->connections[idx] = 0;
+  pthread_mutex_unlock(&ctx->connections_lock);
+  return idx < 0 ? -1 : 0;
 }
 
 void initConnections(OrazioWSContext* ctx){
   memset(ctx->connections, 0, sizeof(struct per_vhost_data__minimal*) * MAX_CONNECTIONS);
 }
 
+static uint64_t now_us(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 static void
 __minimal_destroy_message(void *_msg)
 {
   struct msg *msg = _msg;
   
-  free(msg->payload);
-  msg->payload = NULL;
+  if (msg->frame)
+    frame_buffer_unref(msg->frame);
+  msg->frame = NULL;
   msg->len = 0;
 }
 
+static void
+release_raw_frame(struct raw_frame *raw)
+{
+  if (raw->frame)
+    frame_buffer_unref(raw->frame);
+  raw->frame = NULL;
+  raw->len = 0;
+}
+
+/* the image of a layer for the capture, halving the layers above as needed */
+static const struct layer_image *get_layer(struct layer_image *layers, const struct raw_frame *raw,
+					   int layer){
+  struct layer_image *image = layers + layer;
+  if(image->ready)
+    return image;
+  if(!layer){
+    image->yuyv = raw->frame->data;
+    image->width = raw->width;
+    image->height = raw->height;
+  }
+  else{
+    const struct layer_image *above = get_layer(layers, raw, layer - 1);
+    image->width = above->width / 4 * 2;
+    image->height = above->height / 2;
+    size_t size = (size_t)image->width * image->height * 2;
+    if(size > image->capacity){
+      free(image->buffer);
+      image->buffer = malloc(size);
+      image->capacity = size;
+    }
+    yuyv_half_into(above->yuyv, image->buffer, above->width, above->height);
+    image->yuyv = image->buffer;
+  }
+  image->capture_us = raw->capture_us;
+  image->ready = 1;
+  return image;
+}
+
+/*
+  encodes a layer image into dest. A jpeg that does not fit the buffer is
+  encoded again with a lower quality (or resolution) rather than dropped,
+  an inter-frame encoder has already moved on. 0 if it never fits
+*/
+static size_t encode_frame(const struct layer_image *image, video_encoder_t *encoder, rate_control_t *rc,
+			   uint8_t *dest, size_t capacity){
+  size_t size = 0;
+  for(int attempt = 0; attempt < ENCODE_ATTEMPTS; ++attempt){
+    video_encoder_set_quality(encoder, rc->quality, rc->scale);
+    size = video_encoder_encode(encoder, image->yuyv, image->width, image->height,
+				image->capture_us, dest, capacity);
+    if(size || encoder->backend->inter)
+      break;
+    rate_control_overflow(rc);
+  }
+  return size;
+}
+
+/* encoder thread state of a stream */
+struct stream_encoder {
+  video_encoder_t *encoder;  /* created when the stream gets its first viewer */
+  uint32_t seq;
+  uint64_t keyframe_us;      /* capture time of the last keyframe */
+  uint32_t keyframes;        /* since the last report */
+  latency_stats_t encode_time;
+};
+
+/*
+  a buffer for an encoded frame of a layer. The pool of the layer holds
+  the latest frame of each of its streams, the one being encoded and one
+  pinned by each viewer, in buffers sized to the rate control target
+  rather than to the capture. A bigger pool replaces it when viewers join
+  or the target grows, the old one lives until its frames are released
+*/
+static frame_buffer_t *encoded_frame(struct per_vhost_data__minimal *vhd, frame_pool_t **pool,
+				     const struct raw_frame *raw, const struct layer_image *image,
+				     int layer, const rate_control_t *rc){
+  size_t rgb = (size_t)image->width * image->height * 3;
+  size_t payload = ENCODED_BUDGET_FACTOR * rate_control_target(rc);
+  if(payload < rgb / ENCODED_MIN_DIVISOR)
+    payload = rgb / ENCODED_MIN_DIVISOR;
+  if(payload > rgb)
+    payload = rgb;
+  size_t size = payload + CAMERA_FRAME_HEADROOM;
+  size_t count = StreamKinds + 1;
+  for(int s = 0; s < StreamCount; ++s)
+    if(stream_layer(s) == layer)
+      count += __atomic_load_n(&vhd->viewers[s], __ATOMIC_RELAXED);
+  if(*pool && ((*pool)->buffer_size < size || (*pool)->count < count)){
+    frame_pool_retire(*pool);
+    *pool = NULL;
+  }
+  /* room for the target to move before the next replacement */
+  if(!*pool && !(*pool = frame_pool_create(size + size / 2, count + ENCODED_POOL_SPARE,
+					   raw->frame->pool->flags)))
+    return NULL;
+  return frame_pool_get(*pool);
+}
+
+/* frames the best client of a stream is behind, over all the service threads */
+static int stream_queue_depth(struct per_vhost_data__minimal *vhd, int stream){
+  int depth = -1;
+  for(int t = 0; t < ws_ctx->service_threads; ++t){
+    int d = __atomic_load_n(&vhd->threads[t].queue_depth[stream], __ATOMIC_RELAXED);
+    if(d >= 0 && (depth < 0 || d < depth))
+      depth = d;
+  }
+  return depth < 0 ? 0 : depth;
+}
+
+/* encodes the capture for a stream and makes it the latest frame of that stream */
+static void publish_stream(struct per_vhost_data__minimal *vhd, const struct raw_frame *raw,
+			   const struct layer_image *image, frame_pool_t **pool, int stream,
+			   rate_control_t *rc, struct stream_encoder *enc){
+  frame_buffer_t* encoded = encoded_frame(vhd, pool, raw, image, stream_layer(stream), rc);
+  if(!encoded){
+    lwsl_user("[Thread_spam] Frame pool exhausted\n");
+    return;
+  }
+  video_encoder_t* encoder = enc->encoder;
+  rrc_frame_header_t header = {
+    .codec = encoder->codec,
+    .capture_us = raw->capture_us,
+    .encode_start_us = now_us()
+  };
+  size_t capacity = encoded->capacity-LWS_PRE-RRC_FRAME_HEADER_SIZE;
+  video_encoder_set_bitrate(encoder, rate_control_bitrate(rc));
+  size_t size = encode_frame(image, encoder, rc, encoded->data+LWS_PRE+RRC_FRAME_HEADER_SIZE, capacity);
+  if(!size){
+    lwsl_user("[Thread_spam] %s frame does not fit in %zu bytes\n", stream_names[stream], capacity);
+    frame_buffer_unref(encoded);
+    return;
+  }
+  header.encode_end_us = now_us();
+  header.seq = ++enc->seq;
+  header.keyframe = encoder->keyframe;
+  if(encoder->keyframe && encoder->backend->inter){
+    enc->keyframe_us = raw->capture_us;
+    ++enc->keyframes;
+  }
+  /* the quality the frame was encoded with, before the rate control moves it */
+  if(encoder->codec == VideoCodecJpeg && (jpeg_options() & JPEG_ABBREVIATED))
+    header.tables = rc->quality;
+  /* the enqueue stamp is set by each session when it starts sending */
+  rrc_frame_header_encode(encoded->data+LWS_PRE, &header);
+  latency_stats_add(&enc->encode_time, (int64_t)(header.encode_end_us - header.encode_start_us));
+  encoded->length = LWS_PRE+RRC_FRAME_HEADER_SIZE+size;
+  struct msg amsg = {
+    .frame = encoded,
+    .len = RRC_FRAME_HEADER_SIZE+size,
+    .seq = header.seq,
+    .published_us = header.encode_end_us,
+    .tables = header.tables,
+    .keyframe = header.keyframe
+  };
+  pthread_mutex_lock(&vhd->lock_frame);
+  struct msg stale = vhd->latest[stream];
+  /* the camera stopped while this capture was encoded: it is dropped */
+  if(header.capture_us <= vhd->sleep_us)
+    stale = amsg;
+  else
+    vhd->latest[stream] = amsg;
+  pthread_mutex_unlock(&vhd->lock_frame);
+  /* sessions still sending the stale frame keep their own reference */
+  __minimal_destroy_message(&stale);
+  rate_control_update(rc, size, stream_queue_depth(vhd, stream), header.encode_end_us);
+}
+
+/* encoder thread: sleeps until the service thread hands over a capture,
+   then encodes it for each stream somebody watches */
 void* thread_spam(void* args){
   struct per_vhost_data__minimal *vhd = (struct per_vhost_data__minimal *) args;
   OrazioWSContext* ctx = ws_ctx;
-  struct msg amsg;
-  int n;
+  struct stream_encoder streams[StreamCount];
+  struct layer_image layers[RRC_LAYER_COUNT];
+  frame_pool_t *pools[RRC_LAYER_COUNT];  /* of the encoded frames, by layer */
+  struct raw_frame raw;
+  uint64_t one = 1;
+  uint64_t last_report = now_us();
+  latency_stats_t capture_wait;  /* capture to encode start */
+  motion_gate_t* gate = &ctx->motion_gate;
+  uint64_t encode_cost = 0;      /* average us to encode a capture for all the streams */
+  uint64_t saved_us = 0;         /* encode_cost of each frame skipped */
+  char stats[128];
+  latency_stats_init(&capture_wait);
+  memset(streams, 0, sizeof(streams));
+  memset(layers, 0, sizeof(layers));
+  memset(pools, 0, sizeof(pools));
+  for(int s = 0; s < StreamCount; ++s)
+    latency_stats_init(&streams[s].encode_time);
   if(!ctx->camera)
     exit(1);
-  struct timeval timeout;
-  timeout.tv_sec = 1;
-  timeout.tv_usec = 0;
-  while(ctx->run){
-    if(!vhd->pss_list)
-      goto wait;
-    if(camera_frame(ctx->camera, timeout) > 0){
-      unsigned char *rgb = yuyv2rgb(ctx->camera->head.start, ctx->camera->width, ctx->camera->height);
-      FILE *out = fopen("result.jpg", "w+");
-      jpeg(out, rgb, ctx->camera->width, ctx->camera->height, 15);
-      size_t size;
-      fseek(out, 0, SEEK_END);
-      size = ftell(out);
-      fseek(out, 0, SEEK_SET);
-      
-      if(size <= 4096){
-	int len = LWS_PRE+size;
-	amsg.payload = malloc(len);
-	if(!amsg.payload){
-	  lwsl_user("[Thread_spam] Malloc error\n");
-	  goto wait_unlock;
-	}
-	int err = fread(amsg.payload+LWS_PRE, 1, size, out);
-	if (err != size){
-	  printf("[Thread_Spam] Error: There was Error %d reading the file\n", err);
-	  exit(1);
-	}
-	pthread_mutex_lock(&vhd->lock_ring);
-	n = (int)lws_ring_get_count_free_elements(vhd->ring);
-	if(!n) {
-	  lwsl_user("[Thread_spam] Ring is full\n");
-	  goto wait_unlock;
-	}
-	amsg.len = size+LWS_PRE;
-	n = lws_ring_insert(vhd->ring, &amsg, 1);
-	if(n!=1){
-	  __minimal_destroy_message(&amsg);
-	  lwsl_user("[Thread_spam] Cannot add elem to ring\n");
-	}
-	else {
-	  lws_cancel_service(vhd->context);
-	}
+  while(1){
+    pthread_mutex_lock(&vhd->lock_capture);
+    while(ctx->run && !vhd->finished && !vhd->captured.frame)
+      pthread_cond_wait(&vhd->capture_cond, &vhd->lock_capture);
+    raw = vhd->captured;
+    vhd->captured.frame = NULL;
+    pthread_mutex_unlock(&vhd->lock_capture);
+    if(!ctx->run || vhd->finished){
+      release_raw_frame(&raw);
+      break;
+    }
+    /* captured before the camera stopped */
+    if(raw.capture_us <= __atomic_load_n(&vhd->sleep_us, __ATOMIC_RELAXED)){
+      release_raw_frame(&raw);
+      continue;
+    }
+
+    uint64_t start = now_us();
+    latency_stats_add(&capture_wait, (int64_t)(start - raw.capture_us));
+    /* nothing moved since the last frame sent: the clients keep showing it */
+    if(__atomic_exchange_n(&vhd->gate_reset, 0, __ATOMIC_RELAXED))
+      motion_gate_reset(gate);
+    if(!motion_gate_check(gate, raw.frame->data, raw.width, raw.height, raw.capture_us)){
+      saved_us += encode_cost;
+      release_raw_frame(&raw);
+      continue;
+    }
+    int published = 0;
+    for(int l = 0; l < RRC_LAYER_COUNT; ++l)
+      layers[l].ready = 0;
+    for(int s = 0; s < StreamCount; ++s){
+      struct stream_encoder *enc = streams + s;
+      if(!__atomic_load_n(&vhd->viewers[s], __ATOMIC_RELAXED))
+	continue;
+      if(!enc->encoder && !(enc->encoder = video_encoder_create(stream_codec(s), stream_gray(s)))){
+	lwsl_err("[Thread_spam] cannot create the %s encoder\n", stream_names[s]);
+	continue;
       }
-      free(rgb);
-      fclose(out);
+      /* somebody joined or lost frames of an inter-frame stream */
+      if(raw.capture_us - enc->keyframe_us >= KEYFRAME_MIN_INTERVAL_US
+	 && __atomic_exchange_n(&vhd->keyframe_request[s], 0, __ATOMIC_RELAXED))
+	video_encoder_force_keyframe(enc->encoder);
+      publish_stream(vhd, &raw, get_layer(layers, &raw, stream_layer(s)), pools + stream_layer(s), s,
+		     ctx->rate_control + s, enc);
+      published = 1;
+    }
+    release_raw_frame(&raw);
+    if(published){
+      uint64_t cost = now_us() - start;
+      encode_cost = encode_cost ? encode_cost + ((int64_t)(cost - encode_cost) >> ENCODE_COST_SHIFT) : cost;
     }
-  wait_unlock:
-    pthread_mutex_unlock(&vhd->lock_ring);
-  wait:
-    usleep(100);
+    /* wakes the service loop, that schedules the writes. With several
+       loops, each one is woken for its own sessions */
+    if(published && ctx->service_threads > 1)
+      lws_cancel_service(vhd->context);
+    else if(published && write(vhd->frames_fd, &one, sizeof(one)) != sizeof(one))
+      lwsl_err("[Thread_spam] cannot signal the service loop\n");
+
+    uint64_t now = now_us();
+    if(now - last_report < STATS_PERIOD_US)
+      continue;
+    float seconds = (now - last_report) * 1e-6f;
+    latency_stats_format(&capture_wait, stats, sizeof(stats));
+    lwsl_user("[Thread_spam] capture to encode %s\n", stats);
+    for(int s = 0; s < StreamCount; ++s){
+      rate_control_t* rc = ctx->rate_control + s;
+      if(!rc->frames)
+	continue;
+      if(streams[s].encoder->backend->inter)
+	lwsl_user("[Thread_spam] %s: scale 1/%d, %.1f fps, %u bytes/frame, %.1f kbit/s (target %.1f), %u keyframes\n",
+		  stream_names[s], rc->scale, rc->frames / seconds,
+		  (unsigned)(rc->bytes / rc->frames), rc->bytes * 8e-3f / seconds,
+		  rate_control_bitrate(rc) * 1e-3f, streams[s].keyframes);
+      else
+	lwsl_user("[Thread_spam] %s: quality %d scale 1/%d, %.1f fps, %u bytes/frame (target %u), %.1f kbit/s, %u re-encoded\n",
+		  stream_names[s], rc->quality, rc->scale, rc->frames / seconds,
+		  (unsigned)(rc->bytes / rc->frames),
+		  (unsigned)rate_control_target(rc),
+		  rc->bytes * 8e-3f / seconds, rc->reencoded);
+      streams[s].keyframes = 0;
+      latency_stats_format(&streams[s].encode_time, stats, sizeof(stats));
+      lwsl_user("[Thread_spam] %s: encode %s\n", stream_names[s], stats);
+      rate_control_stats_reset(rc);
+    }
+    if(gate->skipped)
+      lwsl_user("[Thread_spam] motion gate: %u passed, %u skipped, largest change %d, check %.1fus/frame, ~%.1fms cpu saved\n",
+		gate->passed, gate->skipped, gate->last_change,
+		(float)gate->check_us / (gate->passed + gate->skipped), saved_us * 1e-3f);
+    motion_gate_stats_reset(gate);
+    saved_us = 0;
+    last_report = now;
   }
 
+  for(int s = 0; s < StreamCount; ++s)
+    if(streams[s].encoder)
+      video_encoder_destroy(streams[s].encoder);
+  for(int l = 0; l < RRC_LAYER_COUNT; ++l){
+    free(layers[l].buffer);
+    /* the latest frames keep them until the protocol is destroyed */
+    if(pools[l])
+      frame_pool_retire(pools[l]);
+  }
   lwsl_notice("[Thread_spam] %p exiting\n", (void *)pthread_self());
   pthread_exit(NULL);
   return NULL;
 }
 
+/* commands are tiny and must not wait behind anything: no Nagle, small buffers */
+static void setup_control_socket(struct lws *wsi){
+  int fd = lws_get_socket_fd(wsi);
+  int one = 1;
+  int size = CONTROL_SOCKET_BUFFER;
+  if (fd < 0)
+    return;
+  if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) ||
+      setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)) ||
+      setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)))
+    lwsl_warn("[motion_protocol] cannot set the socket options\n");
+}
+
+/*
+  a message is out of order if its seq is not newer than the last one
+  accepted, and stale if it took much longer than the fastest messages
+  of the connection. The clocks of client and host are not synchronized:
+  receive time - client stamp is the one way delay plus a constant offset,
+  its minimum is the baseline
+*/
+static rrc_status_t check_command(struct per_session_data__minimal *pss,
+				  const rrc_control_t *control, uint64_t rx_us){
+  int64_t delay = (int64_t)(rx_us - control->client_stamp_us);
+  if (pss->has_baseline && (int32_t)(control->seq - pss->command_seq) <= 0)
+    return RrcOutOfOrder;
+  if (!pss->has_baseline || delay < pss->delay_baseline) {
+    pss->delay_baseline = delay;
+    pss->has_baseline = 1;
+  }
+  if (delay - pss->delay_baseline > STALE_COMMAND_US)
+    return RrcStale;
+  /* follows the clock drift, slowly enough not to swallow the queueing */
+  pss->delay_baseline += (delay - pss->delay_baseline) >> DELAY_BASELINE_SHIFT;
+  pss->command_seq = control->seq;
+  return RrcAccepted;
+}
+
+static void report_commands(struct per_session_data__minimal *pss){
+  uint64_t now = now_us();
+  if (now - pss->last_report < STATS_PERIOD_US)
+    return;
+  if (pss->accepted || pss->out_of_order || pss->stale)
+    lwsl_user("[motion_protocol] client %p: %u accepted, %u out of order, %u stale\n",
+	      (void *)pss->wsi, pss->accepted, pss->out_of_order, pss->stale);
+  pss->accepted = pss->out_of_order = pss->stale = 0;
+  pss->last_report = now;
+}
+
 static int callback_rcv_comm(struct lws *wsi,
                          enum lws_callback_reasons reason, void *user,
                          void *in, size_t len){
@@ -176,8 +677,9 @@ static int callback_rcv_comm(struct lws *wsi,
   struct per_session_data__minimal *pss = (struct per_session_data__minimal *)user;
   struct per_vhost_data__minimal *vhd = (struct per_vhost_data__minimal *) lws_protocol_vh_priv_get(lws_get_vhost(wsi), lws_get_protocol(wsi));
   OrazioWSContext* ctx = ws_ctx;
-  JoyPacket* ic;
-  int idx = 0;
+  rrc_control_t control;
+  uint64_t rx_us;
+  int m;
     
   switch (reason){
         
@@ -193,9 +695,12 @@ static int callback_rcv_comm(struct lws *wsi,
   case LWS_CALLBACK_ESTABLISHED:
     lws_ll_fwd_insert(pss, pss_list, vhd->pss_list);
     pss->wsi = wsi;
-    idx = getFreeConnectionIdx(ctx);
-    if(idx >= 0)
-      ctx->connections[idx] = vhd;
+    pss->has_baseline = 0;
+    pss->echo_pending = 0;
+    pss->accepted = pss->out_of_order = pss->stale = 0;
+    pss->last_report = now_us();
+    addConnection(ctx, vhd);
+    setup_control_socket(wsi);
     printf("[motion_protocol] Connection established\n");           
     break;
         
@@ -205,34 +710,58 @@ static int callback_rcv_comm(struct lws *wsi,
     break;  
         
   case LWS_CALLBACK_RECEIVE:
-    ic = (JoyPacket*) in;
+    rx_us = command_now_us();
+    if (rrc_control_decode(&control, in, len)) {
+      lwsl_warn("[motion_protocol] malformed control message (%zu bytes)\n", len);
+      break;
+    }
+    rrc_status_t status = check_command(pss, &control, rx_us);
+    pss->echo.status = status;
+    pss->echo.seq = control.seq;
+    pss->echo.client_stamp_us = control.client_stamp_us;
+    pss->echo_rx_us = rx_us;
+    pss->echo_pending = 1;
+    lws_callback_on_writable(wsi);
+    if (status == RrcOutOfOrder) {
+      ++pss->out_of_order;
+      break;
+    }
+    if (status == RrcStale) {
+      ++pss->stale;
+      break;
+    }
+    ++pss->accepted;
+
     float tv = 0;
     float rv = 0;
     float tvscale = MAX_TV / 32767.0;
     float rvscale = MAX_RV / 32767.0;
-    int axis = ic->axis;
-    int value = ic->value;
-    int type = ic->type;
-    if (axis==TV_AXIS && type==2){
-      tv = -value*tvscale;
-    }
-    if (axis==RV_AXIS && type==2){
-      rv = -value*rvscale;
-    }
-    if(axis==HALT_BUTTON && type==1){
+    if (control.num_axes > TV_AXIS)
+      tv = -control.axes[TV_AXIS]*tvscale;
+    if (control.num_axes > RV_AXIS)
+      rv = -control.axes[RV_AXIS]*rvscale;
+    if (control.buttons & (1u << HALT_BUTTON)) {
       tv = 0;
       rv = 0;
     }
-    else if (axis==BOOST_BUTTON && type==1){
-      if(value)
-	gain = 2.0;
-      else
-	gain = 1.0;
+    gain = (control.buttons & (1u << BOOST_BUTTON)) ? 2.0 : 1.0;
+    command_mailbox_post(ctx->commands, tv, rv, rx_us);
+    break;
+
+  case LWS_CALLBACK_SERVER_WRITEABLE:
+    /* echoes the last message only, the client cares about the newest round trip */
+    if (!pss->echo_pending)
+      break;
+    pss->echo.host_delay_us = command_now_us() - pss->echo_rx_us;
+    rrc_echo_encode(pss->echo_buf + LWS_PRE, &pss->echo);
+    pss->echo_pending = 0;
+    m = lws_write(wsi, pss->echo_buf + LWS_PRE, RRC_ECHO_SIZE, LWS_WRITE_BINARY);
+    if (m < RRC_ECHO_SIZE) {
+      lwsl_err("[motion_protocol] ERROR %d writing to ws socket\n", m);
+      return -1;
     }
-    ws_ctx->drive_control->header.seq = 1;
-    ws_ctx->drive_control->translational_velocity = tv;
-    ws_ctx->drive_control->rotational_velocity = rv;
-    break;       
+    report_commands(pss);
+    break;
         
   default:
     break;
@@ -243,16 +772,311 @@ static int callback_rcv_comm(struct lws *wsi,
 
 int num_frame = 0;
 
+/* a buffer of the pool of the thread for a copy of size bytes, the pool
+   follows the size of the camera buffers */
+static frame_buffer_t *thread_frame(struct service_thread *thread, size_t size){
+  if (thread->pool && thread->pool->buffer_size < size) {
+    frame_pool_retire(thread->pool);
+    thread->pool = NULL;
+  }
+  if (!thread->pool && !(thread->pool = frame_pool_create(size, THREAD_POOL_BUFFERS, 0)))
+    return NULL;
+  return frame_pool_get(thread->pool);
+}
+
+/* the copy of the newest frame of a stream of this thread, refreshed if
+   the encoder published another one. The published frame is only read */
+static struct msg *thread_latest(struct per_vhost_data__minimal *vhd, int stream){
+  struct msg *copy = &vhd->threads[service_tsi].latest[stream];
+  struct msg shared = {0};
+  int present;
+  pthread_mutex_lock(&vhd->lock_frame);
+  present = vhd->latest[stream].frame != NULL;
+  if (present && vhd->latest[stream].seq != copy->seq) {
+    shared = vhd->latest[stream];
+    frame_buffer_ref(shared.frame);
+  }
+  pthread_mutex_unlock(&vhd->lock_frame);
+  /* the camera stopped, new viewers wait for a fresh frame */
+  if (!present)
+    __minimal_destroy_message(copy);
+  if (!shared.frame)
+    return copy;
+  frame_buffer_t *frame = thread_frame(&vhd->threads[service_tsi], shared.frame->capacity);
+  if (frame) {
+    memcpy(frame->data, shared.frame->data, shared.frame->length);
+    frame->length = shared.frame->length;
+    __minimal_destroy_message(copy);
+    *copy = shared;
+    copy->frame = frame;
+  }
+  else
+    lwsl_user("[Cam_service] thread %d: frame pool exhausted\n", service_tsi);
+  frame_buffer_unref(shared.frame);
+  return copy;
+}
+
+/* takes a reference to the newest frame if the session has not seen it yet */
+static int take_latest_frame(struct per_vhost_data__minimal *vhd,
+			     struct per_session_data__minimal *pss){
+  int taken = 0;
+  struct msg *latest = ws_ctx->service_threads > 1 ? thread_latest(vhd, pss->stream)
+    : &vhd->latest[pss->stream];
+  pthread_mutex_lock(&vhd->lock_frame); /* --------- frame lock { */
+  if (latest->frame && latest->seq != pss->last_seq) {
+    uint32_t missed = pss->last_seq ? latest->seq - pss->last_seq - 1 : 0;
+    /* past a gap the client could not decode an inter frame */
+    if (missed)
+      pss->need_keyframe = 1;
+    pss->dropped += missed;
+    pss->last_seq = latest->seq;
+    if (pss->need_keyframe && !latest->keyframe) {
+      ++pss->dropped;
+      __atomic_store_n(&vhd->keyframe_request[pss->stream], 1, __ATOMIC_RELAXED);
+      __atomic_store_n(&vhd->gate_reset, 1, __ATOMIC_RELAXED);
+    }
+    else {
+      pss->current = *latest;
+      frame_buffer_ref(pss->current.frame);
+      pss->need_keyframe = 0;
+      taken = 1;
+    }
+  }
+  pthread_mutex_unlock(&vhd->lock_frame); /* } frame lock ------- */
+  return taken;
+}
+
+static void report_session(struct per_session_data__minimal *pss){
+  uint64_t now = now_us();
+  if (now - pss->last_report < STATS_PERIOD_US)
+    return;
+  char stats[128];
+  latency_stats_format(&pss->enqueue_wait, stats, sizeof(stats));
+  lwsl_user("[Cam_service] client %p: %u sent, %u dropped, max queue depth %u, publish to send %s\n",
+	    (void *)pss->wsi, pss->sent, pss->dropped, pss->max_depth, stats);
+  pss->sent = 0;
+  pss->dropped = 0;
+  pss->max_depth = 0;
+  pss->last_report = now;
+}
+
+/*
+  a frame was published: schedules a writable callback for all the
+  clients of this service thread, and takes note of how far behind they are
+*/
+static void notify_sessions(struct per_vhost_data__minimal *vhd){
+  struct service_thread *thread = &vhd->threads[service_tsi];
+  uint32_t latest_seq[StreamCount], depth;
+  int min_depth[StreamCount];
+  pthread_mutex_lock(&vhd->lock_frame);
+  for (int s = 0; s < StreamCount; ++s) {
+    latest_seq[s] = vhd->latest[s].seq;
+    min_depth[s] = -1;
+  }
+  pthread_mutex_unlock(&vhd->lock_frame);
+  lws_start_foreach_llp(struct per_session_data__minimal **,
+			ppss, thread->pss_list) {
+    int s = (*ppss)->stream;
+    depth = latest_seq[s] - (*ppss)->last_seq;
+    if (depth > (*ppss)->max_depth)
+      (*ppss)->max_depth = depth;
+    if (min_depth[s] < 0 || (int)depth < min_depth[s])
+      min_depth[s] = depth;
+    lws_callback_on_writable((*ppss)->wsi);
+  } lws_end_foreach_llp(ppss, pss_list);
+  for (int s = 0; s < StreamCount; ++s)
+    __atomic_store_n(&thread->queue_depth[s], min_depth[s], __ATOMIC_RELAXED);
+}
+
+/* the camera mode changed: the sessions of this thread get the new state */
+static void sync_camera_state(struct per_vhost_data__minimal *vhd){
+  struct service_thread *thread = &vhd->threads[service_tsi];
+  uint32_t version = __atomic_load_n(&vhd->state_version, __ATOMIC_RELAXED);
+  if (thread->state_version == version)
+    return;
+  thread->state_version = version;
+  lws_start_foreach_llp(struct per_session_data__minimal **,
+			ppss, thread->pss_list) {
+    (*ppss)->state_pending = 1;
+    lws_callback_on_writable((*ppss)->wsi);
+  } lws_end_foreach_llp(ppss, pss_list);
+}
+
+/* moves a session to another stream, the frame being sent is finished first */
+static void set_session_stream(struct per_vhost_data__minimal *vhd,
+			       struct per_session_data__minimal *pss, int stream){
+  if (stream == pss->stream)
+    return;
+  __atomic_sub_fetch(&vhd->viewers[pss->stream], 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&vhd->viewers[stream], 1, __ATOMIC_RELAXED);
+  pss->stream = stream;
+  __atomic_store_n(&vhd->gate_reset, 1, __ATOMIC_RELAXED);
+  /* the seqs of the streams are unrelated */
+  pss->last_seq = 0;
+  pss->need_keyframe = 1;
+  lwsl_user("[Cam_service] client %p: %s stream\n", (void *)pss->wsi, stream_names[stream]);
+  lws_callback_on_writable(pss->wsi);
+}
+
+/*
+  the camera streams only while somebody watches. Stopped, the buffers and
+  the format are kept, so that restarting is a QBUF of each buffer and a
+  STREAMON. A stopped V4L2 fd polls with an error, so it leaves the loop
+  and a new duplicate is adopted when it restarts.
+  lws only lets a thread touch its own connections: the camera is adopted
+  by the first service thread, the others ask it through lws_cancel_service.
+  It is stopped by the thread of its descriptor, when it captured for
+  nobody for CAMERA_LINGER_US or a mode switch left it stopped.
+  The camera and its state are under camera_lock
+*/
+static void camera_wake(OrazioWSContext* ctx, struct per_vhost_data__minimal *vhd){
+  pthread_mutex_lock(&ctx->camera_lock);
+  ctx->idle_since_us = 0;
+  /* still streaming, the last viewer left a moment ago */
+  if (ctx->camera_wsi) {
+    pthread_mutex_unlock(&ctx->camera_lock);
+    return;
+  }
+  if (service_tsi) {
+    ctx->camera_wake_pending = 1;
+    pthread_mutex_unlock(&ctx->camera_lock);
+    lws_cancel_service(vhd->context);
+    return;
+  }
+  ctx->camera_wake_pending = 0;
+  uint64_t start = now_us();
+  if (camera_set_streaming(ctx->camera, 1)) {
+    lwsl_err("[Cam_capture] cannot restart the camera\n");
+    pthread_mutex_unlock(&ctx->camera_lock);
+    return;
+  }
+  lws_sock_file_fd_type fd;
+  fd.filefd = dup(ctx->camera->fd);
+  ctx->camera_wsi = lws_adopt_descriptor_vhost(vhd->vhost, LWS_ADOPT_RAW_FILE_DESC,
+						fd, "cam_capture", NULL);
+  if (!ctx->camera_wsi) {
+    lwsl_err("[Cam_capture] cannot adopt the camera descriptor\n");
+    camera_set_streaming(ctx->camera, 0);
+    pthread_mutex_unlock(&ctx->camera_lock);
+    return;
+  }
+  ctx->resume_us = start;
+  pthread_mutex_unlock(&ctx->camera_lock);
+  lwsl_user("[Cam_capture] camera restarted in %lluus\n", (unsigned long long)(now_us() - start));
+}
+
+/* on the thread of the camera descriptor, with camera_lock held */
+static void camera_sleep(OrazioWSContext* ctx, struct per_vhost_data__minimal *vhd){
+  struct lws* wsi = ctx->camera_wsi;
+  ctx->camera_wsi = NULL;
+  ctx->camera_tsi = -1;
+  ctx->camera_stop_pending = 0;
+  lws_set_timeout(wsi, PENDING_TIMEOUT_USER_OK, LWS_TO_KILL_ASYNC);
+  if (camera_set_streaming(ctx->camera, 0))
+    lwsl_err("[Cam_capture] cannot stop the camera\n");
+  ctx->resume_us = 0;
+  /* the next viewer waits for a fresh frame rather than getting this one,
+     or the capture waiting for the encoder, or the one being encoded */
+  pthread_mutex_lock(&vhd->lock_capture);
+  struct raw_frame pending = vhd->captured;
+  vhd->captured.frame = NULL;
+  pthread_mutex_unlock(&vhd->lock_capture);
+  release_raw_frame(&pending);
+  pthread_mutex_lock(&vhd->lock_frame);
+  __atomic_store_n(&vhd->sleep_us, now_us(), __ATOMIC_RELAXED);
+  for (int s = 0; s < StreamCount; ++s)
+    __minimal_destroy_message(&vhd->latest[s]);
+  pthread_mutex_unlock(&vhd->lock_frame);
+  lwsl_user("[Cam_capture] no viewers, camera stopped\n");
+}
+
+/* camera work asked by another service thread: the thread of the camera
+   drops a stopped one, and wakes it again if it has viewers. The first
+   thread adopts the camera for a viewer that came on another one */
+static void camera_pending(OrazioWSContext* ctx, struct per_vhost_data__minimal *vhd){
+  pthread_mutex_lock(&ctx->camera_lock);
+  int stop = ctx->camera_stop_pending && ctx->camera_tsi == service_tsi;
+  if (stop)
+    camera_sleep(ctx, vhd);
+  int wake = (stop || (ctx->camera_wake_pending && !service_tsi))
+    && __atomic_load_n(&vhd->sessions, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&ctx->camera_lock);
+  if (wake)
+    camera_wake(ctx, vhd);
+}
+
+/*
+  a viewer asked for another camera mode. This runs on the service thread
+  of the viewer, the capture waits on camera_lock: the frames already in
+  the pipeline carry their size and their pool, so nothing has to be
+  flushed. All the viewers are told what the camera ended up with.
+  The values come from the wire: a zero size or rate is refused here, the
+  camera clamps the rest to CAMERA_MAX_WIDTH/HEIGHT/FPS
+*/
+static void set_camera_mode(OrazioWSContext* ctx, struct per_vhost_data__minimal *vhd,
+			    const rrc_camera_mode_t* mode){
+  camera_t* camera = ctx->camera;
+  rrc_camera_mode_t* state = &ctx->camera_state;
+  pthread_mutex_lock(&ctx->camera_lock);
+  uint64_t start = now_us();
+  uint8_t flags = mode->flags;
+  if ((flags & RRC_CAMERA_SIZE) && (!mode->width || !mode->height))
+    flags &= ~RRC_CAMERA_SIZE;
+  if ((flags & RRC_CAMERA_FPS) && !mode->fps)
+    flags &= ~RRC_CAMERA_FPS;
+  if (flags != mode->flags)
+    errno = EINVAL;
+  state->flags = 0;
+  if ((flags & RRC_CAMERA_SIZE) && !camera_set_format(camera, mode->width, mode->height))
+    state->flags |= RRC_CAMERA_SIZE;
+  if ((flags & RRC_CAMERA_FPS) && !camera_set_fps(camera, mode->fps))
+    state->flags |= RRC_CAMERA_FPS;
+  if ((flags & RRC_CAMERA_EXPOSURE) && !camera_set_exposure(camera, mode->exposure)) {
+    state->flags |= RRC_CAMERA_EXPOSURE;
+    state->exposure = mode->exposure;
+  }
+  if (mode->flags & ~state->flags)
+    lwsl_warn("[Cam_service] camera mode partly refused (flags %x of %x): %s\n",
+	      state->flags, mode->flags, strerror(errno));
+  state->width = camera->width;
+  state->height = camera->height;
+  state->fps = camera->fps;
+  lwsl_user("[Cam_service] camera %ux%u, %u fps, exposure %u, switched in %lluus\n",
+	    state->width, state->height, state->fps, state->exposure,
+	    (unsigned long long)(now_us() - start));
+  /* the driver did not stream again, not even in the previous mode: the
+     stopped descriptor would never be readable, the thread of the camera
+     drops it and the camera starts over */
+  int stopped = ctx->camera_wsi && !camera->streaming && camera_set_streaming(camera, 1);
+  if (stopped) {
+    lwsl_err("[Cam_service] the camera stopped switching mode, restarting it\n");
+    ctx->camera_stop_pending = 1;
+  }
+  /* also retries a restart that failed before */
+  int restart = !ctx->camera_wsi;
+  pthread_mutex_unlock(&ctx->camera_lock);
+  if (stopped)
+    camera_pending(ctx, vhd);
+  if (restart && __atomic_load_n(&vhd->sessions, __ATOMIC_RELAXED))
+    camera_wake(ctx, vhd);
+  __atomic_add_fetch(&vhd->state_version, 1, __ATOMIC_RELAXED);
+  sync_camera_state(vhd);
+  if (ctx->service_threads > 1)
+    lws_cancel_service(vhd->context);
+}
+
 static int callback_send_cam(struct lws *wsi,
                          enum lws_callback_reasons reason, void *user,
                          void *in, size_t len){
     
   struct per_session_data__minimal *pss = (struct per_session_data__minimal*) user;
   struct per_vhost_data__minimal *vhd = (struct per_vhost_data__minimal*) lws_protocol_vh_priv_get(lws_get_vhost(wsi),lws_get_protocol(wsi));
-  const struct msg *pmsg;
   OrazioWSContext* ctx = ws_ctx;
   void *retval;
-  int m, idx = 0;
+  int m;
+  uint32_t latest_seq;
+  rrc_camera_mode_t mode;
+  rrc_stream_options_t options;
 
   switch(reason){
         
@@ -263,17 +1087,20 @@ static int callback_send_cam(struct lws *wsi,
     if(!vhd)
       return 1;
 
-    pthread_mutex_init(&vhd->lock_ring, NULL);
+    pthread_mutex_init(&vhd->lock_frame, NULL);
+    pthread_mutex_init(&vhd->lock_capture, NULL);
+    pthread_cond_init(&vhd->capture_cond, NULL);
 
     vhd->context = lws_get_context(wsi);
     vhd->protocol = lws_get_protocol(wsi);
     vhd->vhost = lws_get_vhost(wsi);
-    
-    vhd->ring = lws_ring_create(sizeof(struct msg), 8, __minimal_destroy_message);
-    if (!vhd->ring) {
-      lwsl_err("[Cam_service] %s: failed to create ring\n", __func__);
+    vhd->frames_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (vhd->frames_fd < 0) {
+      lwsl_err("[Cam_service] eventfd creation failed\n");
       return 1;
     }
+    ctx->cam_vhd = vhd;
+    
     pthread_attr_t attr;
     pthread_attr_init(&attr);
     if (pthread_create(&vhd->pthread_spam, &attr, thread_spam, vhd)) {
@@ -286,108 +1113,372 @@ static int callback_send_cam(struct lws *wsi,
 
   case LWS_CALLBACK_PROTOCOL_DESTROY:
 init_fail:
+    pthread_mutex_lock(&vhd->lock_capture);
     vhd->finished = 1;
+    pthread_cond_signal(&vhd->capture_cond);
+    pthread_mutex_unlock(&vhd->lock_capture);
     pthread_join(vhd->pthread_spam, &retval);
+    ctx->cam_vhd = NULL;
 
-    if (vhd->ring)
-      lws_ring_destroy(vhd->ring);
+    for (int s = 0; s < StreamCount; ++s)
+      __minimal_destroy_message(&vhd->latest[s]);
+    for (int t = 0; t < MAX_SERVICE_THREADS; ++t) {
+      for (int s = 0; s < StreamCount; ++s)
+	__minimal_destroy_message(&vhd->threads[t].latest[s]);
+      if (vhd->threads[t].pool)
+	frame_pool_retire(vhd->threads[t].pool);
+    }
+    release_raw_frame(&vhd->captured);
+    close(vhd->frames_fd);
 
-    pthread_mutex_destroy(&vhd->lock_ring);
+    pthread_cond_destroy(&vhd->capture_cond);
+    pthread_mutex_destroy(&vhd->lock_capture);
+    pthread_mutex_destroy(&vhd->lock_frame);
     break;    
 
   case LWS_CALLBACK_ESTABLISHED:
-    lws_ll_fwd_insert(pss, pss_list, vhd->pss_list);
-    idx = getFreeConnectionIdx(ctx);
-    if(idx >= 0)
-      ctx->connections[idx] = vhd;
-    pss->tail = lws_ring_get_oldest_tail(vhd->ring);
+    lws_ll_fwd_insert(pss, pss_list, vhd->threads[service_tsi].pss_list);
+    __atomic_add_fetch(&vhd->sessions, 1, __ATOMIC_RELAXED);
+    camera_wake(ctx, vhd);
+    addConnection(ctx, vhd);
+    memset(&pss->current, 0, sizeof(pss->current));
+    pss->offset = 0;
+    pss->last_seq = 0;
+    pss->stream = stream_of(VideoCodecJpeg, ctx->params.gray, RRC_LAYER_FULL);
+    pss->need_keyframe = 1;
+    __atomic_add_fetch(&vhd->viewers[pss->stream], 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&vhd->gate_reset, 1, __ATOMIC_RELAXED);
+    pss->sent = pss->dropped = pss->max_depth = 0;
+    pss->last_report = now_us();
+    latency_stats_init(&pss->enqueue_wait);
+    pss->clock_pending = 0;
+    pss->state_pending = 1;
+    memset(pss->tables_sent, 0, sizeof(pss->tables_sent));
+    pss->established_us = now_us();
     pss->wsi = wsi;
     printf("[Cam_service] Connection established\n");
+    /* start right away with the newest frame */
+    lws_callback_on_writable(wsi);
     break;
         
   case LWS_CALLBACK_CLOSED:
-    lws_ll_fwd_remove(struct per_session_data__minimal, pss_list, pss, vhd->pss_list);
+    lws_ll_fwd_remove(struct per_session_data__minimal, pss_list, pss,
+		      vhd->threads[service_tsi].pss_list);
+    __minimal_destroy_message(&pss->current);
+    __atomic_sub_fetch(&vhd->viewers[pss->stream], 1, __ATOMIC_RELAXED);
+    /* the last viewer left: the capture stops the camera if nobody comes back soon */
+    __atomic_sub_fetch(&vhd->sessions, 1, __ATOMIC_RELAXED);
     freeConnection(ctx, vhd);
     break;
+
+  case LWS_CALLBACK_EVENT_WAIT_CANCELLED:
+    /* several service threads: the encoder published a frame or a viewer
+       changed the camera, each thread looks after its own sessions */
+    if (!vhd || ctx->service_threads < 2)
+      break;
+    camera_pending(ctx, vhd);
+    notify_sessions(vhd);
+    sync_camera_state(vhd);
+    break;
         
   case LWS_CALLBACK_SERVER_WRITEABLE:
-    /*take one frame from queue and send on libwebsockets*/
-    pthread_mutex_lock(&vhd->lock_ring); /* --------- ring lock { */
+    /* clock pong, only between two frames */
+    if (pss->clock_pending && !pss->offset) {
+      pss->clock.host_send_us = now_us();
+      rrc_clock_pong_encode(pss->clock_buf + LWS_PRE, &pss->clock);
+      pss->clock_pending = 0;
+      m = lws_write(wsi, pss->clock_buf + LWS_PRE, RRC_CLOCK_PONG_SIZE, LWS_WRITE_BINARY);
+      if (m < RRC_CLOCK_PONG_SIZE) {
+	lwsl_err("[Cam_service] ERROR %d writing to ws socket\n", m);
+	return -1;
+      }
+      lws_callback_on_writable(wsi);
+      break;
+    }
+
+    /* camera state, also between two frames */
+    if (pss->state_pending && !pss->offset) {
+      pthread_mutex_lock(&ctx->camera_lock);
+      rrc_camera_state_encode(pss->state_buf + LWS_PRE, &ctx->camera_state);
+      pthread_mutex_unlock(&ctx->camera_lock);
+      pss->state_pending = 0;
+      m = lws_write(wsi, pss->state_buf + LWS_PRE, RRC_CAMERA_MODE_SIZE, LWS_WRITE_BINARY);
+      if (m < RRC_CAMERA_MODE_SIZE) {
+	lwsl_err("[Cam_service] ERROR %d writing to ws socket\n", m);
+	return -1;
+      }
+      lws_callback_on_writable(wsi);
+      break;
+    }
 
-    pmsg = lws_ring_get_element(vhd->ring, &pss->tail);
-    if (!pmsg) {
-      pthread_mutex_unlock(&vhd->lock_ring); /* } ring lock ------- */
+    /* done with the previous frame: jump to the newest one */
+    if (!pss->current.frame && !take_latest_frame(vhd, pss))
+      break;
+
+    /* the tables the frame leaves out, if the client does not have them */
+    if (!pss->offset && pss->current.tables && !pss->tables_sent[pss->current.tables]) {
+      size_t tables_size = jpeg_mem_tables(pss->tables_buf + LWS_PRE + RRC_JPEG_TABLES_HEADER_SIZE,
+					   RRC_JPEG_TABLES_MAX_SIZE - RRC_JPEG_TABLES_HEADER_SIZE,
+					   pss->current.tables);
+      if (!tables_size) {
+	lwsl_err("[Cam_service] jpeg tables do not fit in %d bytes\n", RRC_JPEG_TABLES_MAX_SIZE);
+	return -1;
+      }
+      size_t n = rrc_jpeg_tables_encode(pss->tables_buf + LWS_PRE, pss->current.tables, tables_size);
+      pss->tables_sent[pss->current.tables] = 1;
+      m = lws_write(wsi, pss->tables_buf + LWS_PRE, n, LWS_WRITE_BINARY);
+      if (m < (int)n) {
+	lwsl_err("[Cam_service] ERROR %d writing to ws socket\n", m);
+	return -1;
+      }
+      lws_callback_on_writable(wsi);
       break;
     }
 
-    /* notice we allowed for LWS_PRE in the payload already */
-    m = lws_write(wsi, ((unsigned char *)pmsg->payload) + LWS_PRE,
-		  pmsg->len, LWS_WRITE_BINARY);
-    if (m < (int)pmsg->len) {
-      pthread_mutex_unlock(&vhd->lock_ring); /* } ring lock ------- */
+    if (!pss->offset) {
+      uint64_t enqueue_us = now_us();
+      rrc_frame_header_set_enqueue(pss->current.frame->data + LWS_PRE, enqueue_us);
+      latency_stats_add(&pss->enqueue_wait, (int64_t)(enqueue_us - pss->current.published_us));
+      if (pss->established_us) {
+	lwsl_user("[Cam_service] client %p: first frame %lluus after connecting\n",
+		  (void *)wsi, (unsigned long long)(enqueue_us - pss->established_us));
+	pss->established_us = 0;
+      }
+    }
+
+    /* the frame goes out straight from the pool buffer, one fragment per
+       writeable callback. lws_write puts the ws header in the LWS_PRE bytes
+       in front of the fragment: past the first fragment those are frame
+       bytes (shared with the other sessions), so we put them back.
+       All the writes to a frame happen on one service thread: the only
+       one, or the one owning the copy, hence nobody reads it meanwhile */
+    size_t remaining = pss->current.len - pss->offset;
+    size_t chunk = remaining > CAM_FRAGMENT_SIZE ? CAM_FRAGMENT_SIZE : remaining;
+    unsigned char *fragment = pss->current.frame->data + LWS_PRE + pss->offset;
+    unsigned char headroom[LWS_PRE];
+    if (pss->offset)
+      memcpy(headroom, fragment - LWS_PRE, LWS_PRE);
+    m = lws_write(wsi, fragment, chunk,
+		  lws_write_ws_flags(LWS_WRITE_BINARY, !pss->offset, chunk == remaining));
+    if (pss->offset)
+      memcpy(fragment - LWS_PRE, headroom, LWS_PRE);
+    if (m < (int)chunk) {
       lwsl_err("[Cam_service] ERROR %d writing to ws socket\n", m);
       return -1;
     }
 
-    lws_ring_consume_and_update_oldest_tail(
-	    vhd->ring,	/* lws_ring object */
-	    struct per_session_data__minimal, /* type of objects with tails */
-	    &pss->tail,	/* tail of guy doing the consuming */
-	    1,		/* number of payload objects being consumed */
-	    vhd->pss_list,	/* head of list of objects with tails */
-	    tail,		/* member name of tail in objects with tails */
-	    pss_list	/* member name of next object in objects with tails */
-    );
-
-    /* more to do? */
-    if (lws_ring_get_element(vhd->ring, &pss->tail))
-      /* come back as soon as we can write more */
-      lws_callback_on_writable(pss->wsi);
-
-    pthread_mutex_unlock(&vhd->lock_ring); /* } ring lock ------- */
-    
+    pss->offset += chunk;
+    if (pss->offset < pss->current.len) {
+      /* rest of the frame on the next writeable */
+      lws_callback_on_writable(wsi);
+      break;
+    }
+    pss->offset = 0;
+    __minimal_destroy_message(&pss->current);
+    ++pss->sent;
+    report_session(pss);
+
+    /* a newer frame came in while we were sending */
+    pthread_mutex_lock(&vhd->lock_frame);
+    latest_seq = vhd->latest[pss->stream].seq;
+    pthread_mutex_unlock(&vhd->lock_frame);
+    if (latest_seq != pss->last_seq)
+      lws_callback_on_writable(wsi);
     break;
 
   case LWS_CALLBACK_RECEIVE:
+    switch (rrc_message_type(in, len)) {
+    case RRC_MSG_CLOCK_PING:
+      /* answered as soon as the frame being sent is done */
+      if (rrc_clock_ping_decode(&pss->clock, in, len))
+	break;
+      pss->clock.host_receive_us = now_us();
+      pss->clock_pending = 1;
+      lws_callback_on_writable(wsi);
+      break;
+    case RRC_MSG_CAMERA_MODE:
+      if (!rrc_camera_mode_decode(&mode, in, len))
+	set_camera_mode(ctx, vhd, &mode);
+      break;
+    case RRC_MSG_STREAM_OPTIONS:
+      if (rrc_stream_options_decode(&options, in, len))
+	break;
+      /* jpeg for a codec we do not have, the frame headers tell the client */
+      if (options.codec >= VideoCodecCount || !video_encoder_available(options.codec))
+	options.codec = VideoCodecJpeg;
+      set_session_stream(vhd, pss, stream_of(options.codec, options.flags & RRC_STREAM_GRAY,
+					     options.layer));
+      if (options.flags & RRC_STREAM_KEYFRAME) {
+	pss->need_keyframe = 1;
+	__atomic_store_n(&vhd->keyframe_request[pss->stream], 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&vhd->gate_reset, 1, __ATOMIC_RELAXED);
+      }
+      break;
+    default:
+      lwsl_warn("[Cam_service] unknown message (%zu bytes)\n", len);
+      break;
+    }
     break;
 
-  case LWS_CALLBACK_EVENT_WAIT_CANCELLED:
+  default:
+    break;
+  }
+
+  return 0;
+}
+
+/* hands the image to the encoder, replacing a capture it has not taken yet */
+static void capture_frame(OrazioWSContext* ctx, struct per_vhost_data__minimal *vhd){
+  camera_t* camera = ctx->camera;
+  pthread_mutex_lock(&ctx->camera_lock);
+  ctx->camera_tsi = service_tsi;
+  /* a mode switch stopped it before its first capture told its thread */
+  if (ctx->camera_stop_pending) {
+    pthread_mutex_unlock(&ctx->camera_lock);
+    camera_pending(ctx, vhd);
+    return;
+  }
+  /* nobody watching: give the buffer back to the driver, and stop the
+     camera if nobody came back in CAMERA_LINGER_US */
+  if (!__atomic_load_n(&vhd->sessions, __ATOMIC_RELAXED)) {
+    camera_capture_into(camera, NULL, 0);
+    uint64_t now = now_us();
+    if (!ctx->idle_since_us)
+      ctx->idle_since_us = now;
+    else if (now - ctx->idle_since_us >= CAMERA_LINGER_US)
+      camera_sleep(ctx, vhd);
+    pthread_mutex_unlock(&ctx->camera_lock);
+    return;
+  }
+  ctx->idle_since_us = 0;
+  frame_buffer_t* buffer = frame_pool_get(camera->pool);
+  if (!buffer) {
+    camera_capture_into(camera, NULL, 0);
+    pthread_mutex_unlock(&ctx->camera_lock);
+    lwsl_user("[Cam_capture] Frame pool exhausted\n");
+    return;
+  }
+  struct raw_frame raw = {
+    .frame = buffer,
+    .len = camera_capture_into(camera, buffer->data, buffer->capacity),
+    .width = camera->width,
+    .height = camera->height,
+    .capture_us = camera->timestamp_us
+  };
+  uint64_t resume_us = ctx->resume_us;
+  ctx->resume_us = 0;
+  pthread_mutex_unlock(&ctx->camera_lock);
+  if (!raw.len) {
+    release_raw_frame(&raw);
+    return;
+  }
+  if (resume_us)
+    lwsl_user("[Cam_capture] first frame %lluus after resuming\n",
+	      (unsigned long long)(now_us() - resume_us));
+  pthread_mutex_lock(&vhd->lock_capture);
+  struct raw_frame stale = vhd->captured;
+  vhd->captured = raw;
+  pthread_cond_signal(&vhd->capture_cond);
+  pthread_mutex_unlock(&vhd->lock_capture);
+  release_raw_frame(&stale);
+}
+
+/*
+  raw file descriptors served by the lws loop: the camera (readable when
+  the driver has a frame) and the eventfd the encoder signals when a jpeg
+  is published. lws closes them on exit, so it gets duplicates
+*/
+static int callback_cam_capture(struct lws *wsi,
+				enum lws_callback_reasons reason, void *user,
+				void *in, size_t len){
+  OrazioWSContext* ctx = ws_ctx;
+  struct per_vhost_data__minimal *vhd = ctx->cam_vhd;
+  lws_sock_file_fd_type fd;
+  uint64_t events;
+
+  switch(reason){
+  case LWS_CALLBACK_PROTOCOL_INIT:
+    if (!vhd)
+      return 1;
+    /* the camera is adopted by camera_wake, when the first viewer comes */
+    fd.filefd = dup(vhd->frames_fd);
+    ctx->frames_wsi = lws_adopt_descriptor_vhost(lws_get_vhost(wsi), LWS_ADOPT_RAW_FILE_DESC,
+						 fd, "cam_capture", NULL);
+    if (!ctx->frames_wsi) {
+      lwsl_err("[Cam_capture] cannot adopt the encoder descriptor\n");
+      return 1;
+    }
+    printf("[Cam_capture] Protocol initialized\n");
+    break;
+
+  case LWS_CALLBACK_RAW_RX_FILE:
     if (!vhd)
       break;
-    /*
-     * When the "spam" threads add a message to the ringbuffer,
-     * they create this event in the lws service thread context
-     * using lws_cancel_service().
-     *
-     * We respond by scheduling a writable callback for all
-     * connected clients.
-     */
-    lws_start_foreach_llp(struct per_session_data__minimal **,
-			  ppss, vhd->pss_list) {
-      lws_callback_on_writable((*ppss)->wsi);
-    } lws_end_foreach_llp(ppss, pss_list);
+    if (wsi == ctx->camera_wsi)
+      capture_frame(ctx, vhd);
+    else if (wsi == ctx->frames_wsi) {
+      if (read(vhd->frames_fd, &events, sizeof(events)) == sizeof(events))
+	notify_sessions(vhd);
+    }
     break;
-        
+
+  case LWS_CALLBACK_RAW_CLOSE_FILE:
+    pthread_mutex_lock(&ctx->camera_lock);
+    if (wsi == ctx->camera_wsi) {
+      ctx->camera_wsi = NULL;
+      ctx->camera_tsi = -1;
+      ctx->camera_stop_pending = 0;
+    }
+    pthread_mutex_unlock(&ctx->camera_lock);
+    if (wsi == ctx->frames_wsi)
+      ctx->frames_wsi = NULL;
+    break;
+
   default:
     break;
   }
+  return 0;
+}
+
+static struct lws_context* create_context(int port, const struct lws_protocols* protocols, int threads){
+  struct lws_context_creation_info info;
+  memset(&info, 0, sizeof info); /* otherwise uninitialized garbage */
+  info.port = port;
+  info.count_threads = threads;
+  info.mounts = NULL;
+  info.protocols = protocols;
+  info.vhost_name = "localhost";
+  info.ws_ping_pong_interval = 10;
+  return lws_create_context(&info);
+}
+
+/* everything is driven by descriptors in the loop: it sleeps in poll
+   until a frame is captured, published, a command comes in or a socket
+   needs service */
+static void service_loop(OrazioWSContext* ctx, struct lws_context* context){
+  int n = 0;
+  while (ctx->run && n >= 0){
+    n = lws_service(context, 0);
+  }
+}
 
+/* video plane past the first service thread: lws spreads the connections
+   over the threads, each loop serves its share */
+static void* _serviceFn(void* args){
+  OrazioWSContext* ctx = ws_ctx;
+  int n = 0;
+  service_tsi = (int)(intptr_t)args;
+  while (ctx->run && n >= 0){
+    n = lws_service_tsi(ctx->context, 0, service_tsi);
+  }
   return 0;
 }
 
+/* video plane: camera capture, publishing and frame writes */
 void* _websocketFn(void* args){
     
   OrazioWSContext* ctx = (OrazioWSContext*) args;
-  ws_ctx = ctx;
-  struct lws_context_creation_info info;
   struct lws_context *context;
-  int n = 0;
-  int port = ctx->port;
-  int rate = ctx->rate;
-
-  memset(&info, 0, sizeof info); /* otherwise uninitialized garbage */
-  info.port = port;
-  info.mounts = NULL;
 
   struct lws_protocols protocols[] = {
     {
@@ -397,15 +1488,6 @@ void* _websocketFn(void* args){
       .rx_buffer_size=0,
       .user=NULL
     },
-    {
-      .name="exec_commands",
-      .callback=callback_rcv_comm,
-      .per_session_data_size=sizeof(struct per_session_data__minimal),
-      .rx_buffer_size=128,
-      .id=0,
-      .user=NULL,
-      .tx_packet_size=0
-    },
     {
       .name="cam_protocol",
       .callback=callback_send_cam,
@@ -415,6 +1497,16 @@ void* _websocketFn(void* args){
       .user=NULL, 
       .tx_packet_size=0
     },
+    {
+      /* after cam_protocol: it adopts the descriptors cam_protocol created */
+      .name="cam_capture",
+      .callback=callback_cam_capture,
+      .per_session_data_size=0,
+      .rx_buffer_size=0,
+      .id=0,
+      .user=NULL,
+      .tx_packet_size=0
+    },
     {
       .name=NULL,
       .callback=NULL,
@@ -424,49 +1516,177 @@ void* _websocketFn(void* args){
     }
   };
     
-  info.protocols = protocols;
-  info.vhost_name = "localhost";
-  info.ws_ping_pong_interval = 10;
+  context = create_context(ctx->port, protocols, ctx->service_threads);
+  if(!context)
+    exit(1);
+  ctx->context = context;
+  /* lws built without LWS_MAX_SMP > 1 runs one thread */
+  int threads = lws_get_count_threads(context);
+  if(threads < ctx->service_threads)
+    lwsl_warn("[Cam_service] lws runs %d of %d service threads\n", threads, ctx->service_threads);
+  ctx->service_threads = threads;
+  for(int t = 1; t < threads; ++t)
+    pthread_create(&ctx->service_thread[t], NULL, _serviceFn, (void*)(intptr_t)t);
+  lwsl_user("[Cam_service] %d service threads\n", threads);
+  service_loop(ctx, context);
+  for(int t = 1; t < threads; ++t)
+    pthread_join(ctx->service_thread[t], NULL);
+  ctx->context = NULL;
+  lws_context_destroy(context);
+  return 0;
+}
+
+/* control plane: joystick commands, never queued behind a frame write */
+void* _controlFn(void* args){
 
-  context = lws_create_context(&info);
+  OrazioWSContext* ctx = (OrazioWSContext*) args;
+  struct lws_context *context;
+
+  struct lws_protocols protocols[] = {
+    {
+      .name="http-only",
+      .callback=lws_callback_http_dummy,
+      .per_session_data_size=0,
+      .rx_buffer_size=0,
+      .user=NULL
+    },
+    {
+      .name="exec_commands",
+      .callback=callback_rcv_comm,
+      .per_session_data_size=sizeof(struct per_session_data__minimal),
+      .rx_buffer_size=128,
+      .id=0,
+      .user=NULL,
+      .tx_packet_size=0
+    },
+    {
+      .name=NULL,
+      .callback=NULL,
+      .per_session_data_size=0,
+      .rx_buffer_size=0,
+      .user=NULL
+    }
+  };
+
+  context = create_context(ctx->control_port, protocols, 1);
   if(!context)
     exit(1);
-    
-  ctx->run = 1;    
-  while (ctx->run && n >= 0){
-    n = lws_service(context, 10);
-    usleep(1000000/rate);
-  }
-    
+  ctx->control_context = context;
+  service_loop(ctx, context);
+  ctx->control_context = NULL;
   lws_context_destroy(context);
   return 0;
 }
 
+void OrazioWebsocketServer_defaultParams(OrazioWSParams* params){
+  params->frame_bytes = 3072;
+  params->bitrate = 0;
+  params->min_quality = 5;
+  params->max_quality = 60;
+  params->downscale = 0;
+  params->control_port = 0;
+  params->width = 320;
+  params->height = 240;
+  params->fps = 0;
+  params->exposure = -1;
+  params->gray = 0;
+  params->motion_threshold = 6;
+  params->motion_refresh_ms = 1000;
+  params->service_threads = 1;
+}
+
+void OrazioWebsocketServer_commandApplied(OrazioWSContext* context, const command_t* command){
+  uint64_t now = command_now_us();
+  latency_stats_add(&context->command_latency, now - command->stamp_us);
+  if(now - context->last_command_report < STATS_PERIOD_US)
+    return;
+  if(context->command_latency.count){
+    char stats[128];
+    latency_stats_format(&context->command_latency, stats, sizeof(stats));
+    lwsl_user("[Control] receive to control loop pickup: %s\n", stats);
+  }
+  context->last_command_report = now;
+}
+
 OrazioWSContext* OrazioWebsocketServer_start(struct OrazioClient* client,
                                              int port,
                                              char* resource_path,
-                                             int rate,
                                              char* cam,
-                                             DifferentialDriveControlPacket* _drive_control ){
+                                             command_mailbox_t* commands,
+                                             const OrazioWSParams* params){
   OrazioWSContext* context = (OrazioWSContext*) malloc(sizeof(OrazioWSContext));
+  if(params)
+    context->params = *params;
+  else
+    OrazioWebsocketServer_defaultParams(&context->params);
+  motion_gate_init(&context->motion_gate, context->params.motion_threshold,
+		   (uint64_t)context->params.motion_refresh_ms * 1000);
+  init_stream_names();
+  /* a layer has a quarter of the pixels of the one above, and of the budget */
+  for(int s = 0; s < StreamCount; ++s)
+    rate_control_init(&context->rate_control[s],
+		      context->params.frame_bytes >> (2 * stream_layer(s)),
+		      context->params.bitrate >> (2 * stream_layer(s)),
+		      context->params.min_quality,
+		      context->params.max_quality,
+		      context->params.downscale);
   context->port = port;
+  context->control_port = context->params.control_port ? context->params.control_port : port+1;
   context->client = client;
-  context->rate = rate;
   initConnections(context);
+  pthread_mutex_init(&context->connections_lock, NULL);
+  pthread_mutex_init(&context->camera_lock, NULL);
+  context->service_threads = context->params.service_threads < 1 ? 1
+    : context->params.service_threads > MAX_SERVICE_THREADS ? MAX_SERVICE_THREADS
+    : context->params.service_threads;
+  context->idle_since_us = 0;
+  context->camera_tsi = -1;
   context->cam = cam;
-  context->camera = camera_initialize(context->cam, WIDTH, HEIGHT);
-  context->drive_control = _drive_control;
+  context->camera = camera_initialize(context->cam, context->params.width, context->params.height);
+  if (context->params.fps > 0 && camera_set_fps(context->camera, context->params.fps))
+    lwsl_warn("[Cam_service] cannot set %d fps: %s\n", context->params.fps, strerror(errno));
+  if (context->params.exposure >= 0 && camera_set_exposure(context->camera, context->params.exposure))
+    lwsl_warn("[Cam_service] cannot set the exposure: %s\n", strerror(errno));
+  memset(&context->camera_state, 0, sizeof(context->camera_state));
+  context->camera_state.width = context->camera->width;
+  context->camera_state.height = context->camera->height;
+  context->camera_state.fps = context->camera->fps;
+  if (context->params.exposure > 0)
+    context->camera_state.exposure = context->params.exposure;
+  /* no viewers yet */
+  camera_set_streaming(context->camera, 0);
+  context->resume_us = 0;
+  context->commands = commands;
+  context->context = NULL;
+  context->control_context = NULL;
+  context->cam_vhd = NULL;
+  context->camera_wsi = NULL;
+  context->frames_wsi = NULL;
+  latency_stats_init(&context->command_latency);
+  context->last_command_report = now_us();
+  context->run = 1;
+  /* the callbacks find the context here, set before any thread starts */
+  ws_ctx = context;
   pthread_attr_t attr;
   pthread_attr_init(&attr);
   pthread_create(&context->thread, &attr, _websocketFn, context);
+  pthread_create(&context->control_thread, &attr, _controlFn, context);
   return context;
 }
 
 void OrazioWebsocketServer_stop(OrazioWSContext* context){
   context->run = 0;
+  if(context->context)
+    lws_cancel_service(context->context);
+  if(context->control_context)
+    lws_cancel_service(context->control_context);
   void* retval;
+  pthread_join(context->control_thread, &retval);
   pthread_join(context->thread, &retval);
+  pthread_mutex_destroy(&context->connections_lock);
+  pthread_mutex_destroy(&context->camera_lock);
   camera_finish(context->camera);
   camera_close(context->camera);
+  motion_gate_destroy(&context->motion_gate);
   free(context);
 }
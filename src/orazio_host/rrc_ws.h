@@ -1,16 +1,42 @@
 #pragma once
 #include "orazio_client.h"
+#include "command_mailbox.h"
 
 struct OrazioWSContext;
 struct joy_packet;
 
+// tuning of the video stream
+typedef struct OrazioWSParams{
+  int frame_bytes;     // rate control target size of a frame
+  int bitrate;         // rate control target in bits/s, overrides frame_bytes if not 0
+  int min_quality;     // jpeg quality range of the rate control
+  int max_quality;
+  int downscale;       // the rate control can halve the resolution
+  int control_port;    // port of the exec_commands server, 0 for port+1
+  int width;           // camera format at start, viewers can change it
+  int height;
+  int fps;             // 0 leaves the driver default
+  int exposure;        // 100us units, 0 automatic, -1 leaves the driver default
+  int gray;            // new viewers get the luma only stream, each can switch
+  int motion_threshold;  // frames changing less are not encoded, 0 encodes them all
+  int motion_refresh_ms; // but one is sent at least this often
+  int service_threads;   // lws service threads of the video plane, each writes to a share of the viewers
+} OrazioWSParams;
+
+// fills the params with the defaults
+void OrazioWebsocketServer_defaultParams(OrazioWSParams* params);
+
 // starts a websocket server bind to the shell
 struct OrazioWSContext* OrazioWebsocketServer_start(struct OrazioClient* client,
                                              int port,
                                              char* resource_path,
-                                             int rate,
                                              char* cam,
-                                             DifferentialDriveControlPacket* _drive_control);
+                                             command_mailbox_t* commands,
+                                             const OrazioWSParams* params);
+
+// the control loop took a command posted by the server:
+// measures the latency from its receive and reports it periodically
+void OrazioWebsocketServer_commandApplied(struct OrazioWSContext* context, const command_t* command);
 
 // stops a websocket server bind to the shell
 void OrazioWebsocketServer_stop(struct OrazioWSContext* context);
\ No newline at end of file
@@ -8,38 +8,173 @@
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <math.h>
 #include <signal.h>
 #include <linux/joystick.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <libgen.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
 #include <libwebsockets.h>
 #include <opencv2/highgui/highgui_c.h>
 
 #include "capture_camera_mod.h"
 #include "orazio_client_test_getkey.h"
+#include "rrc_protocol.h"
+#include "command_mailbox.h"
+#include "latency_stats.h"
+#include "video_decoder.h"
 
 #define _XOPEN_SOURCE
 #define WIDTH 320
 #define HEIGHT 240
+#define STATS_PERIOD_US 1000000
+#define JOY_EVENTS_PER_READ 64
+#define JOY_POLL_MS 250       /* checks the interruption this often */
+#define JOY_REOPEN_MS 2000    /* retries to open the device this often */
+#define CLOCK_PING_PERIOD_US 1000000
+#define CLOCK_SAMPLES 8       /* the offset comes from the fastest of the last pongs */
+#define KEYFRAME_REQUEST_PERIOD_US 500000  /* a lost inter-frame stream asks a keyframe this often */
+#define PENDING_FRAMES 16     /* inter frames waiting for the decoder, past this the chain breaks */
+#define SCRIPT_TV_AXIS 1      /* axes read by rrc_host */
+#define SCRIPT_RV_AXIS 3
 
 static int interrupted;
 
 const char* window="window";
-char* filename = "buf";
 
 char* default_joy_dev = "/dev/input/js0";
 char* address = "localhost";
+int port = 9000;          /* video */
+int control_port = 9001;  /* joystick commands */
+int keepalive_hz = 10;    /* control messages/s when the joystick does not move */
+int send_always = 0;      /* old behaviour: a message per writeable, to compare the counters */
+int headless = 0;         /* decodes and measures the frames without showing them */
+int scripted_joy_hz = 0;  /* >0: synthetic joystick moving this many times per second */
 
-/* JoyPacket structure stores the params (axis, value, type) sent by joystick
-   lock is the semaphore which is set to read/write the structure */
-typedef struct JoyPacket{
-  int axis;
-  int value;
-  int type;
-}JoyPacket;
+/* joyThread signals a new joystick state here, the service loop polls it */
+int joy_event_fd = -1;
+struct lws *joy_event_wsi = NULL;
 
-JoyPacket* ic;
-unsigned char* out;
+/* state of all the axes and buttons of the joystick, updated by joyThread
+   and sent whole in each control message */
+typedef struct JoyState{
+  pthread_mutex_t lock;
+  int16_t axes[RRC_MAX_AXES];
+  uint32_t buttons;
+  uint8_t num_axes;
+  uint32_t version;  /* bumped when something changes */
+}JoyState;
+
+JoyState joy_state = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* control messages sent and round trips measured on their echoes */
+uint32_t command_seq = 0;
+latency_stats_t command_rtt;
+uint32_t command_rejected = 0;
+uint64_t last_rtt_report = 0;
+
+/* sent by the control connection, since last_send_report */
+uint32_t sent_messages = 0;
+uint64_t sent_bytes = 0;
+uint64_t last_send_report = 0;
+
+/* control message being written, with the room lws wants in front */
+unsigned char command_buf[LWS_PRE+RRC_CONTROL_MAX_SIZE];
+
+/* a received jpeg */
+typedef struct FrameBuffer{
+  unsigned char* data;  /* frame header, then the jpeg */
+  size_t size;
+  size_t capacity;
+  uint64_t received_us;
+}FrameBuffer;
+
+/* frames can arrive in several fragments, they are reassembled in receiving.
+   A complete frame is swapped into the pending queue, where the render
+   thread takes them all swapping them with its own, so the service loop
+   never waits on decode or display. A frame that decodes alone (a jpeg, a
+   keyframe) replaces the ones waiting: the newest frame wins. Inter frames
+   need all the ones before them, they are all decoded in order and only
+   the older ones are not shown */
+FrameBuffer receiving = {0};
+pthread_mutex_t render_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t render_cond = PTHREAD_COND_INITIALIZER;
+FrameBuffer pending[PENDING_FRAMES];
+int pending_count = 0;
+uint32_t frames_received = 0;
+uint32_t frames_skipped = 0;  /* replaced in pending before being decoded */
+
+/* tables of the abbreviated jpegs, by quality, under render_lock. The host
+   sends each once, before the first frame that needs it */
+typedef struct JpegTables{
+  unsigned char data[RRC_JPEG_TABLES_MAX_SIZE];
+  size_t size;  /* 0 not received */
+}JpegTables;
+JpegTables jpeg_tables[RRC_MAX_JPEG_QUALITY+1];
+
+/* offset host clock - client clock, estimated from clock pings sent on the
+   video connection. The sample with the shortest round trip is the one
+   least disturbed by queueing */
+typedef struct ClockSync{
+  int64_t offsets[CLOCK_SAMPLES];
+  uint64_t rtts[CLOCK_SAMPLES];
+  int count;
+  int next;
+  uint32_t ping_seq;
+  char ping_pending;
+  int64_t offset;  /* read by the render thread */
+  int valid;
+}ClockSync;
+
+ClockSync clock_sync = {0};
+unsigned char clock_buf[LWS_PRE+RRC_CLOCK_PING_SIZE];
+
+/* camera mode to ask the host for, from the command line or the window keys.
+   The render thread wakes the service loop with lws_cancel_service */
+pthread_mutex_t cam_request_lock = PTHREAD_MUTEX_INITIALIZER;
+rrc_camera_mode_t cam_request = {0};
+int cam_request_pending = 0;
+struct lws_context *ws_context = NULL;
+unsigned char cam_mode_buf[LWS_PRE+RRC_CAMERA_MODE_SIZE];
+
+/* stream options of this viewer, sent again on each connection */
+rrc_stream_options_t stream_options = { .codec=RRC_CODEC_JPEG, .layer=RRC_LAYER_FULL };
+uint8_t keyframe_pending = 0;  /* RRC_STREAM_KEYFRAME in the next options */
+int stream_options_pending = 0;
+unsigned char stream_options_buf[LWS_PRE+RRC_STREAM_OPTIONS_SIZE];
+
+/* window keys 1-4: trade resolution for frame rate */
+#define CAM_PRESET_FLAGS (RRC_CAMERA_SIZE|RRC_CAMERA_FPS)
+const rrc_camera_mode_t cam_presets[]={
+  { .flags=CAM_PRESET_FLAGS, .width=160, .height=120, .fps=30 },
+  { .flags=CAM_PRESET_FLAGS, .width=320, .height=240, .fps=30 },
+  { .flags=CAM_PRESET_FLAGS, .width=640, .height=480, .fps=15 },
+  { .flags=CAM_PRESET_FLAGS, .width=1280, .height=720, .fps=10 }
+};
+#define NUM_CAM_PRESETS (int)(sizeof(cam_presets)/sizeof(cam_presets[0]))
+
+/* latency of each stage of the video pipeline, measured by the render thread */
+typedef enum{
+  StageCaptureToEncode=0,  /* host */
+  StageEncode,             /* host, includes the color conversion */
+  StageEncodeToSend,       /* host, waiting for the client connection */
+  StageNetwork,            /* send start on the host to complete reception, needs the clock offset */
+  StageReceiveToDecode,    /* waiting for the render thread */
+  StageDecode,
+  StageDisplay,
+  StageGlassToGlass,       /* capture to display, needs the clock offset */
+  StageCount
+}Stage;
+
+const char* stage_names[StageCount]={
+  "capture-encode", "encode", "encode-send", "network",
+  "receive-decode", "decode", "display", "glass-to-glass"
+};
 
 /* per_vhost_data__minimal stores the params of connection  */
 struct per_vhost_data__minimal {
@@ -51,11 +186,7 @@ struct per_vhost_data__minimal {
 
   char finished;
   char established;
-};
-
-struct msg {
-  void *payload; /* is malloc'd */
-  size_t len;
+  uint32_t sent_version;  /* joystick state version of the last control message */
 };
 
 const char *banner[]={
@@ -63,10 +194,23 @@ const char *banner[]={
   "generaized client for remote_robot_controller",
   "usage:"
   "$> rrc_client <parameters>",
-  "starts a client that connects to ADDRESS:9000",
+  "starts a client that connects to ADDRESS:9000 (video) and ADDRESS:9001 (commands)",
   "parameters: ",
   "-input-dev <string>: the joystick (default /dev/input/js0)",
   "-address   <string>: address of rrc_host (default 'localhost')",
+  "-port         <int>: video port of rrc_host (default 9000)",
+  "-control-port <int>: command port of rrc_host (default 9001)",
+  "-keepalive-hz <int>: control messages/s when the joystick is still (default 10, 0 never)",
+  "-send-always      : send at every writeable as the old client, for comparison",
+  "-headless         : no window, frames are only decoded and measured",
+  "-scripted-joy <int>: no joystick, the drive axes sweep with <int> changes/s",
+  "-cam-mode <WxH[@fps]>: camera mode asked to the host once connected",
+  "-exposure     <int>: camera exposure in 100us units, 0 automatic",
+  "-gray             : grayscale video, lighter on weak links",
+  "-codec <jpeg|vp8> : video codec, vp8 if the host has it (default jpeg)",
+  "-layer <full|half|quarter>: resolution of the simulcast to get (default full)",
+  "in the window, keys 1-4 switch between 160x120@30 320x240@30 640x480@15 1280x720@10",
+  "g toggles grayscale and l steps through the layers",
   0
 };
 
@@ -78,23 +222,287 @@ void printBanner(){
   }
 }
 
-/* show_frame function takes frame and its len, using openCV show a window 
-   containing the frame given. The CVWaitkey is set at 20 */
-void show_frame(unsigned char* frame, size_t len){
-  FILE* f=fopen(filename, "w");
-  if (!f)
+/* merges a request in the one waiting to be sent, any thread */
+static void request_cam_mode(const rrc_camera_mode_t* mode){
+  pthread_mutex_lock(&cam_request_lock);
+  if(mode->flags & RRC_CAMERA_SIZE){
+    cam_request.width=mode->width;
+    cam_request.height=mode->height;
+  }
+  if(mode->flags & RRC_CAMERA_FPS)
+    cam_request.fps=mode->fps;
+  if(mode->flags & RRC_CAMERA_EXPOSURE)
+    cam_request.exposure=mode->exposure;
+  cam_request.flags|=mode->flags;
+  cam_request_pending=1;
+  pthread_mutex_unlock(&cam_request_lock);
+  if(ws_context)
+    lws_cancel_service(ws_context);
+}
+
+/* any thread: toggles the grayscale stream */
+static void toggle_gray(void){
+  pthread_mutex_lock(&cam_request_lock);
+  stream_options.flags^=RRC_STREAM_GRAY;
+  stream_options_pending=1;
+  pthread_mutex_unlock(&cam_request_lock);
+  if(ws_context)
+    lws_cancel_service(ws_context);
+}
+
+/* any thread: the next layer of the simulcast, back to full after the smallest */
+static void next_layer(void){
+  pthread_mutex_lock(&cam_request_lock);
+  stream_options.layer=(stream_options.layer+1)%RRC_LAYER_COUNT;
+  stream_options_pending=1;
+  pthread_mutex_unlock(&cam_request_lock);
+  if(ws_context)
+    lws_cancel_service(ws_context);
+}
+
+/* render thread: the inter-frame stream lost a frame, asks the host to restart it */
+static void request_keyframe(void){
+  pthread_mutex_lock(&cam_request_lock);
+  keyframe_pending=RRC_STREAM_KEYFRAME;
+  stream_options_pending=1;
+  pthread_mutex_unlock(&cam_request_lock);
+  if(ws_context)
+    lws_cancel_service(ws_context);
+}
+
+/* service loop: takes the stream options to send, 0 if they did not change */
+static int take_stream_options(rrc_stream_options_t* options){
+  pthread_mutex_lock(&cam_request_lock);
+  int pending=stream_options_pending;
+  *options=stream_options;
+  options->flags|=keyframe_pending;
+  stream_options_pending=0;
+  keyframe_pending=0;
+  pthread_mutex_unlock(&cam_request_lock);
+  return pending;
+}
+
+/* service loop: takes the request to send, 0 if there is none */
+static int take_cam_request(rrc_camera_mode_t* mode){
+  pthread_mutex_lock(&cam_request_lock);
+  int pending=cam_request_pending;
+  if(pending){
+    *mode=cam_request;
+    memset(&cam_request, 0, sizeof(cam_request));
+    cam_request_pending=0;
+  }
+  pthread_mutex_unlock(&cam_request_lock);
+  return pending;
+}
+
+static void swap_frames(FrameBuffer* a, FrameBuffer* b){
+  FrameBuffer tmp=*a;
+  *a=*b;
+  *b=tmp;
+}
+
+/* service loop: a frame is complete, hands it to the render thread */
+static void publish_frame(void){
+  rrc_frame_header_t header;
+  /* a corrupted frame is counted by the render thread */
+  int alone=rrc_frame_header_decode(&header, receiving.data, receiving.size) || header.keyframe;
+  pthread_mutex_lock(&render_lock);
+  /* a full queue drops the chain too, the decoder asks for a keyframe */
+  if(alone || pending_count==PENDING_FRAMES){
+    frames_skipped+=pending_count;
+    pending_count=0;
+  }
+  swap_frames(&receiving, pending+pending_count);
+  ++pending_count;
+  ++frames_received;
+  pthread_cond_signal(&render_cond);
+  pthread_mutex_unlock(&render_lock);
+}
+
+/* service loop: keeps the tables of a quality */
+static void store_jpeg_tables(const unsigned char* buf, size_t len){
+  uint8_t quality;
+  const uint8_t* tables;
+  size_t size;
+  if(rrc_jpeg_tables_decode(&quality, &tables, &size, buf, len))
     return;
-  int size=len;
-  fwrite(frame, size, 1, f);
-  fclose(f);
-  CvMat* mat_src=cvLoadImageM(filename, CV_LOAD_IMAGE_COLOR);
-  cvShowImage("window",mat_src);
-  cvWaitKey(20);
+  pthread_mutex_lock(&render_lock);
+  memcpy(jpeg_tables[quality].data, tables, size);
+  jpeg_tables[quality].size=size;
+  pthread_mutex_unlock(&render_lock);
+}
+
+/* render thread: loads into the decoder the tables an abbreviated frame
+   left out, unless they are the ones it has. -1 if they did not come */
+static int load_jpeg_tables(video_decoder_t* video, uint8_t quality, uint8_t* loaded){
+  jpeg_decoder_t* decoder=video_decoder_jpeg(video);
+  if(!quality || quality==*loaded)
+    return 0;
+  pthread_mutex_lock(&render_lock);
+  int result=jpeg_tables[quality].size ?
+    jpeg_decoder_load_tables(decoder, jpeg_tables[quality].data, jpeg_tables[quality].size) : -1;
+  pthread_mutex_unlock(&render_lock);
+  *loaded=result ? 0 : quality;
+  return result;
+}
+
+/* decodes the frames in order and shows the newest, all the highgui calls happen here */
+void* renderThread(void* args_){
+  video_decoder_t* decoder=video_decoder_create();
+  uint8_t tables_loaded=0;  /* quality of the tables in the decoder */
+  uint64_t keyframe_requested=0;
+  FrameBuffer frames[PENDING_FRAMES];
+  memset(frames, 0, sizeof(frames));
+  IplImage* image=NULL;
+  uint32_t image_width=0, image_height=0;
+  uint32_t rendered=0, corrupted=0, unsynced=0, hidden=0;
+  uint64_t last_report=command_now_us();
+  latency_stats_t stages[StageCount];
+  for(int i=0; i<StageCount; ++i)
+    latency_stats_init(stages+i);
+  latency_stats_t sizes;  /* bytes of the jpegs */
+  latency_stats_init(&sizes);
+
+  if(!headless)
+    cvNamedWindow(window, CV_WINDOW_AUTOSIZE);
+  while(!interrupted){
+    pthread_mutex_lock(&render_lock);
+    while(!interrupted && !pending_count)
+      pthread_cond_wait(&render_cond, &render_lock);
+    int count=pending_count;
+    for(int i=0; i<count; ++i)
+      swap_frames(frames+i, pending+i);
+    pending_count=0;
+    pthread_mutex_unlock(&render_lock);
+    if(interrupted)
+      break;
+
+    /* every frame goes through the decoder, the last one decoded is shown */
+    FrameBuffer* shown=NULL;
+    rrc_frame_header_t shown_header;
+    uint8_t* bgr=NULL;
+    uint32_t width=0, height=0;
+    uint64_t decode_end=0;
+    for(int i=0; i<count; ++i){
+      FrameBuffer* frame=frames+i;
+      rrc_frame_header_t header;
+      if(rrc_frame_header_decode(&header, frame->data, frame->size)){
+	++corrupted;
+	continue;
+      }
+      uint64_t decode_start=command_now_us();
+      if(load_jpeg_tables(decoder, header.tables, &tables_loaded)){
+	++corrupted;
+	continue;
+      }
+      /* a full jpeg replaces the tables in the decoder */
+      if(header.codec==RRC_CODEC_JPEG && !header.tables)
+	tables_loaded=0;
+      uint8_t* decoded;
+      uint32_t decoded_width, decoded_height;
+      int result=video_decoder_decode(decoder, header.codec, header.seq, header.keyframe,
+				      frame->data+RRC_FRAME_HEADER_SIZE, frame->size-RRC_FRAME_HEADER_SIZE,
+				      &decoded, &decoded_width, &decoded_height);
+      if(result==VIDEO_DECODER_NEED_KEYFRAME || (result && header.codec!=RRC_CODEC_JPEG)){
+	/* frames were dropped here or on the host, the chain restarts from a keyframe */
+	if(result==VIDEO_DECODER_NEED_KEYFRAME)
+	  ++unsynced;
+	else
+	  ++corrupted;
+	if(decode_start-keyframe_requested>=KEYFRAME_REQUEST_PERIOD_US){
+	  request_keyframe();
+	  keyframe_requested=decode_start;
+	}
+	continue;
+      }
+      if(result){
+	++corrupted;
+	continue;
+      }
+      decode_end=command_now_us();
+      latency_stats_add(stages+StageReceiveToDecode, (int64_t)(decode_start-frame->received_us));
+      latency_stats_add(stages+StageDecode, (int64_t)(decode_end-decode_start));
+      latency_stats_add(&sizes, frame->size-RRC_FRAME_HEADER_SIZE);
+      if(shown)
+	++hidden;
+      shown=frame;
+      shown_header=header;
+      bgr=decoded;
+      width=decoded_width;
+      height=decoded_height;
+    }
+    if(!shown)
+      continue;
+
+    if(!headless){
+      if(!image || width!=image_width || height!=image_height){
+	if(image)
+	  cvReleaseImageHeader(&image);
+	image=cvCreateImageHeader(cvSize(width, height), IPL_DEPTH_8U, 3);
+	image_width=width;
+	image_height=height;
+      }
+      /* the decoder buffer moves only if the size grows */
+      cvSetData(image, bgr, width*3);
+      cvShowImage(window, image);
+      int key=cvWaitKey(1);
+      if(key>='1' && key<'1'+NUM_CAM_PRESETS)
+	request_cam_mode(cam_presets+key-'1');
+      else if(key=='g')
+	toggle_gray();
+      else if(key=='l')
+	next_layer();
+    }
+    ++rendered;
+
+    uint64_t displayed=command_now_us();
+    rrc_frame_header_t* header=&shown_header;
+    latency_stats_add(stages+StageCaptureToEncode, (int64_t)(header->encode_start_us-header->capture_us));
+    latency_stats_add(stages+StageEncode, (int64_t)(header->encode_end_us-header->encode_start_us));
+    latency_stats_add(stages+StageEncodeToSend, (int64_t)(header->enqueue_us-header->encode_end_us));
+    latency_stats_add(stages+StageDisplay, (int64_t)(displayed-decode_end));
+    if(__atomic_load_n(&clock_sync.valid, __ATOMIC_ACQUIRE)){
+      /* host stamps on our clock */
+      int64_t offset=__atomic_load_n(&clock_sync.offset, __ATOMIC_RELAXED);
+      latency_stats_add(stages+StageNetwork, (int64_t)(shown->received_us-header->enqueue_us)+offset);
+      latency_stats_add(stages+StageGlassToGlass, (int64_t)(displayed-header->capture_us)+offset);
+    }
+
+    uint64_t now=command_now_us();
+    if(now-last_report>=STATS_PERIOD_US){
+      float seconds=(now-last_report)*1e-6f;
+      pthread_mutex_lock(&render_lock);
+      uint32_t received=frames_received, skipped=frames_skipped;
+      frames_received=frames_skipped=0;
+      pthread_mutex_unlock(&render_lock);
+      lwsl_user("[render] %.1f fps received, %.1f fps rendered, %u skipped, %u decoded not shown, %u corrupted, %u waiting a keyframe\n",
+		received/seconds, rendered/seconds, skipped, hidden, corrupted, unsynced);
+      for(int i=0; i<StageCount; ++i){
+	char stats[128];
+	latency_stats_format(stages+i, stats, sizeof(stats));
+	lwsl_user("[render]   %-15s %s\n", stage_names[i], stats);
+      }
+      lwsl_user("[render]   %-15s p50 %uB p99 %uB max %uB\n", "frame size",
+		latency_stats_percentile(&sizes, 0.5f), latency_stats_percentile(&sizes, 0.99f),
+		latency_stats_percentile(&sizes, 1.f));
+      rendered=corrupted=unsynced=hidden=0;
+      last_report=now;
+    }
+  }
+  if(image)
+    cvReleaseImageHeader(&image);
+  if(!headless)
+    cvDestroyWindow(window);
+  video_decoder_destroy(decoder);
+  for(int i=0; i<PENDING_FRAMES; ++i)
+    free(frames[i].data);
+  return 0;
 }
 
-static int connect_client(struct per_vhost_data__minimal* vhd, const char* address, const char* protocol){
+
+static int connect_client(struct per_vhost_data__minimal* vhd, const char* address, int port, const char* protocol){
   vhd->i.context=vhd->context;
-  vhd->i.port=9000;
+  vhd->i.port=port;
   vhd->i.address=address;
   vhd->i.path="/client";
   vhd->i.host=vhd->i.address;
@@ -113,7 +521,8 @@ static int callback_send_comm(struct lws *wsi,
 			      void *in, size_t len){
 
   struct per_vhost_data__minimal *vhd=(struct per_vhost_data__minimal*) lws_protocol_vh_priv_get(lws_get_vhost(wsi),lws_get_protocol(wsi));
-  struct msg pmsg;
+  rrc_control_t control;
+  rrc_echo_t echo;
 
   switch (reason) {
 
@@ -128,7 +537,15 @@ static int callback_send_comm(struct lws *wsi,
     vhd->protocol=lws_get_protocol(wsi);
     vhd->vhost=lws_get_vhost(wsi);
 
-    if (connect_client(vhd, address, "exec_commands")){
+    /* lws closes what it adopts, it gets a duplicate */
+    lws_sock_file_fd_type fd;
+    fd.filefd=dup(joy_event_fd);
+    joy_event_wsi=lws_adopt_descriptor_vhost(vhd->vhost, LWS_ADOPT_RAW_FILE_DESC, fd, "exec_commands", NULL);
+    if(!joy_event_wsi){
+      lwsl_err("[cmd_service] cannot adopt the joystick eventfd\n");
+      return 1;
+    }
+    if (connect_client(vhd, address, control_port, "exec_commands")){
       lws_timed_callback_vh_protocol(vhd->vhost, vhd->protocol, LWS_CALLBACK_USER, 1);
     }
     printf("[cmd_service] Protocol initialized\n");
@@ -138,6 +555,11 @@ static int callback_send_comm(struct lws *wsi,
     vhd->finished=1;
     break;
 
+  case LWS_CALLBACK_RAW_CLOSE_FILE:
+    if(wsi==joy_event_wsi)
+      joy_event_wsi=NULL;
+    break;
+
   case LWS_CALLBACK_CLIENT_CONNECTION_ERROR:
     lwsl_err("CLIENT_CONNECTION_ERROR: %s\n", in ? (char *)in : "(null)");
     vhd->client_wsi=NULL;
@@ -148,25 +570,86 @@ static int callback_send_comm(struct lws *wsi,
   case LWS_CALLBACK_CLIENT_ESTABLISHED:
     printf("[ws_service] Connect with server success.\n");
     vhd->established=1;
+    /* the host starts from the current state */
     lws_callback_on_writable(vhd->client_wsi);
     break;
 
+  case LWS_CALLBACK_RAW_RX_FILE:
+    /* joyThread signalled: send if the state changed since the last message */
+    if(wsi!=joy_event_wsi)
+      break;
+    uint64_t events;
+    if(read(joy_event_fd, &events, sizeof(events))!=sizeof(events))
+      break;
+    if(!vhd->established || !vhd->client_wsi)
+      break;
+    pthread_mutex_lock(&joy_state.lock);
+    uint32_t version=joy_state.version;
+    pthread_mutex_unlock(&joy_state.lock);
+    if(version!=vhd->sent_version)
+      lws_callback_on_writable(vhd->client_wsi);
+    break;
+
+  case LWS_CALLBACK_TIMER:
+    /* nothing changed for a keepalive period */
+    if(vhd->client_wsi)
+      lws_callback_on_writable(vhd->client_wsi);
+    break;
+
   case LWS_CALLBACK_CLIENT_WRITEABLE:
     if(wsi == NULL)
       return -1;
     int n;
-    int len = sizeof(JoyPacket);
-    pmsg.payload = malloc(LWS_PRE+len);
-    /* setup the buffer*/
-    memcpy (pmsg.payload+LWS_PRE, ic, sizeof(JoyPacket));
+    memset(&control, 0, sizeof(control));
+    pthread_mutex_lock(&joy_state.lock);
+    control.num_axes=joy_state.num_axes;
+    control.buttons=joy_state.buttons;
+    memcpy(control.axes, joy_state.axes, sizeof(control.axes));
+    vhd->sent_version=joy_state.version;
+    pthread_mutex_unlock(&joy_state.lock);
+    control.seq=++command_seq;
+    control.client_stamp_us=command_now_us();
+    int len=rrc_control_encode(command_buf+LWS_PRE, &control);
     /* write out*/
-    n=lws_write(vhd->client_wsi, pmsg.payload+LWS_PRE, sizeof(JoyPacket), LWS_WRITE_BINARY);
+    n=lws_write(vhd->client_wsi, command_buf+LWS_PRE, len, LWS_WRITE_BINARY);
     if(n < len){
       lwsl_err("ERROR %d writing to ws socket\n", n);
       return -1;
     }
-    free(pmsg.payload);
-    lws_callback_on_writable(vhd->client_wsi);
+    ++sent_messages;
+    sent_bytes+=len;
+    uint64_t sent_at=command_now_us();
+    if(sent_at-last_send_report>=STATS_PERIOD_US){
+      float seconds=(sent_at-last_send_report)*1e-6f;
+      if(last_send_report)
+	lwsl_user("[cmd_service] %.1f messages/s, %.0f bytes/s\n",
+		  sent_messages/seconds, sent_bytes/seconds);
+      sent_messages=0;
+      sent_bytes=0;
+      last_send_report=sent_at;
+    }
+    if(send_always)
+      lws_callback_on_writable(vhd->client_wsi);
+    else if(keepalive_hz>0)
+      /* rearmed at each message, fires only if nothing changes */
+      lws_set_timer_usecs(vhd->client_wsi, 1000000/keepalive_hz);
+    break;
+
+  case LWS_CALLBACK_CLIENT_RECEIVE:
+    /* echo of a control message: round trip */
+    if(rrc_echo_decode(&echo, in, len))
+      break;
+    uint64_t now=command_now_us();
+    latency_stats_add(&command_rtt, now-echo.client_stamp_us);
+    if(echo.status!=RrcAccepted)
+      ++command_rejected;
+    if(now-last_rtt_report>=STATS_PERIOD_US){
+      char stats[128];
+      latency_stats_format(&command_rtt, stats, sizeof(stats));
+      lwsl_user("[cmd_service] command rtt %s, %u rejected\n", stats, command_rejected);
+      command_rejected=0;
+      last_rtt_report=now;
+    }
     break;
 
   case LWS_CALLBACK_CLOSED:
@@ -183,13 +666,36 @@ static int callback_send_comm(struct lws *wsi,
   return 0;
 }
 
+/* service loop: a pong came in, t0 and t3 on our clock, t1 and t2 on the host's */
+static void clock_sync_update(const rrc_clock_t* pong, uint64_t received_us){
+  ClockSync* cs=&clock_sync;
+  int64_t host_hold=pong->host_send_us-pong->host_receive_us;
+  int64_t rtt=(int64_t)(received_us-pong->client_send_us)-host_hold;
+  if(rtt<0)
+    rtt=0;
+  cs->offsets[cs->next]=((int64_t)(pong->host_receive_us-pong->client_send_us)
+			 +(int64_t)(pong->host_send_us-received_us))/2;
+  cs->rtts[cs->next]=rtt;
+  cs->next=(cs->next+1)%CLOCK_SAMPLES;
+  if(cs->count<CLOCK_SAMPLES)
+    ++cs->count;
+  int best=0;
+  for(int i=1; i<cs->count; ++i)
+    if(cs->rtts[i]<cs->rtts[best])
+      best=i;
+  __atomic_store_n(&cs->offset, cs->offsets[best], __ATOMIC_RELAXED);
+  __atomic_store_n(&cs->valid, 1, __ATOMIC_RELEASE);
+}
+
 /* callback function that is triggered when a frame is coming from websocket.
-   Through the function show_frame the image on host's camera is shown */
+   The complete frames go to the render thread, that shows the image of host's camera */
 static int callback_rcv_cam(struct lws *wsi,
 			    enum lws_callback_reasons reason, void *user,
 			    void *in, size_t len){
   struct per_vhost_data__minimal *vhd=(struct per_vhost_data__minimal*) lws_protocol_vh_priv_get(lws_get_vhost(wsi),lws_get_protocol(wsi));
   unsigned char *frame;
+  rrc_camera_mode_t mode;
+  rrc_stream_options_t options;
   switch (reason) {
 
     /* --- protocol lifecycle callbacks --- */
@@ -202,7 +708,7 @@ static int callback_rcv_cam(struct lws *wsi,
     vhd->protocol=lws_get_protocol(wsi);
     vhd->vhost=lws_get_vhost(wsi);
 
-    if (connect_client(vhd, address, "cam_protocol")){
+    if (connect_client(vhd, address, port, "cam_protocol")){
       lws_timed_callback_vh_protocol(vhd->vhost, vhd->protocol, LWS_CALLBACK_USER, 1);
     }
     printf("[cam_service] Protocol initialized\n");
@@ -223,11 +729,98 @@ static int callback_rcv_cam(struct lws *wsi,
   case LWS_CALLBACK_CLIENT_ESTABLISHED:
     printf("[cam_service] Connect with server success.\n");
     vhd->established=1;
+    /* a new session starts in color jpeg, full resolution */
+    pthread_mutex_lock(&cam_request_lock);
+    stream_options_pending=stream_options.flags!=0 || stream_options.codec!=RRC_CODEC_JPEG
+      || stream_options.layer!=RRC_LAYER_FULL;
+    pthread_mutex_unlock(&cam_request_lock);
+    /* the clocks are measured right away, then periodically */
+    clock_sync.ping_pending=1;
+    lws_callback_on_writable(wsi);
+    lws_set_timer_usecs(wsi, CLOCK_PING_PERIOD_US);
+    break;
+
+  case LWS_CALLBACK_TIMER:
+    clock_sync.ping_pending=1;
+    lws_callback_on_writable(wsi);
+    lws_set_timer_usecs(wsi, CLOCK_PING_PERIOD_US);
+    break;
+
+  case LWS_CALLBACK_EVENT_WAIT_CANCELLED:
+    /* the render thread asked for a camera mode */
+    if(vhd && vhd->established && vhd->client_wsi && (cam_request_pending || stream_options_pending))
+      lws_callback_on_writable(vhd->client_wsi);
+    break;
+
+  case LWS_CALLBACK_CLIENT_WRITEABLE:
+    if(take_stream_options(&options)){
+      rrc_stream_options_encode(stream_options_buf+LWS_PRE, &options);
+      if(lws_write(wsi, stream_options_buf+LWS_PRE, RRC_STREAM_OPTIONS_SIZE, LWS_WRITE_BINARY)<RRC_STREAM_OPTIONS_SIZE){
+	lwsl_err("ERROR writing to ws socket\n");
+	return -1;
+      }
+      lws_callback_on_writable(wsi);
+      break;
+    }
+    if(take_cam_request(&mode)){
+      rrc_camera_mode_encode(cam_mode_buf+LWS_PRE, &mode);
+      if(lws_write(wsi, cam_mode_buf+LWS_PRE, RRC_CAMERA_MODE_SIZE, LWS_WRITE_BINARY)<RRC_CAMERA_MODE_SIZE){
+	lwsl_err("ERROR writing to ws socket\n");
+	return -1;
+      }
+      if(clock_sync.ping_pending)
+	lws_callback_on_writable(wsi);
+      break;
+    }
+    if(!clock_sync.ping_pending)
+      break;
+    rrc_clock_t ping={
+      .seq=++clock_sync.ping_seq,
+      .client_send_us=command_now_us()
+    };
+    rrc_clock_ping_encode(clock_buf+LWS_PRE, &ping);
+    clock_sync.ping_pending=0;
+    if(lws_write(wsi, clock_buf+LWS_PRE, RRC_CLOCK_PING_SIZE, LWS_WRITE_BINARY)<RRC_CLOCK_PING_SIZE){
+      lwsl_err("ERROR writing to ws socket\n");
+      return -1;
+    }
     break;
 
   case LWS_CALLBACK_CLIENT_RECEIVE:
     frame = (unsigned char*) in;
-    show_frame(frame, len);
+    /* pongs, camera states and jpeg tables are never fragmented and never inside a frame */
+    if (lws_is_first_fragment(wsi) && lws_is_final_fragment(wsi)
+	&& rrc_message_type(frame, len)==RRC_MSG_CLOCK_PONG){
+      rrc_clock_t pong;
+      if (!rrc_clock_pong_decode(&pong, frame, len))
+	clock_sync_update(&pong, command_now_us());
+      break;
+    }
+    if (lws_is_first_fragment(wsi) && lws_is_final_fragment(wsi)
+	&& rrc_message_type(frame, len)==RRC_MSG_CAMERA_STATE){
+      if (!rrc_camera_state_decode(&mode, frame, len))
+	lwsl_user("[cam_service] camera %ux%u, %u fps, exposure %u%s\n",
+		  mode.width, mode.height, mode.fps, mode.exposure,
+		  mode.exposure ? "" : " (auto)");
+      break;
+    }
+    if (lws_is_first_fragment(wsi) && lws_is_final_fragment(wsi)
+	&& rrc_message_type(frame, len)==RRC_MSG_JPEG_TABLES){
+      store_jpeg_tables(frame, len);
+      break;
+    }
+    if (lws_is_first_fragment(wsi))
+      receiving.size = 0;
+    if (receiving.size+len > receiving.capacity){
+      receiving.capacity = 2*(receiving.size+len);
+      receiving.data = realloc(receiving.data, receiving.capacity);
+    }
+    memcpy(receiving.data+receiving.size, frame, len);
+    receiving.size += len;
+    if (lws_is_final_fragment(wsi)){
+      receiving.received_us = command_now_us();
+      publish_frame();
+    }
     break;
 
   case LWS_CALLBACK_CLOSED:
@@ -244,38 +837,146 @@ static int callback_rcv_cam(struct lws *wsi,
   return 0;
 }
 
-/* thread's function that reads every 1 ms the input from joypad */
-void* joyThread(void* args_){
+/* applies a burst of events to the state, returns 1 if something changed */
+static int joy_apply(const struct js_event* events, int count){
+  int changed=0;
+  pthread_mutex_lock(&joy_state.lock);
+  for(int i=0; i<count; ++i){
+    const struct js_event* e=events+i;
+    uint8_t type=e->type & ~JS_EVENT_INIT;
+    if(type==JS_EVENT_AXIS && e->number<RRC_MAX_AXES){
+      changed|=joy_state.axes[e->number]!=e->value || e->number>=joy_state.num_axes;
+      joy_state.axes[e->number]=e->value;
+      if(e->number>=joy_state.num_axes)
+	joy_state.num_axes=e->number+1;
+    }
+    else if(type==JS_EVENT_BUTTON && e->number<32){
+      uint32_t buttons=joy_state.buttons;
+      if(e->value)
+	joy_state.buttons|=1u<<e->number;
+      else
+	joy_state.buttons&=~(1u<<e->number);
+      changed|=buttons!=joy_state.buttons;
+    }
+  }
+  if(changed)
+    ++joy_state.version;
+  pthread_mutex_unlock(&joy_state.lock);
+  return changed;
+}
 
-  char* dev=(char*) args_;
-  struct js_event e;
-  
-  ic->axis=0;
-  ic->value=0;
-  ic->type=0;
+/* the device went away: everything released, so that the robot stops */
+static void joy_reset(void){
+  pthread_mutex_lock(&joy_state.lock);
+  memset(joy_state.axes, 0, sizeof(joy_state.axes));
+  joy_state.buttons=0;
+  ++joy_state.version;
+  pthread_mutex_unlock(&joy_state.lock);
+}
 
-  int fd=open(dev, O_RDONLY|O_NONBLOCK);
+/* wakes the service loop, that sends the new state */
+static void joy_notify(void){
+  uint64_t one=1;
+  if(write(joy_event_fd, &one, sizeof(one))!=sizeof(one))
+    lwsl_err("[joy_thread] cannot signal the service loop\n");
+}
 
-  while(fd < 0){
-    printf("[joy_thread] no dev_input found on %s\nRetrying in 2 seconds...\n(press CTRL-C to abort)", dev);
-    sleep(2);
+/* opens the device, waiting for it to be plugged in if it is not there */
+static int joy_open(const char* dev, int inotify_fd){
+  int warned=0;
+  while(!interrupted){
+    int fd=open(dev, O_RDONLY|O_NONBLOCK);
+    if(fd>=0)
+      return fd;
+    if(!warned){
+      printf("[joy_thread] no dev_input found on %s, waiting for it\n(press CTRL-C to abort)\n", dev);
+      warned=1;
+    }
+    /* a new node in the device directory, or retry now and then */
+    struct pollfd pfd={ .fd=inotify_fd, .events=POLLIN };
+    if(poll(&pfd, inotify_fd>=0 ? 1 : 0, JOY_REOPEN_MS)>0){
+      char buf[4096];
+      if(read(inotify_fd, buf, sizeof(buf))<0)
+	lwsl_err("[joy_thread] inotify read failed\n");
+    }
   }
+  return -1;
+}
 
-  printf("[joy_thread] dev_input opened\n");
+/* reads the joystick when it has events: all the events queued at each
+   wake up make a single state update and a single notification */
+void* joyThread(void* args_){
+
+  char* dev=(char*) args_;
+  struct js_event events[JOY_EVENTS_PER_READ];
+
+  /* hot plug: watch the directory of the device for new nodes */
+  char dir[PATH_MAX];
+  strncpy(dir, dev, sizeof(dir)-1);
+  dir[sizeof(dir)-1]=0;
+  int inotify_fd=inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+  if(inotify_fd>=0 && inotify_add_watch(inotify_fd, dirname(dir), IN_CREATE|IN_ATTRIB)<0){
+    close(inotify_fd);
+    inotify_fd=-1;
+  }
 
   while(!interrupted){
-    if(read(fd, &e, sizeof(e)) > 0){
-      fflush(stdout);
-      ic->axis=e.number;
-      ic->value=e.value;
-      ic->type=e.type;
+    int fd=joy_open(dev, inotify_fd);
+    if(fd<0)
+      break;
+    printf("[joy_thread] dev_input opened\n");
+
+    while(!interrupted){
+      struct pollfd pfd={ .fd=fd, .events=POLLIN };
+      int n=poll(&pfd, 1, JOY_POLL_MS);
+      if(n<=0)
+	continue;
+      if(pfd.revents & (POLLERR|POLLHUP|POLLNVAL))
+	break;
+      int changed=0;
+      ssize_t size;
+      while((size=read(fd, events, sizeof(events)))>0)
+	changed|=joy_apply(events, size/sizeof(struct js_event));
+      if(changed)
+	joy_notify();
+      /* ENODEV when it is unplugged */
+      if(size<0 && errno!=EAGAIN && errno!=EINTR)
+	break;
+    }
+    close(fd);
+    if(!interrupted){
+      printf("[joy_thread] dev_input lost\n");
+      joy_reset();
+      joy_notify();
     }
   }
-  close(fd);
+  if(inotify_fd>=0)
+    close(inotify_fd);
   printf("[joy_thread] dev_input closed\n");
   return 0;
 }
 
+/* stands in for the joystick in unattended runs: the drive axes follow two
+   slow sine waves, so that every step is a change that gets sent */
+void* joyScriptThread(void* args_){
+  int hz=*(int*) args_;
+  uint64_t start=command_now_us();
+  printf("[joy_thread] scripted joystick, %d changes/s\n", hz);
+  while(!interrupted){
+    usleep(1000000/hz);
+    float t=(command_now_us()-start)*1e-6f;
+    struct js_event events[2]={
+      { .type=JS_EVENT_AXIS, .number=SCRIPT_TV_AXIS, .value=(int16_t)(16000*sinf(t*M_PI/2)) },
+      { .type=JS_EVENT_AXIS, .number=SCRIPT_RV_AXIS, .value=(int16_t)(8000*sinf(t*M_PI/3)) }
+    };
+    if(joy_apply(events, 2))
+      joy_notify();
+  }
+  joy_reset();
+  printf("[joy_thread] scripted joystick stopped\n");
+  return 0;
+}
+
 static void sigint_handler(int sig)
 {
   interrupted = 1;
@@ -283,6 +984,7 @@ static void sigint_handler(int sig)
 
 int main(int argc, char** argv){
   pthread_t joy_thread;
+  pthread_t render_thread;
   char* dev = default_joy_dev;
   int c = 1;
   signal(SIGINT, sigint_handler);
@@ -295,20 +997,115 @@ int main(int argc, char** argv){
       c++;
       dev = argv[c];
     }
+    else if(!strcmp(argv[c], "-port")){
+      c++;
+      port = atoi(argv[c]);
+    }
+    else if(!strcmp(argv[c], "-control-port")){
+      c++;
+      control_port = atoi(argv[c]);
+    }
+    else if(!strcmp(argv[c], "-keepalive-hz")){
+      c++;
+      keepalive_hz = atoi(argv[c]);
+    }
+    else if(!strcmp(argv[c], "-send-always")){
+      send_always = 1;
+    }
+    else if(!strcmp(argv[c], "-headless")){
+      headless = 1;
+    }
+    else if(!strcmp(argv[c], "-scripted-joy")){
+      c++;
+      scripted_joy_hz = atoi(argv[c]);
+    }
+    else if(!strcmp(argv[c], "-cam-mode")){
+      c++;
+      unsigned width, height, fps;
+      int n=sscanf(argv[c], "%ux%u@%u", &width, &height, &fps);
+      if(n<2){
+	printf("-cam-mode wants WxH or WxH@fps\n");
+	return -1;
+      }
+      rrc_camera_mode_t mode={
+	.flags=RRC_CAMERA_SIZE | (n==3 ? RRC_CAMERA_FPS : 0),
+	.width=width,
+	.height=height,
+	.fps=n==3 ? fps : 0
+      };
+      request_cam_mode(&mode);
+    }
+    else if(!strcmp(argv[c], "-exposure")){
+      c++;
+      rrc_camera_mode_t mode={ .flags=RRC_CAMERA_EXPOSURE, .exposure=atoi(argv[c]) };
+      request_cam_mode(&mode);
+    }
+    else if(!strcmp(argv[c], "-gray")){
+      stream_options.flags=RRC_STREAM_GRAY;
+    }
+    else if(!strcmp(argv[c], "-codec")){
+      c++;
+      if(!strcmp(argv[c], "jpeg"))
+	stream_options.codec=RRC_CODEC_JPEG;
+      else if(!strcmp(argv[c], "vp8"))
+	stream_options.codec=RRC_CODEC_VP8;
+      else{
+	printf("-codec wants jpeg or vp8\n");
+	return -1;
+      }
+    }
+    else if(!strcmp(argv[c], "-layer")){
+      c++;
+      if(!strcmp(argv[c], "full"))
+	stream_options.layer=RRC_LAYER_FULL;
+      else if(!strcmp(argv[c], "half"))
+	stream_options.layer=RRC_LAYER_HALF;
+      else if(!strcmp(argv[c], "quarter"))
+	stream_options.layer=RRC_LAYER_QUARTER;
+      else{
+	printf("-layer wants full, half or quarter\n");
+	return -1;
+      }
+    }
     else if(!strcmp(argv[c], "-help")){
       printBanner();
       return 0;
     }
+    c++;
   }
 
   printf("running with parameters\n");
-  printf(" address: %s\n", address);
-  printf(" input_device: %s\n", dev);
+  printf(" address: %s (video %d, commands %d)\n", address, port, control_port);
+  if(scripted_joy_hz > 0)
+    printf(" input_device: scripted, %d Hz\n", scripted_joy_hz);
+  else
+    printf(" input_device: %s\n", dev);
+  if(headless)
+    printf(" headless\n");
+  if(stream_options.flags & RRC_STREAM_GRAY)
+    printf(" grayscale video\n");
+  if(stream_options.codec!=RRC_CODEC_JPEG)
+    printf(" codec: %s\n", video_codec_name(stream_options.codec));
+  if(stream_options.layer!=RRC_LAYER_FULL)
+    printf(" layer: 1/%d resolution\n", 1<<stream_options.layer);
+  if(send_always)
+    printf(" sending at every writeable\n");
+  else
+    printf(" sending on change, keepalive %d Hz\n", keepalive_hz);
 
-  ic = malloc(sizeof(JoyPacket));
+  latency_stats_init(&command_rtt);
+  joy_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (joy_event_fd < 0){
+    printf("[Main] cannot create the joystick eventfd\n");
+    return -1;
+  }
   pthread_attr_t attr;
   pthread_attr_init(&attr);
-  pthread_create(&joy_thread, &attr, joyThread, dev);
+  if(scripted_joy_hz > 0)
+    pthread_create(&joy_thread, &attr, joyScriptThread, &scripted_joy_hz);
+  else
+    pthread_create(&joy_thread, &attr, joyThread, dev);
+  pthread_create(&render_thread, &attr, renderThread, NULL);
 
   struct lws_context_creation_info info;
   struct lws_context *context;
@@ -336,6 +1133,7 @@ int main(int argc, char** argv){
 
   context=lws_create_context(&info);
   printf("[Main] context created\n");
+  ws_context=context;
 
   int n = 0;
   if (context==NULL){
@@ -347,10 +1145,18 @@ int main(int argc, char** argv){
     n = lws_service(context, 10);
   }
 
+  ws_context=NULL;
   lws_context_destroy(context);
   void* arg;
   pthread_join(joy_thread, &arg);
-  free(ic);
+  close(joy_event_fd);
+  pthread_mutex_lock(&render_lock);
+  pthread_cond_signal(&render_cond);
+  pthread_mutex_unlock(&render_lock);
+  pthread_join(render_thread, &arg);
+  free(receiving.data);
+  for(int i=0; i<PENDING_FRAMES; ++i)
+    free(pending[i].data);
   printf("[Main] Terminated\n");
   return 0;
 }
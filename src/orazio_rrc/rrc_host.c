@@ -10,8 +10,11 @@
 #include "orazio_client.h"
 #include "orazio_print_packet.h"
 #include "orazio_client_test_getkey.h"
+#include "capture_camera_mod.h"
+#include "command_mailbox.h"
 
 #define NUM_JOINTS 2
+#define EPOCH_STATS_PERIOD_US 5000000
 
 typedef enum{
   System = 0,
@@ -23,7 +26,7 @@ typedef enum{
   Stop = -2,
 }Mode;
 
-Mode mode = Start;
+volatile Mode mode = Start;
 static struct OrazioClient *client = 0;
 
 const char *banner[]={
@@ -31,10 +34,32 @@ const char *banner[]={
   "generaized host for remote_robot_controller",
   "usage:"
   "$> rrc_host <parameters>",
-  "starts a host that accept connections from localhost:9000",
+  "starts a host that accept connections from localhost:9000 (video)",
+  "and localhost:9001 (commands)",
   "parameters: ",
   "-serial-dev <string>: the serial device (default /dev/ttyACM0)",
   "-cam        <string>: the camera which streams(default /dev/video0)",
+  "                      synthetic[:WxH][@fps] for a test pattern,",
+  "                      yuyv:<file>[:WxH][@fps] to play a raw YUYV recording",
+  "-width         <int>: camera width at start (default 320), viewers can change it",
+  "-height        <int>: camera height at start (default 240)",
+  "-fps           <int>: camera frame rate (default: the driver's)",
+  "-exposure      <int>: exposure time in 100us units, 0 automatic at a steady frame rate",
+  "-jpeg-workers  <int>: threads encoding each frame in strips (default 1)",
+  "-full-jpegs        : every frame carries its jpeg tables (they are sent once per quality)",
+  "-optimize-coding   : huffman tables fitted to each frame, smaller and slower",
+  "-hugepages         : back the frame pool with huge pages",
+  "-mlock             : lock the frame pool in ram",
+  "-frame-bytes   <int>: target size of a video frame (default 3072)",
+  "-bitrate       <int>: target video bitrate in bit/s, overrides -frame-bytes",
+  "-downscale         : let the rate control halve the resolution",
+  "-gray              : viewers start with the grayscale stream (they can switch)",
+  "-motion-threshold <int>: mean luma change of a 32x32 block that makes a new frame",
+  "                      worth sending (default 6, 0 sends all the frames)",
+  "-motion-refresh-ms <int>: a frame is sent at least this often (default 1000)",
+  "-control-port  <int>: port of the command server (default 9001)",
+  "-service-threads <int>: threads writing the video to the viewers (default 1)",
+  "-no-keyboard       : no arrow keys control, for running unattended (stop with CTRL-C)",
   0
 };
 
@@ -61,7 +86,12 @@ void stopRobot(void){
   OrazioClient_sendPacket(client, (PacketHeader *)&drive_control, 0);
 }
 
+// velocity commands, one mailbox per writer thread
+static command_mailbox_t ws_commands;
+static command_mailbox_t key_commands;
+
 void* keyThread(void* arg){
+  float tv=0, rv=0;
   setConioTerminalMode();
   while(mode!=Stop) {
     KeyCode key_code=getKey();
@@ -70,20 +100,20 @@ void* keyThread(void* arg){
       mode=Stop;
       break;
     case KeyArrowUp:
-      drive_control.translational_velocity+=0.1;
-      drive_control.header.seq=1;
+      tv+=0.1;
+      command_mailbox_post(&key_commands, tv, rv, command_now_us());
       break;
     case KeyArrowDown:
-      drive_control.translational_velocity-=0.1;
-      drive_control.header.seq=1;
+      tv-=0.1;
+      command_mailbox_post(&key_commands, tv, rv, command_now_us());
       break;
     case KeyArrowRight:
-      drive_control.rotational_velocity-=0.1;
-      drive_control.header.seq=1;
+      rv-=0.1;
+      command_mailbox_post(&key_commands, tv, rv, command_now_us());
       break;
     case KeyArrowLeft:
-      drive_control.rotational_velocity+=0.1;
-      drive_control.header.seq=1;
+      rv+=0.1;
+      command_mailbox_post(&key_commands, tv, rv, command_now_us());
       break;
     case KeyS:
       mode=System;
@@ -101,13 +131,43 @@ void* keyThread(void* arg){
       mode=None;
       break;
     default:
-      stopRobot();
+      tv=0;
+      rv=0;
+      command_mailbox_post(&key_commands, tv, rv, command_now_us());
     }
   }
   resetTerminalMode();
   return 0;
 };
 
+/* epoch callback: applies the newest command posted since the last epoch,
+   the client sends it right away */
+static void applyCommands(struct OrazioClient* cl, void* args){
+  struct OrazioWSContext* ctx=(struct OrazioWSContext*) args;
+  static uint32_t ws_seq=0, key_seq=0;
+  command_t ws_command, key_command;
+  int from_ws=command_mailbox_poll(&ws_commands, &ws_seq, &ws_command);
+  int from_key=command_mailbox_poll(&key_commands, &key_seq, &key_command);
+  if(from_ws && from_key){
+    if(key_command.stamp_us > ws_command.stamp_us)
+      from_ws=0;
+    else
+      from_key=0;
+  }
+  if(from_ws){
+    OrazioClient_setBaseVelocityAt(cl, ws_command.translational_velocity, ws_command.rotational_velocity,
+				   ws_command.stamp_us);
+    OrazioWebsocketServer_commandApplied(ctx, &ws_command);
+  }
+  else if(from_key)
+    OrazioClient_setBaseVelocityAt(cl, key_command.translational_velocity, key_command.rotational_velocity,
+				   key_command.stamp_us);
+}
+
+static void sigint_handler(int sig){
+  mode = Stop;
+}
+
 char* default_serial_device = "/dev/ttyACM0";
 char* default_cam = "/dev/video0";
 
@@ -115,7 +175,13 @@ int main(int argc, char** argv){
   int c = 1;
   char* serial_device = default_serial_device;
   char* cam = default_cam;
-  while(c < argc-1){
+  int jpeg_workers = 1;
+  int jpeg_coding = JPEG_ABBREVIATED;
+  int pool_flags = 0;
+  int keyboard = 1;
+  OrazioWSParams ws_params;
+  OrazioWebsocketServer_defaultParams(&ws_params);
+  while(c < argc){
     if(!strcmp(argv[c], "-serial-dev")){
       c++;
       serial_device = argv[c];
@@ -124,15 +190,86 @@ int main(int argc, char** argv){
       c++;
       cam = argv[c];
     }
+    else if(!strcmp(argv[c], "-width")){
+      c++;
+      ws_params.width = atoi(argv[c]);
+    }
+    else if(!strcmp(argv[c], "-height")){
+      c++;
+      ws_params.height = atoi(argv[c]);
+    }
+    else if(!strcmp(argv[c], "-fps")){
+      c++;
+      ws_params.fps = atoi(argv[c]);
+    }
+    else if(!strcmp(argv[c], "-exposure")){
+      c++;
+      ws_params.exposure = atoi(argv[c]);
+    }
+    else if(!strcmp(argv[c], "-jpeg-workers")){
+      c++;
+      jpeg_workers = atoi(argv[c]);
+    }
+    else if(!strcmp(argv[c], "-full-jpegs")){
+      jpeg_coding &= ~JPEG_ABBREVIATED;
+    }
+    else if(!strcmp(argv[c], "-optimize-coding")){
+      jpeg_coding |= JPEG_OPTIMIZE_CODING;
+    }
+    else if(!strcmp(argv[c], "-hugepages")){
+      pool_flags |= FRAME_POOL_HUGEPAGES;
+    }
+    else if(!strcmp(argv[c], "-mlock")){
+      pool_flags |= FRAME_POOL_MLOCK;
+    }
+    else if(!strcmp(argv[c], "-frame-bytes")){
+      c++;
+      ws_params.frame_bytes = atoi(argv[c]);
+    }
+    else if(!strcmp(argv[c], "-bitrate")){
+      c++;
+      ws_params.bitrate = atoi(argv[c]);
+    }
+    else if(!strcmp(argv[c], "-downscale")){
+      ws_params.downscale = 1;
+    }
+    else if(!strcmp(argv[c], "-gray")){
+      ws_params.gray = 1;
+    }
+    else if(!strcmp(argv[c], "-motion-threshold")){
+      c++;
+      ws_params.motion_threshold = atoi(argv[c]);
+    }
+    else if(!strcmp(argv[c], "-motion-refresh-ms")){
+      c++;
+      ws_params.motion_refresh_ms = atoi(argv[c]);
+    }
+    else if(!strcmp(argv[c], "-control-port")){
+      c++;
+      ws_params.control_port = atoi(argv[c]);
+    }
+    else if(!strcmp(argv[c], "-service-threads")){
+      c++;
+      ws_params.service_threads = atoi(argv[c]);
+    }
+    else if(!strcmp(argv[c], "-no-keyboard")){
+      keyboard = 0;
+    }
     else if(!strcmp(argv[c], "-help")){
       printBanner();
       return 0;
     }
+    c++;
   }
 
   printf("running with parameters\n");
   printf(" serial device: %s\n", serial_device);
-  printf(" camera: %s\n", cam);
+  printf(" camera: %s, %d x %d\n", cam, ws_params.width, ws_params.height);
+  printf(" jpeg workers: %d\n", jpeg_workers);
+  printf(" service threads: %d\n", ws_params.service_threads);
+  jpeg_set_workers(jpeg_workers);
+  jpeg_set_options(jpeg_coding);
+  camera_set_pool_flags(pool_flags);
 
   SystemStatusPacket system_status={
     .header.type=SYSTEM_STATUS_PACKET_ID,
@@ -192,28 +329,29 @@ int main(int argc, char** argv){
   OrazioClient_get(client, (PacketHeader*) &system_params);
 
   // 6. server thread to read joyinput
+  command_mailbox_init(&ws_commands);
+  command_mailbox_init(&key_commands);
+  signal(SIGINT, sigint_handler);
+  signal(SIGTERM, sigint_handler);
   pthread_t key_thread;
-  pthread_create(&key_thread, 0, keyThread, 0);
+  if(keyboard)
+    pthread_create(&key_thread, 0, keyThread, 0);
 
-  struct OrazioWSContext* ctx = OrazioWebsocketServer_start(client, 9000, NULL, 115200, cam, &drive_control);
+  struct OrazioWSContext* ctx = OrazioWebsocketServer_start(client, 9000, NULL, cam, &ws_commands, &ws_params);
   if(!ctx){
     fprintf(stderr,"error on creating server thread\n");
     exit(EXIT_FAILURE);
   }
+  OrazioClient_setEpochCallback(client, applyCommands, ctx);
+  uint64_t last_epoch_stats=command_now_us();
     
   Mode previous_mode=mode;
   /* 7. main loop:
-     -- send in output all controls
+     -- at each epoch the client picks up the last command and sends it
      -- sync
      -- get variables/status from orazioClient through Orazio_get*/
 
   while(mode!=Stop){
-    if(drive_control.header.seq){
-      int result = OrazioClient_sendPacket(client, (PacketHeader*)&drive_control, 0);
-      if(result) printf("error\n");
-      drive_control.header.seq=0;
-    }
-
     if(previous_mode!=mode){
       switch(mode){
       case System:
@@ -241,6 +379,14 @@ int main(int argc, char** argv){
 
     OrazioClient_sync(client,1);
 
+    uint64_t now=command_now_us();
+    if(now-last_epoch_stats>=EPOCH_STATS_PERIOD_US){
+      char stats_buf[512];
+      OrazioClient_printEpochStats(client, stats_buf, sizeof(stats_buf));
+      printf("\r\033[2K[Epoch] %s\n", stats_buf);
+      last_epoch_stats=now;
+    }
+
     char output_buf[1024];
     int pos=0;
     switch(mode){
@@ -264,11 +410,18 @@ int main(int argc, char** argv){
     default:;
     }
   }
-  void *retval;
-  pthread_join(key_thread,&retval);
+  if(keyboard){
+    /* stopped by a signal the thread still waits for a key */
+    void *retval;
+    pthread_cancel(key_thread);
+    pthread_join(key_thread,&retval);
+    resetTerminalMode();
+  }
   printf("Terminating\n");
+  OrazioClient_setEpochCallback(client, 0, 0);
   OrazioWebsocketServer_stop(ctx);
   printf("Stopping Robot");
+  OrazioClient_setBaseVelocity(client, 0, 0);
   stopRobot();
   for (int i=0; i<10;++i){
     printf(".");